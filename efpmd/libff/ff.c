@@ -157,6 +157,20 @@ ff_set_atom_xyz(struct ff *ff, int idx, const double *xyz)
 	atoms_.z[idx] = xyz[2] / ANGSTROM_TO_BOHR;
 }
 
+void
+ff_set_xyz(struct ff *ff, const double *xyz)
+{
+	int i;
+
+	(void)ff;
+
+	for (i = 0; i < atoms_.n; i++, xyz += 3) {
+		atoms_.x[i] = xyz[0] / ANGSTROM_TO_BOHR;
+		atoms_.y[i] = xyz[1] / ANGSTROM_TO_BOHR;
+		atoms_.z[i] = xyz[2] / ANGSTROM_TO_BOHR;
+	}
+}
+
 void
 ff_compute(struct ff *ff, int do_grad)
 {
@@ -168,7 +182,7 @@ ff_compute(struct ff *ff, int do_grad)
 		ff->energy = energy_();
 
 	if (do_grad)
-		for (i = 0; i < 3 * MAXATM; i++)
+		for (i = 0; i < 3 * atoms_.n; i++)
 			ff->grad[i] *= KCALMOL_TO_AU / ANGSTROM_TO_BOHR;
 
 	ff->energy *= KCALMOL_TO_AU;
@@ -186,6 +200,12 @@ ff_get_atom_gradient(struct ff *ff, int idx, double *grad)
 	memcpy(grad, ff->grad + 3 * idx, 3 * sizeof(double));
 }
 
+void
+ff_get_gradient(struct ff *ff, double *grad)
+{
+	memcpy(grad, ff->grad, 3 * atoms_.n * sizeof(double));
+}
+
 void
 ff_free(struct ff *ff)
 {
@@ -253,6 +273,13 @@ ff_set_atom_xyz(struct ff *ff, int idx, const double *xyz)
 	(void)xyz;
 }
 
+void
+ff_set_xyz(struct ff *ff, const double *xyz)
+{
+	(void)ff;
+	(void)xyz;
+}
+
 void
 ff_compute(struct ff *ff, int do_grad)
 {
@@ -276,6 +303,13 @@ ff_get_atom_gradient(struct ff *ff, int idx, double *xyz)
 	(void)xyz;
 }
 
+void
+ff_get_gradient(struct ff *ff, double *grad)
+{
+	(void)ff;
+	(void)grad;
+}
+
 void
 ff_free(struct ff *ff)
 {
@@ -36,9 +36,11 @@ int ff_load_parameters(struct ff *, const char *);
 int ff_get_atom_count(struct ff *);
 void ff_get_atom_xyz(struct ff *, int, double *);
 void ff_set_atom_xyz(struct ff *, int, const double *);
+void ff_set_xyz(struct ff *, const double *);
 void ff_compute(struct ff *, int);
 double ff_get_energy(struct ff *);
 void ff_get_atom_gradient(struct ff *, int, double *);
+void ff_get_gradient(struct ff *, double *);
 void ff_free(struct ff *);
 
 #endif /* LIBFF_FF_H */
@@ -61,6 +61,39 @@ void check_fail(enum efp_result res)
 		die("LIBEFP: %s", efp_result_to_string(res));
 }
 
+/* returns skip flags of all fragment pairs as an n_frags by n_frags array */
+char *save_skiplist(struct efp *efp)
+{
+	size_t n_frags;
+	char *skip;
+
+	check_fail(efp_get_frag_count(efp, &n_frags));
+	skip = xmalloc(n_frags * n_frags + 1);
+
+	for (size_t i = 0; i < n_frags; i++) {
+		for (size_t j = 0; j < n_frags; j++) {
+			int value;
+
+			check_fail(efp_get_skip_fragments(efp, i, j, &value));
+			skip[i * n_frags + j] = (char)value;
+		}
+	}
+
+	return skip;
+}
+
+void restore_skiplist(struct efp *efp, const char *skip)
+{
+	size_t n_frags;
+
+	check_fail(efp_get_frag_count(efp, &n_frags));
+
+	for (size_t i = 0; i < n_frags; i++)
+		for (size_t j = i + 1; j < n_frags; j++)
+			check_fail(efp_skip_fragments(efp, i, j,
+			    skip[i * n_frags + j]));
+}
+
 void *xmalloc(size_t size)
 {
 	void *mem = malloc(size);
@@ -158,6 +191,22 @@ void print_energy(struct state *state)
 	    energy.charge_penetration);
 	msg("\n");
 
+	struct efp_opts opts;
+	check_fail(efp_get_opts(state->efp, &opts));
+
+	if (opts.terms & EFP_TERM_POL &&
+	    opts.pol_driver != EFP_POL_DRIVER_DIRECT &&
+	    opts.pol_driver != EFP_POL_DRIVER_HODLR) {
+		size_t n_iter;
+		double residual;
+
+		check_fail(efp_get_pol_convergence(state->efp, &n_iter,
+		    &residual));
+		msg("%30s %16zu\n", "POLARIZATION ITERATIONS", n_iter);
+		msg("%30s %16.4le\n", "POLARIZATION RESIDUAL", residual);
+		msg("\n");
+	}
+
 	if (state->ff) {
 		msg("%30s %16.10lf\n", "FORCE-FIELD ENERGY",
 		    ff_get_energy(state->ff));
@@ -166,6 +215,44 @@ void print_energy(struct state *state)
 
 	msg("%30s %16.10lf\n", "TOTAL ENERGY", state->energy);
 	msg("\n\n");
+
+	if (state->pairwise)
+		print_pairwise(state);
+}
+
+void print_pairwise(struct state *state)
+{
+	struct efp_pair_iter iter = { 0, 0 };
+	struct efp_pair_energy pair;
+	size_t n_frags, n_pairs;
+	double *pol;
+	FILE *out = state->pairwise;
+
+	check_fail(efp_get_frag_count(state->efp, &n_frags));
+	check_fail(efp_get_pair_energy_count(state->efp, &n_pairs));
+
+	fprintf(out, "# %zu FRAGMENT PAIRS (ATOMIC UNITS)\n", n_pairs);
+	fprintf(out, "# %6s %8s %16s %16s %16s %16s\n", "FRAG_I", "FRAG_J",
+	    "ELECTROSTATIC", "CHARGE_PEN", "DISPERSION", "EXCH_REP");
+
+	while (efp_next_pair_energy(state->efp, &iter, &pair))
+		fprintf(out, "%8zu %8zu %16.10lf %16.10lf %16.10lf %16.10lf\n",
+		    pair.frag_i + 1, pair.frag_j + 1, pair.electrostatic,
+		    pair.charge_penetration, pair.dispersion,
+		    pair.exchange_repulsion);
+
+	pol = xmalloc(n_frags * sizeof(double));
+	check_fail(efp_get_frag_pol_energy(state->efp, pol));
+
+	fprintf(out, "# %zu FRAGMENTS (ATOMIC UNITS)\n", n_frags);
+	fprintf(out, "# %6s %16s\n", "FRAG", "POLARIZATION");
+
+	for (size_t i = 0; i < n_frags; i++)
+		fprintf(out, "%8zu %16.10lf\n", i + 1, pol[i]);
+
+	fprintf(out, "\n");
+	fflush(out);
+	free(pol);
 }
 
 void print_gradient(struct state *state)
@@ -96,6 +96,9 @@ struct state {
 	struct sys *sys;
 	double energy;
 	double *grad;
+	double *ff_xyz;
+	double *ff_grad;
+	FILE *pairwise;
 };
 
 void NORETURN die(const char *, ...);
@@ -109,13 +112,17 @@ void print_vec(const double *);
 void print_geometry(struct efp *);
 void print_energy(struct state *);
 void print_gradient(struct state *);
+void print_pairwise(struct state *);
 void print_fragment(const char *, const double *, const double *);
 void print_charge(double, double, double, double);
 void print_vector(size_t, const double *);
 void print_matrix(size_t, size_t, const double *);
 
 void check_fail(enum efp_result);
+char *save_skiplist(struct efp *);
+void restore_skiplist(struct efp *, const char *);
 void compute_energy(struct state *, bool);
+struct efp *create_efp(const struct cfg *, const struct sys *);
 struct sys *parse_input(struct cfg *, const char *);
 vec_t box_from_str(const char *);
 int efp_strcasecmp(const char *, const char *);
@@ -26,25 +26,105 @@
 
 #include "common.h"
 
-/* current coordinates from efp struct are used */
-void compute_energy(struct state *state, bool do_grad)
+/* fragment atom coordinates in the order of the force field atoms */
+static void get_ff_xyz(struct state *state, size_t nfrag)
 {
-	struct efp_atom *atoms;
-	struct efp_energy efp_energy;
-	double xyz[3], xyzabc[6], *grad;
-	size_t ifrag, nfrag, iatom, natom;
-	int itotal;
+	struct efp_atom *atoms = NULL;
+	size_t ifrag, iatom, natom;
+	double *xyz = state->ff_xyz;
+
+	for (ifrag = 0; ifrag < nfrag; ifrag++) {
+		check_fail(efp_get_frag_atom_count(state->efp, ifrag, &natom));
+		atoms = xrealloc(atoms, natom * sizeof(struct efp_atom));
+		check_fail(efp_get_frag_atoms(state->efp, ifrag, natom, atoms));
 
-	/* EFP part */
+		for (iatom = 0; iatom < natom; iatom++, xyz += 3) {
+			xyz[0] = atoms[iatom].x;
+			xyz[1] = atoms[iatom].y;
+			xyz[2] = atoms[iatom].z;
+		}
+	}
+
+	free(atoms);
+}
+
+static void compute_efp(struct state *state, bool do_grad, size_t nfrag)
+{
 	check_fail(efp_compute(state->efp, do_grad));
-	check_fail(efp_get_energy(state->efp, &efp_energy));
-	check_fail(efp_get_frag_count(state->efp, &nfrag));
 
 	if (do_grad) {
 		check_fail(efp_get_gradient(state->efp, state->grad));
 		check_fail(efp_get_point_charge_gradient(state->efp,
 		    state->grad + 6 * nfrag));
 	}
+}
+
+static void compute_ff(struct state *state, bool do_grad)
+{
+	ff_set_xyz(state->ff, state->ff_xyz);
+	ff_compute(state->ff, do_grad);
+
+	if (do_grad)
+		ff_get_gradient(state->ff, state->ff_grad);
+}
+
+/*
+ * EFP and MM parts are independent until their gradients are summed so the
+ * force field is evaluated on a separate thread while efp_compute runs with
+ * its own nested thread team. The calling thread does the EFP part to keep
+ * all MPI calls on it.
+ */
+static void compute_efp_ff(struct state *state, bool do_grad, size_t nfrag)
+{
+#ifdef _OPENMP
+	int levels = omp_get_max_active_levels();
+
+	if (omp_in_parallel()) {
+		compute_efp(state, do_grad, nfrag);
+		compute_ff(state, do_grad);
+		return;
+	}
+
+	if (levels < 2)
+		omp_set_max_active_levels(2);
+
+#pragma omp parallel num_threads(2)
+	{
+		if (omp_get_thread_num() == 0) {
+			compute_efp(state, do_grad, nfrag);
+
+			if (omp_get_num_threads() < 2)
+				compute_ff(state, do_grad);
+		} else {
+			compute_ff(state, do_grad);
+		}
+	}
+
+	omp_set_max_active_levels(levels);
+#else
+	compute_efp(state, do_grad, nfrag);
+	compute_ff(state, do_grad);
+#endif
+}
+
+/* current coordinates from efp struct are used */
+void compute_energy(struct state *state, bool do_grad)
+{
+	struct efp_energy efp_energy;
+	double xyzabc[6], *grad;
+	const double *xyz, *g;
+	size_t ifrag, nfrag, iatom, natom;
+
+	check_fail(efp_get_frag_count(state->efp, &nfrag));
+
+	if (state->ff) {
+		get_ff_xyz(state, nfrag);
+		compute_efp_ff(state, do_grad, nfrag);
+	} else {
+		compute_efp(state, do_grad, nfrag);
+	}
+
+	check_fail(efp_get_energy(state->efp, &efp_energy));
 
 	state->energy = efp_energy.total;
 
@@ -77,42 +157,26 @@ void compute_energy(struct state *state, bool do_grad)
 	if (state->ff == NULL)
 		return;
 
-	for (ifrag = 0, itotal = 0; ifrag < nfrag; ifrag++) {
-		check_fail(efp_get_frag_atom_count(state->efp, ifrag, &natom));
-		atoms = xmalloc(natom * sizeof(struct efp_atom));
-		check_fail(efp_get_frag_atoms(state->efp, ifrag, natom, atoms));
-
-		for (iatom = 0; iatom < natom; iatom++, itotal++)
-			ff_set_atom_xyz(state->ff, itotal, &atoms[iatom].x);
-
-		free(atoms);
-	}
-
-	ff_compute(state->ff, do_grad);
-
 	if (do_grad) {
-		for (ifrag = 0, itotal = 0, grad = state->grad; ifrag < nfrag; ifrag++, grad += 6) {
+		xyz = state->ff_xyz;
+		g = state->ff_grad;
+
+		for (ifrag = 0, grad = state->grad; ifrag < nfrag; ifrag++, grad += 6) {
 			check_fail(efp_get_frag_xyzabc(state->efp, ifrag, xyzabc));
 			check_fail(efp_get_frag_atom_count(state->efp, ifrag, &natom));
-			atoms = xmalloc(natom * sizeof(struct efp_atom));
-			check_fail(efp_get_frag_atoms(state->efp, ifrag, natom, atoms));
-
-			for (iatom = 0; iatom < natom; iatom++, itotal++) {
-				ff_get_atom_gradient(state->ff, itotal, xyz);
-
-				grad[0] += xyz[0];
-				grad[1] += xyz[1];
-				grad[2] += xyz[2];
-
-				grad[3] += (atoms[iatom].y - xyzabc[1]) * xyz[2] -
-					   (atoms[iatom].z - xyzabc[2]) * xyz[1];
-				grad[4] += (atoms[iatom].z - xyzabc[2]) * xyz[0] -
-					   (atoms[iatom].x - xyzabc[0]) * xyz[2];
-				grad[5] += (atoms[iatom].x - xyzabc[0]) * xyz[1] -
-					   (atoms[iatom].y - xyzabc[1]) * xyz[0];
-			}
 
-			free(atoms);
+			for (iatom = 0; iatom < natom; iatom++, xyz += 3, g += 3) {
+				grad[0] += g[0];
+				grad[1] += g[1];
+				grad[2] += g[2];
+
+				grad[3] += (xyz[1] - xyzabc[1]) * g[2] -
+					   (xyz[2] - xyzabc[2]) * g[1];
+				grad[4] += (xyz[2] - xyzabc[2]) * g[0] -
+					   (xyz[0] - xyzabc[0]) * g[2];
+				grad[5] += (xyz[0] - xyzabc[0]) * g[1] -
+					   (xyz[1] - xyzabc[1]) * g[0];
+			}
 		}
 	}
 
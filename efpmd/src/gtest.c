@@ -24,10 +24,38 @@
  * SUCH DAMAGE.
  */
 
+#include <stdint.h>
+
 #include "common.h"
 
 void sim_gtest(struct state *state);
 
+#define N_TERMS 4
+
+/* energy terms for which separate gradient errors are reported */
+static const struct {
+	const char *name;
+	unsigned terms;
+} gtest_terms[N_TERMS] = {
+	{ "ELECTROSTATIC", EFP_TERM_ELEC | EFP_TERM_AI_ELEC },
+	{ "POLARIZATION", EFP_TERM_POL | EFP_TERM_AI_POL },
+	{ "DISPERSION", EFP_TERM_DISP | EFP_TERM_AI_DISP },
+	{ "EXCHANGE REPULSION", EFP_TERM_XR | EFP_TERM_AI_XR }
+};
+
+struct gtest_energy {
+	double total;
+	double term[N_TERMS];
+};
+
+struct gtest_worker {
+	struct state state;
+	double *xyzabc;
+	double *xyz;
+	const char *skip;
+	size_t active;
+};
+
 static void test_vec(char label, size_t idx, double tol, const double *agrad,
 		const double *ngrad)
 {
@@ -45,103 +73,445 @@ static void test_vec(char label, size_t idx, double tol, const double *agrad,
 	msg(match ? "  MATCH\n" : "  DOES NOT MATCH\n");
 }
 
-static void test_cgrad(struct state *state, const double *cgrad)
+static void compute_energies(struct state *state, struct gtest_energy *out)
+{
+	struct efp_energy energy;
+
+	compute_energy(state, false);
+	check_fail(efp_get_energy(state->efp, &energy));
+
+	out->total = state->energy;
+	out->term[0] = energy.electrostatic + energy.charge_penetration +
+	    energy.electrostatic_point_charges;
+	out->term[1] = energy.polarization;
+	out->term[2] = energy.dispersion + energy.ai_dispersion;
+	out->term[3] = energy.exchange_repulsion;
+}
+
+/*
+ * Pairwise terms of fragments that are not displaced cancel out in finite
+ * differences. If polarization is off only pairs involving the displaced
+ * fragment are computed. Value n_frags of frag skips all fragment pairs which
+ * is used for point charge displacements. Pairs skipped by the caller stay
+ * skipped.
+ */
+static void restrict_pairs(struct gtest_worker *w, size_t n_frags, size_t frag)
+{
+	struct efp *efp = w->state.efp;
+
+	if (w->active == frag)
+		return;
+
+	if (w->active == SIZE_MAX) {
+		for (size_t i = 0; i < n_frags; i++)
+			for (size_t j = i + 1; j < n_frags; j++)
+				check_fail(efp_skip_fragments(efp, i, j, 1));
+	} else if (w->active < n_frags) {
+		for (size_t i = 0; i < n_frags; i++)
+			if (i != w->active)
+				check_fail(efp_skip_fragments(efp, w->active, i, 1));
+	}
+
+	if (frag < n_frags) {
+		for (size_t i = 0; i < n_frags; i++)
+			if (i != frag)
+				check_fail(efp_skip_fragments(efp, frag, i,
+				    w->skip[frag * n_frags + i]));
+	}
+
+	w->active = frag;
+}
+
+static void unrestrict_pairs(struct gtest_worker *w)
+{
+	if (w->active == SIZE_MAX)
+		return;
+
+	restore_skiplist(w->state.efp, w->skip);
+	w->active = SIZE_MAX;
+}
+
+static void set_coord(struct gtest_worker *w, size_t n_frags, size_t n_charges,
+		const double *znuc, size_t k)
+{
+	if (k < 6 * n_frags)
+		check_fail(efp_set_frag_coordinates(w->state.efp, k / 6,
+		    EFP_COORD_TYPE_XYZABC, w->xyzabc + k / 6 * 6));
+	else
+		check_fail(efp_set_point_charges(w->state.efp, n_charges,
+		    znuc, w->xyz));
+}
+
+static size_t get_worker_count(struct state *state)
+{
+	size_t n_workers = 1;
+
+#if defined(_OPENMP) && !defined(EFP_USE_MPI)
+	/* force field object can not be shared between threads */
+	if (state->ff == NULL)
+		n_workers = (size_t)omp_get_max_threads();
+#else
+	(void)state;
+#endif
+	return n_workers;
+}
+
+/*
+ * Compute numerical derivatives of the total energy and of each energy term
+ * for all fragment and point charge coordinates. Displacements are
+ * distributed between threads, each thread owns a separate efp object.
+ */
+static void numerical_grad(struct state *state, double *ngrad, double *nterm)
 {
-	double tol = cfg_get_double(state->cfg, "gtest_tol");
 	double dstep = cfg_get_double(state->cfg, "num_step_dist");
+	double astep = cfg_get_double(state->cfg, "num_step_angle");
+	size_t n_frags, n_charges, n_workers, n_coord;
+	struct efp_opts opts;
+	bool pairwise;
 
-	size_t n_charges;
+	check_fail(efp_get_frag_count(state->efp, &n_frags));
 	check_fail(efp_get_point_charge_count(state->efp, &n_charges));
+	check_fail(efp_get_opts(state->efp, &opts));
+
+	pairwise = !(opts.terms & (EFP_TERM_POL | EFP_TERM_AI_POL));
+	n_workers = get_worker_count(state);
+	n_coord = 6 * n_frags + 3 * n_charges;
+
+	double znuc[n_charges + 1];
+	struct gtest_worker workers[n_workers];
+	char *skip = save_skiplist(state->efp);
 
-	double znuc[n_charges], xyz[3 * n_charges];
 	check_fail(efp_get_point_charge_values(state->efp, znuc));
-	check_fail(efp_get_point_charge_coordinates(state->efp, xyz));
 
-	for (size_t i = 0; i < n_charges; i++) {
-		double ngrad[3];
+	for (size_t i = 0; i < n_workers; i++) {
+		struct gtest_worker *w = workers + i;
 
-		for (size_t j = 0; j < 3; j++) {
-			double e1, e2;
-			double coord = xyz[3 * i + j];
+		w->state = *state;
+		w->skip = skip;
+		w->active = SIZE_MAX;
+		w->xyzabc = xmalloc((6 * n_frags + 1) * sizeof(double));
+		w->xyz = xmalloc((3 * n_charges + 1) * sizeof(double));
 
-			xyz[3 * i + j] = coord - dstep;
-			check_fail(efp_set_point_charges(state->efp, n_charges, znuc, xyz));
-			compute_energy(state, 0);
-			e1 = state->energy;
+		check_fail(efp_get_coordinates(state->efp, w->xyzabc));
+		check_fail(efp_get_point_charge_coordinates(state->efp, w->xyz));
 
-			xyz[3 * i + j] = coord + dstep;
-			check_fail(efp_set_point_charges(state->efp, n_charges, znuc, xyz));
-			compute_energy(state, 0);
-			e2 = state->energy;
+		if (i > 0) {
+			w->state.efp = create_efp(state->cfg, state->sys);
+			check_fail(efp_set_coordinates(w->state.efp,
+			    EFP_COORD_TYPE_XYZABC, w->xyzabc));
+			restore_skiplist(w->state.efp, skip);
+		}
+	}
 
-			xyz[3 * i + j] = coord;
-			ngrad[j] = (e2 - e1) / (2.0 * dstep);
+#ifdef _OPENMP
+#pragma omp parallel for num_threads(n_workers) schedule(dynamic)
+#endif
+	for (size_t k = 0; k < n_coord; k++) {
+		struct gtest_energy e1, e2;
+		struct gtest_worker *w = workers;
+		double *coord, orig, step;
+
+#ifdef _OPENMP
+		w += omp_get_thread_num();
+#endif
+		if (k < 6 * n_frags) {
+			coord = w->xyzabc + k;
+			step = k % 6 < 3 ? dstep : astep;
+		} else {
+			coord = w->xyz + k - 6 * n_frags;
+			step = dstep;
 		}
 
-		test_vec('Q', i + 1, tol, cgrad + 3 * i, ngrad);
+		if (pairwise)
+			restrict_pairs(w, n_frags,
+			    k < 6 * n_frags ? k / 6 : n_frags);
+
+		orig = *coord;
+
+		*coord = orig - step;
+		set_coord(w, n_frags, n_charges, znuc, k);
+		compute_energies(&w->state, &e1);
+
+		*coord = orig + step;
+		set_coord(w, n_frags, n_charges, znuc, k);
+		compute_energies(&w->state, &e2);
+
+		*coord = orig;
+		set_coord(w, n_frags, n_charges, znuc, k);
+
+		ngrad[k] = (e2.total - e1.total) / (2.0 * step);
+
+		for (size_t t = 0; t < N_TERMS; t++)
+			nterm[t * n_coord + k] =
+			    (e2.term[t] - e1.term[t]) / (2.0 * step);
 	}
 
-	check_fail(efp_set_point_charges(state->efp, n_charges, znuc, xyz));
+	unrestrict_pairs(workers);
+
+	for (size_t i = 0; i < n_workers; i++) {
+		if (i > 0)
+			efp_shutdown(workers[i].state.efp);
+		free(workers[i].xyzabc);
+		free(workers[i].xyz);
+	}
+
+	free(skip);
 }
 
-static void test_fgrad(struct state *state, const double *fgrad)
+/* analytic gradient of a subset of energy terms, torques are converted to
+ * derivatives with respect to Euler angles */
+static void analytic_grad(struct state *state, unsigned terms, double *agrad)
 {
-	double tol = cfg_get_double(state->cfg, "gtest_tol");
-	double dstep = cfg_get_double(state->cfg, "num_step_dist");
-	double astep = cfg_get_double(state->cfg, "num_step_angle");
-
+	struct efp_opts opts, opts_term;
 	size_t n_frags;
+
 	check_fail(efp_get_frag_count(state->efp, &n_frags));
+	check_fail(efp_get_opts(state->efp, &opts));
+
+	opts_term = opts;
+	opts_term.terms &= terms;
 
 	double xyzabc[6 * n_frags];
 	check_fail(efp_get_coordinates(state->efp, xyzabc));
 
+	check_fail(efp_set_opts(state->efp, &opts_term));
+	check_fail(efp_compute(state->efp, 1));
+	check_fail(efp_get_gradient(state->efp, agrad));
+	check_fail(efp_get_point_charge_gradient(state->efp, agrad + 6 * n_frags));
+	check_fail(efp_set_opts(state->efp, &opts));
+
 	for (size_t i = 0; i < n_frags; i++) {
-		double deriv[3], ngrad[6];
+		double deriv[3];
+
+		efp_torque_to_derivative(xyzabc + 6 * i + 3, agrad + 6 * i + 3, deriv);
+		memcpy(agrad + 6 * i + 3, deriv, 3 * sizeof(double));
+	}
+}
+
+static void test_terms(struct state *state, const double *nterm)
+{
+	double tol = cfg_get_double(state->cfg, "gtest_tol");
+	size_t n_frags, n_charges, n_coord;
+	struct efp_opts opts;
+
+	check_fail(efp_get_frag_count(state->efp, &n_frags));
+	check_fail(efp_get_point_charge_count(state->efp, &n_charges));
+	check_fail(efp_get_opts(state->efp, &opts));
+
+	n_coord = 6 * n_frags + 3 * n_charges;
+
+	double agrad[n_coord];
+
+	msg("\n\n    GRADIENT ERRORS BY ENERGY TERM\n\n");
+	msg("%30s %16s %16s\n", "", "MAX ERROR", "RMS ERROR");
+
+	for (size_t t = 0; t < N_TERMS; t++) {
+		double err, max_err = 0.0, sum_err = 0.0;
 
-		for (size_t j = 0; j < 6; j++) {
-			double e1, e2;
-			double coord = xyzabc[6 * i + j];
-			double step = j < 3 ? dstep : astep;
+		if (!(opts.terms & gtest_terms[t].terms))
+			continue;
 
-			xyzabc[6 * i + j] = coord - step;
-			check_fail(efp_set_coordinates(state->efp, EFP_COORD_TYPE_XYZABC, xyzabc));
-			compute_energy(state, false);
-			e1 = state->energy;
+		analytic_grad(state, gtest_terms[t].terms, agrad);
 
-			xyzabc[6 * i + j] = coord + step;
-			check_fail(efp_set_coordinates(state->efp, EFP_COORD_TYPE_XYZABC, xyzabc));
-			compute_energy(state, false);
-			e2 = state->energy;
+		for (size_t k = 0; k < n_coord; k++) {
+			err = fabs(agrad[k] - nterm[t * n_coord + k]);
+			sum_err += err * err;
 
-			xyzabc[6 * i + j] = coord;
-			ngrad[j] = (e2 - e1) / (2.0 * step);
+			if (err > max_err)
+				max_err = err;
 		}
 
-		test_vec('F', i + 1, tol, fgrad + 6 * i, ngrad);
-		efp_torque_to_derivative(xyzabc + 6 * i + 3, fgrad + 6 * i + 3, deriv);
-		test_vec('D', i + 1, tol, deriv, ngrad + 3);
+		msg("%30s %16.8E %16.8E", gtest_terms[t].name, max_err,
+		    sqrt(sum_err / n_coord));
+		msg(max_err > tol ? "  DOES NOT MATCH\n" : "  MATCH\n");
 	}
-
-	check_fail(efp_set_coordinates(state->efp, EFP_COORD_TYPE_XYZABC, xyzabc));
 }
 
 static void test_grad(struct state *state)
 {
-	size_t n_frags, n_charges;
+	double tol = cfg_get_double(state->cfg, "gtest_tol");
+	size_t n_frags, n_charges, n_coord;
+
 	check_fail(efp_get_frag_count(state->efp, &n_frags));
 	check_fail(efp_get_point_charge_count(state->efp, &n_charges));
 
+	n_coord = 6 * n_frags + 3 * n_charges;
+
+	double xyzabc[6 * n_frags];
+	double *ngrad = xmalloc(n_coord * sizeof(double));
+	double *nterm = xmalloc(N_TERMS * n_coord * sizeof(double));
+
+	check_fail(efp_get_coordinates(state->efp, xyzabc));
+	numerical_grad(state, ngrad, nterm);
+
+	for (size_t i = 0; i < n_charges; i++)
+		test_vec('Q', i + 1, tol, state->grad + 6 * n_frags + 3 * i,
+		    ngrad + 6 * n_frags + 3 * i);
+
+	for (size_t i = 0; i < n_frags; i++) {
+		const double *fgrad = state->grad + 6 * i;
+		double deriv[3];
+
+		test_vec('F', i + 1, tol, fgrad, ngrad + 6 * i);
+		efp_torque_to_derivative(xyzabc + 6 * i + 3, fgrad + 3, deriv);
+		test_vec('D', i + 1, tol, deriv, ngrad + 6 * i + 3);
+	}
+
+	test_terms(state, nterm);
+
+	free(ngrad);
+	free(nterm);
+}
+
+/* direction of a linear fragment, torque along it can not be represented by
+ * atomic forces */
+static bool get_linear_axis(const struct efp_atom *atoms, size_t n_atoms,
+		vec_t *axis)
+{
+	vec_t r0 = { atoms[0].x, atoms[0].y, atoms[0].z };
+	bool found = false;
+
+	for (size_t j = 1; j < n_atoms; j++) {
+		vec_t pos = { atoms[j].x, atoms[j].y, atoms[j].z };
+		vec_t dr = vec_sub(&pos, &r0);
+
+		if (!found) {
+			if (vec_len(&dr) < 1.0e-6)
+				continue;
+
+			*axis = dr;
+			vec_normalize(axis);
+			found = true;
+		} else {
+			vec_t c = vec_cross(&dr, axis);
+
+			if (vec_len(&c) > 1.0e-6)
+				return false;
+		}
+	}
+
+	return found;
+}
+
+/* maximum deviation of summed atomic forces and torques from the fragment
+ * gradient, atoms also get extra forces if extra is not NULL */
+static double atomic_grad_error(struct state *state, size_t n_total,
+		const double *extra)
+{
+	size_t n_frags, n_atoms, offset;
+	double err, max_err = 0.0;
+
+	check_fail(efp_get_frag_count(state->efp, &n_frags));
+
 	double fgrad[6 * n_frags];
-	memcpy(fgrad, state->grad, n_frags * 6 * sizeof(double));
+	double xyzabc[6 * n_frags];
 
-	if (n_charges > 0) {
-		double cgrad[3 * n_charges];
-		check_fail(efp_get_point_charge_gradient(state->efp, cgrad));
-		test_cgrad(state, cgrad);
+	check_fail(efp_get_gradient(state->efp, fgrad));
+	check_fail(efp_get_coordinates(state->efp, xyzabc));
+
+	double *agrad = xmalloc((3 * n_total + 1) * sizeof(double));
+
+	check_fail(efp_get_atomic_gradient_into(state->efp, extra, agrad));
+
+	offset = 0;
+
+	for (size_t i = 0; i < n_frags; i++) {
+		check_fail(efp_get_frag_atom_count(state->efp, i, &n_atoms));
+
+		struct efp_atom atoms[n_atoms];
+		vec_t com = { xyzabc[6 * i + 0], xyzabc[6 * i + 1],
+		    xyzabc[6 * i + 2] };
+		double sum[6];
+
+		check_fail(efp_get_frag_atoms(state->efp, i, n_atoms, atoms));
+		memcpy(sum, fgrad + 6 * i, 6 * sizeof(double));
+
+		for (size_t j = 0; j < n_atoms; j++) {
+			const vec_t *g = (const vec_t *)agrad + offset + j;
+			vec_t pos = { atoms[j].x, atoms[j].y, atoms[j].z };
+			vec_t dr = vec_sub(&pos, &com);
+			vec_t t = vec_cross(&dr, g);
+
+			sum[0] -= g->x;
+			sum[1] -= g->y;
+			sum[2] -= g->z;
+			sum[3] -= t.x;
+			sum[4] -= t.y;
+			sum[5] -= t.z;
+
+			if (extra) {
+				const vec_t *e = (const vec_t *)extra +
+				    offset + j;
+
+				t = vec_cross(&dr, e);
+				sum[0] += e->x;
+				sum[1] += e->y;
+				sum[2] += e->z;
+				sum[3] += t.x;
+				sum[4] += t.y;
+				sum[5] += t.z;
+			}
+		}
+
+		vec_t axis = vec_zero;
+
+		if (get_linear_axis(atoms, n_atoms, &axis)) {
+			vec_t t = { sum[3], sum[4], sum[5] };
+			double proj = vec_dot(&t, &axis);
+
+			sum[3] -= proj * axis.x;
+			sum[4] -= proj * axis.y;
+			sum[5] -= proj * axis.z;
+		}
+
+		for (size_t k = 0; k < 6; k++) {
+			err = fabs(sum[k]);
+
+			if (err > max_err)
+				max_err = err;
+		}
+
+		offset += n_atoms;
 	}
 
-	test_fgrad(state, fgrad);
+	free(agrad);
+	return max_err;
+}
+
+/* atomic gradients summed over each fragment must reproduce the fragment
+ * force and torque */
+static void test_atomic_grad(struct state *state)
+{
+	double tol = cfg_get_double(state->cfg, "gtest_tol");
+	size_t n_frags, n_atoms = 0;
+	double err;
+
+	check_fail(efp_get_frag_count(state->efp, &n_frags));
+
+	for (size_t i = 0; i < n_frags; i++) {
+		size_t n;
+
+		check_fail(efp_get_frag_atom_count(state->efp, i, &n));
+		n_atoms += n;
+	}
+
+	double *extra = xmalloc((3 * n_atoms + 1) * sizeof(double));
+
+	for (size_t i = 0; i < 3 * n_atoms; i++)
+		extra[i] = 0.001 * (double)(i % 7) - 0.003;
+
+	msg("\n\n    ATOMIC GRADIENT ERRORS\n\n");
+	msg("%30s %16s\n", "", "MAX ERROR");
+
+	err = atomic_grad_error(state, n_atoms, NULL);
+	msg("%30s %16.8E", "ATOMIC GRADIENT", err);
+	msg(err > tol ? "  DOES NOT MATCH\n" : "  MATCH\n");
+
+	err = atomic_grad_error(state, n_atoms, extra);
+	msg("%30s %16.8E", "WITH EXTRA FORCES", err);
+	msg(err > tol ? "  DOES NOT MATCH\n" : "  MATCH\n");
+
+	free(extra);
 }
 
 static void test_energy(struct state *state)
@@ -164,6 +534,7 @@ void sim_gtest(struct state *state)
 	compute_energy(state, 1);
 	print_energy(state);
 	test_energy(state);
+	test_atomic_grad(state);
 
 	msg("\n\n    COMPUTING NUMERICAL GRADIENT\n\n");
 	test_grad(state);
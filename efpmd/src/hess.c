@@ -29,6 +29,17 @@
 
 void sim_hess(struct state *state);
 
+/*
+ * Block-sparse Hessian. Only 6x6 blocks of fragment pairs closer than
+ * hess_cutoff are stored, rows of blocks are in compressed sparse row order.
+ */
+struct sparse_hess {
+	size_t n_frags;
+	size_t *row; /* offsets of block rows, n_frags + 1 elements */
+	size_t *col; /* fragment index of each block */
+	double *block; /* 36 values per block, row-major */
+};
+
 static void compute_gradient(struct state *state, size_t n_frags,
 			     const double *xyzabc, double *grad)
 {
@@ -119,6 +130,212 @@ static void compute_hessian(struct state *state, double *hess)
 	msg("\n\n");
 }
 
+static double frag_dist2(struct state *state, const double *xyzabc,
+    size_t i, size_t j)
+{
+	vec_t dr = {
+		xyzabc[6 * j + 0] - xyzabc[6 * i + 0],
+		xyzabc[6 * j + 1] - xyzabc[6 * i + 1],
+		xyzabc[6 * j + 2] - xyzabc[6 * i + 2]
+	};
+
+	if (cfg_get_bool(state->cfg, "enable_pbc")) {
+		vec_t box = box_from_str(cfg_get_string(state->cfg,
+		    "periodic_box"));
+
+		dr.x -= box.x * round(dr.x / box.x);
+		dr.y -= box.y * round(dr.y / box.y);
+		dr.z -= box.z * round(dr.z / box.z);
+	}
+
+	return vec_len_2(&dr);
+}
+
+static void sparse_hess_init(struct state *state, struct sparse_hess *sh)
+{
+	size_t n_frags, n_blocks = 0;
+	double cutoff2 = cfg_get_double(state->cfg, "hess_cutoff");
+
+	cutoff2 *= cutoff2;
+
+	check_fail(efp_get_frag_count(state->efp, &n_frags));
+
+	double xyzabc[6 * n_frags];
+	check_fail(efp_get_coordinates(state->efp, xyzabc));
+
+	sh->n_frags = n_frags;
+	sh->row = xmalloc((n_frags + 1) * sizeof(size_t));
+	sh->col = NULL;
+
+	for (size_t i = 0; i < n_frags; i++) {
+		sh->row[i] = n_blocks;
+
+		for (size_t j = 0; j < n_frags; j++) {
+			if (j != i && frag_dist2(state, xyzabc, i, j) > cutoff2)
+				continue;
+
+			sh->col = xrealloc(sh->col,
+			    (n_blocks + 1) * sizeof(size_t));
+			sh->col[n_blocks++] = j;
+		}
+	}
+
+	sh->row[n_frags] = n_blocks;
+	sh->block = xcalloc(36 * n_blocks + 1, sizeof(double));
+}
+
+static void sparse_hess_free(struct sparse_hess *sh)
+{
+	free(sh->row);
+	free(sh->col);
+	free(sh->block);
+}
+
+static double *sparse_hess_find(struct sparse_hess *sh, size_t i, size_t j)
+{
+	for (size_t k = sh->row[i]; k < sh->row[i + 1]; k++)
+		if (sh->col[k] == j)
+			return sh->block + 36 * k;
+
+	return NULL;
+}
+
+/*
+ * Enable interactions which depend on coordinates of fragment frag. Pairwise
+ * terms only need pairs involving frag. With polarization all pairs among
+ * neighbors of frag are enabled so that induced dipoles relax locally. If
+ * enable is false the pairs are skipped again. Pairs marked in the original
+ * skip list are never enabled.
+ */
+static void set_hess_pairs(struct state *state, struct sparse_hess *sh,
+    const char *skip, size_t frag, bool local_pol, bool enable)
+{
+	size_t n_frags = sh->n_frags;
+
+	for (size_t k = sh->row[frag]; k < sh->row[frag + 1]; k++) {
+		size_t i = sh->col[k];
+
+		if (!local_pol) {
+			if (i != frag)
+				check_fail(efp_skip_fragments(state->efp,
+				    frag, i, enable ?
+				    skip[frag * n_frags + i] : 1));
+			continue;
+		}
+
+		for (size_t l = k + 1; l < sh->row[frag + 1]; l++) {
+			size_t j = sh->col[l];
+
+			check_fail(efp_skip_fragments(state->efp, i, j,
+			    enable ? skip[i * n_frags + j] : 1));
+		}
+	}
+}
+
+static void skip_all_pairs(struct state *state, size_t n_frags)
+{
+	for (size_t i = 0; i < n_frags; i++)
+		for (size_t j = i + 1; j < n_frags; j++)
+			check_fail(efp_skip_fragments(state->efp, i, j, 1));
+}
+
+/*
+ * Displacing fragment i only changes gradients of fragments which interact
+ * with it, so each displacement evaluates only those interactions and fills
+ * block row i.
+ */
+static void compute_sparse_hessian(struct state *state, struct sparse_hess *sh)
+{
+	size_t n_frags = sh->n_frags, n_coord = 6 * sh->n_frags;
+	double *xyzabc, *grad_f, *grad_b;
+	char *skip;
+	bool central = cfg_get_bool(state->cfg, "hess_central");
+	struct efp_opts opts;
+
+	check_fail(efp_get_opts(state->efp, &opts));
+	bool local_pol = opts.terms & (EFP_TERM_POL | EFP_TERM_AI_POL);
+
+	xyzabc = xmalloc(n_coord * sizeof(double));
+	grad_f = xmalloc(n_coord * sizeof(double));
+	grad_b = xmalloc(n_coord * sizeof(double));
+
+	check_fail(efp_get_coordinates(state->efp, xyzabc));
+	skip = save_skiplist(state->efp);
+	skip_all_pairs(state, n_frags);
+
+	for (size_t i = 0; i < n_coord; i++) {
+		size_t frag = i / 6;
+		double save = xyzabc[i];
+		double step = i % 6 < 3 ? cfg_get_double(state->cfg, "num_step_dist") :
+					  cfg_get_double(state->cfg, "num_step_angle");
+
+		if (i % 6 == 0) {
+			if (frag > 0)
+				set_hess_pairs(state, sh, skip, frag - 1,
+				    local_pol, false);
+			set_hess_pairs(state, sh, skip, frag, local_pol, true);
+
+			if (!central)
+				compute_gradient(state, n_frags, xyzabc, grad_b);
+		}
+
+		show_progress(i + 1, n_coord, "FORWARD");
+		xyzabc[i] = save + step;
+		compute_gradient(state, n_frags, xyzabc, grad_f);
+
+		if (central) {
+			show_progress(i + 1, n_coord, "BACKWARD");
+			xyzabc[i] = save - step;
+			compute_gradient(state, n_frags, xyzabc, grad_b);
+		}
+
+		double delta = central ? 2.0 * step : step;
+
+		for (size_t k = sh->row[frag]; k < sh->row[frag + 1]; k++) {
+			const double *gf = grad_f + 6 * sh->col[k];
+			const double *gb = grad_b + 6 * sh->col[k];
+			double *out = sh->block + 36 * k + 6 * (i % 6);
+
+			for (size_t j = 0; j < 6; j++)
+				out[j] = (gf[j] - gb[j]) / delta;
+		}
+
+		xyzabc[i] = save;
+	}
+
+	/* restore original coordinates and interactions */
+	restore_skiplist(state->efp, skip);
+	free(skip);
+	check_fail(efp_set_coordinates(state->efp, EFP_COORD_TYPE_XYZABC, xyzabc));
+
+	/* reduce error by computing the average of H(i,j) and H(j,i) */
+	for (size_t i = 0; i < n_frags; i++) {
+		for (size_t k = sh->row[i]; k < sh->row[i + 1]; k++) {
+			size_t j = sh->col[k];
+			double *b_ij = sh->block + 36 * k;
+			double *b_ji = sparse_hess_find(sh, j, i);
+
+			if (j < i)
+				continue;
+
+			for (size_t a = 0; a < 6; a++) {
+				for (size_t b = j == i ? a + 1 : 0; b < 6; b++) {
+					double sum = b_ij[6 * a + b] + b_ji[6 * b + a];
+
+					b_ij[6 * a + b] = 0.5 * sum;
+					b_ji[6 * b + a] = 0.5 * sum;
+				}
+			}
+		}
+	}
+
+	free(xyzabc);
+	free(grad_f);
+	free(grad_b);
+
+	msg("\n\n");
+}
+
 static void get_inertia_factor(const double *inertia, const mat_t *rotmat,
 					mat_t *inertia_fact)
 {
@@ -225,6 +442,19 @@ static void w_rot_rot(const mat_t *fact1, const mat_t *fact2, size_t stride,
 	}
 }
 
+/* mass-weight 6x6 block of fragments i and j with rows stride apart */
+static void mass_weight_block(const double *mass_fact,
+    const mat_t *inertia_fact, size_t i, size_t j, size_t stride,
+    const double *in, double *out)
+{
+	w_tr_tr(mass_fact[i], mass_fact[j], stride, in, out);
+	w_tr_rot(mass_fact[i], inertia_fact + j, stride, in + 3, out + 3);
+	w_rot_tr(inertia_fact + i, mass_fact[j], stride, in + 3 * stride,
+	    out + 3 * stride);
+	w_rot_rot(inertia_fact + i, inertia_fact + j, stride,
+	    in + 3 * stride + 3, out + 3 * stride + 3);
+}
+
 static void mass_weight_hessian(struct efp *efp, const double *in, double *out)
 {
 	size_t n_frags, n_coord;
@@ -241,21 +471,47 @@ static void mass_weight_hessian(struct efp *efp, const double *in, double *out)
 		for (size_t j = 0; j < n_frags; j++) {
 			size_t offset = 6 * n_coord * i + 6 * j;
 
-			w_tr_tr(mass_fact[i], mass_fact[j], n_coord,
-					in + offset,
-					out + offset);
+			mass_weight_block(mass_fact, inertia_fact, i, j,
+			    n_coord, in + offset, out + offset);
+		}
+	}
+}
 
-			w_tr_rot(mass_fact[i], inertia_fact + j, n_coord,
-					in + offset + 3,
-					out + offset + 3);
+/* mass-weighted sparse Hessian expanded to a dense matrix */
+static void mass_weight_sparse_hessian(struct efp *efp,
+    const struct sparse_hess *sh, double *out)
+{
+	size_t n_frags = sh->n_frags, n_coord = 6 * sh->n_frags;
 
-			w_rot_tr(inertia_fact + i, mass_fact[j], n_coord,
-					in + offset + 3 * n_coord,
-					out + offset + 3 * n_coord);
+	double mass_fact[n_frags];
+	mat_t inertia_fact[n_frags];
+
+	get_weight_factor(efp, mass_fact, inertia_fact);
+	memset(out, 0, n_coord * n_coord * sizeof(double));
+
+	for (size_t i = 0; i < n_frags; i++) {
+		for (size_t k = sh->row[i]; k < sh->row[i + 1]; k++) {
+			size_t j = sh->col[k];
+			double w[36];
+
+			/* blocks are stored with stride 6 */
+			mass_weight_block(mass_fact, inertia_fact, i, j, 6,
+			    sh->block + 36 * k, w);
 
-			w_rot_rot(inertia_fact + i, inertia_fact + j, n_coord,
-					in + offset + 3 * n_coord + 3,
-					out + offset + 3 * n_coord + 3);
+			for (size_t a = 0; a < 6; a++)
+				memcpy(out + (6 * i + a) * n_coord + 6 * j,
+				    w + 6 * a, 6 * sizeof(double));
+		}
+	}
+}
+
+static void print_sparse_hessian(const struct sparse_hess *sh)
+{
+	for (size_t i = 0; i < sh->n_frags; i++) {
+		for (size_t k = sh->row[i]; k < sh->row[i + 1]; k++) {
+			msg("    BLOCK OF FRAGMENTS %zu AND %zu\n\n", i + 1,
+			    sh->col[k] + 1);
+			print_matrix(6, 6, sh->block + 36 * k);
 		}
 	}
 }
@@ -286,17 +542,34 @@ void sim_hess(struct state *state)
 	check_fail(efp_get_frag_count(state->efp, &n_frags));
 	n_coord = 6 * n_frags;
 
-	hess = xmalloc(n_coord * n_coord * sizeof(double));
-	compute_hessian(state, hess);
+	if (cfg_get_bool(state->cfg, "hess_sparse")) {
+		struct sparse_hess sh;
+
+		sparse_hess_init(state, &sh);
+		compute_sparse_hessian(state, &sh);
 
-	msg("    HESSIAN MATRIX\n\n");
-	print_matrix(n_coord, n_coord, hess);
+		msg("    SPARSE HESSIAN MATRIX, %zu OF %zu BLOCKS\n\n",
+		    sh.row[n_frags], n_frags * n_frags);
+		print_sparse_hessian(&sh);
 
-	mass_hess = xmalloc(n_coord * n_coord * sizeof(double));
-	mass_weight_hessian(state->efp, hess, mass_hess);
+		/* normal mode analysis needs the full matrix */
+		hess = NULL;
+		mass_hess = xmalloc(n_coord * n_coord * sizeof(double));
+		mass_weight_sparse_hessian(state->efp, &sh, mass_hess);
+		sparse_hess_free(&sh);
+	} else {
+		hess = xmalloc(n_coord * n_coord * sizeof(double));
+		compute_hessian(state, hess);
 
-	msg("    MASS-WEIGHTED HESSIAN MATRIX\n\n");
-	print_matrix(n_coord, n_coord, mass_hess);
+		msg("    HESSIAN MATRIX\n\n");
+		print_matrix(n_coord, n_coord, hess);
+
+		mass_hess = xmalloc(n_coord * n_coord * sizeof(double));
+		mass_weight_hessian(state->efp, hess, mass_hess);
+
+		msg("    MASS-WEIGHTED HESSIAN MATRIX\n\n");
+		print_matrix(n_coord, n_coord, mass_hess);
+	}
 
 	msg("    NORMAL MODE ANALYSIS\n\n");
 
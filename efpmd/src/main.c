@@ -98,9 +98,20 @@ static struct cfg *make_cfg(void)
 
 	cfg_add_enum(cfg, "pol_driver", EFP_POL_DRIVER_ITERATIVE,
 		"iterative\n"
-		"direct\n",
+		"direct\n"
+		"adaptive\n"
+		"hodlr\n",
 		(int []) { EFP_POL_DRIVER_ITERATIVE,
-			   EFP_POL_DRIVER_DIRECT });
+			   EFP_POL_DRIVER_DIRECT,
+			   EFP_POL_DRIVER_ADAPTIVE,
+			   EFP_POL_DRIVER_HODLR });
+
+	cfg_add_double(cfg, "pol_scf_tol", 1.0e-10);
+	cfg_add_int(cfg, "pol_scf_max_iter", 80);
+	cfg_add_int(cfg, "pol_diis_size", 0);
+	cfg_add_bool(cfg, "enable_adaptive_pol_tol", false);
+	cfg_add_double(cfg, "pol_tol_max", 1.0e-6);
+	cfg_add_double(cfg, "pol_drift_max", 1.0e-7);
 
 	cfg_add_bool(cfg, "enable_ff", false);
 	cfg_add_bool(cfg, "enable_multistep", false);
@@ -111,15 +122,28 @@ static struct cfg *make_cfg(void)
 	cfg_add_bool(cfg, "enable_cutoff", false);
 	cfg_add_double(cfg, "swf_cutoff", 10.0);
 	cfg_add_int(cfg, "max_steps", 100);
+	cfg_add_int(cfg, "max_memory", 0);
+	cfg_add_bool(cfg, "enable_numa", false);
+	cfg_add_bool(cfg, "enable_huge_pages", false);
+	cfg_add_bool(cfg, "enable_shm", false);
+	cfg_add_bool(cfg, "enable_lazy_library", false);
 	cfg_add_int(cfg, "multistep_steps", 1);
+	cfg_add_bool(cfg, "enable_xl_pol", false);
+	cfg_add_int(cfg, "xl_pol_iter", 1);
+	cfg_add_int(cfg, "xl_pol_steps", 100);
 	cfg_add_string(cfg, "fraglib_path", FRAGLIB_PATH);
 	cfg_add_string(cfg, "userlib_path", ".");
 	cfg_add_bool(cfg, "enable_pbc", false);
+	cfg_add_bool(cfg, "enable_disp_ewald", false);
 	cfg_add_string(cfg, "periodic_box", "30.0 30.0 30.0");
 	cfg_add_double(cfg, "opt_tol", 1.0e-4);
 	cfg_add_double(cfg, "gtest_tol", 1.0e-6);
 	cfg_add_double(cfg, "ref_energy", 0.0);
+	cfg_add_bool(cfg, "print_pairwise", false);
+	cfg_add_string(cfg, "pairwise_file", "pairwise.dat");
 	cfg_add_bool(cfg, "hess_central", false);
+	cfg_add_bool(cfg, "hess_sparse", false);
+	cfg_add_double(cfg, "hess_cutoff", 10.0);
 	cfg_add_double(cfg, "num_step_dist", 0.001);
 	cfg_add_double(cfg, "num_step_angle", 0.01);
 
@@ -237,7 +261,7 @@ next:
 	return terms;
 }
 
-static struct efp *create_efp(const struct cfg *cfg, const struct sys *sys)
+struct efp *create_efp(const struct cfg *cfg, const struct sys *sys)
 {
 	struct efp_opts opts = {
 		.terms = get_terms(cfg_get_string(cfg, "terms")),
@@ -245,9 +269,18 @@ static struct efp *create_efp(const struct cfg *cfg, const struct sys *sys)
 		.disp_damp = cfg_get_enum(cfg, "disp_damp"),
 		.pol_damp = cfg_get_enum(cfg, "pol_damp"),
 		.pol_driver = cfg_get_enum(cfg, "pol_driver"),
+		.pol_scf_tol = cfg_get_double(cfg, "pol_scf_tol"),
+		.pol_scf_max_iter = (size_t)cfg_get_int(cfg, "pol_scf_max_iter"),
+		.pol_diis_size = (size_t)cfg_get_int(cfg, "pol_diis_size"),
 		.enable_pbc = cfg_get_bool(cfg, "enable_pbc"),
 		.enable_cutoff = cfg_get_bool(cfg, "enable_cutoff"),
-		.swf_cutoff = cfg_get_double(cfg, "swf_cutoff")
+		.swf_cutoff = cfg_get_double(cfg, "swf_cutoff"),
+		.enable_disp_ewald = cfg_get_bool(cfg, "enable_disp_ewald"),
+		.enable_pairwise = cfg_get_bool(cfg, "print_pairwise"),
+		.enable_numa = cfg_get_bool(cfg, "enable_numa"),
+		.enable_huge_pages = cfg_get_bool(cfg, "enable_huge_pages"),
+		.enable_shm = cfg_get_bool(cfg, "enable_shm"),
+		.enable_lazy_library = cfg_get_bool(cfg, "enable_lazy_library")
 	};
 
 	enum efp_coord_type coord_type = cfg_get_enum(cfg, "coord");
@@ -256,11 +289,28 @@ static struct efp *create_efp(const struct cfg *cfg, const struct sys *sys)
 	if (!efp)
 		error("unable to create efp object");
 
+	if (sys->n_charges > 0) {
+		if (opts.terms & EFP_TERM_ELEC)
+			opts.terms |= EFP_TERM_AI_ELEC;
+
+		if (opts.terms & EFP_TERM_POL)
+			opts.terms |= EFP_TERM_AI_POL;
+	}
+
+	if (cfg_get_bool(cfg, "enable_ff"))
+		opts.terms &= ~(EFP_TERM_ELEC | EFP_TERM_POL | EFP_TERM_DISP | EFP_TERM_XR);
+
+	/* options must be set before potentials are loaded in lazy mode */
+	check_fail(efp_set_opts(efp, &opts));
+
 	if (cfg_get_bool(cfg, "single_params_file"))
 		check_fail(efp_add_potential(efp, cfg_get_string(cfg, "efp_params_file")));
 	else
 		add_potentials(efp, cfg, sys);
 
+	check_fail(efp_set_memory_limit(efp,
+	    (size_t)cfg_get_int(cfg, "max_memory") * 1024 * 1024));
+
 	for (size_t i = 0; i < sys->n_frags; i++)
 		check_fail(efp_add_fragment(efp, sys->frags[i].name));
 
@@ -275,19 +325,9 @@ static struct efp *create_efp(const struct cfg *cfg, const struct sys *sys)
 			pos[3 * i + 2] = sys->charges[i].pos.z;
 		}
 
-		if (opts.terms & EFP_TERM_ELEC)
-			opts.terms |= EFP_TERM_AI_ELEC;
-
-		if (opts.terms & EFP_TERM_POL)
-			opts.terms |= EFP_TERM_AI_POL;
-
 		check_fail(efp_set_point_charges(efp, sys->n_charges, q, pos));
 	}
 
-	if (cfg_get_bool(cfg, "enable_ff"))
-		opts.terms &= ~(EFP_TERM_ELEC | EFP_TERM_POL | EFP_TERM_DISP | EFP_TERM_XR);
-
-	check_fail(efp_set_opts(efp, &opts));
 	check_fail(efp_prepare(efp));
 
 	if (opts.enable_pbc) {
@@ -309,6 +349,27 @@ static void state_init(struct state *state, const struct cfg *cfg, const struct
 	state->energy = 0;
 	state->grad = xcalloc(sys->n_frags * 6 + sys->n_charges * 3, sizeof(double));
 	state->ff = NULL;
+	state->ff_xyz = NULL;
+	state->ff_grad = NULL;
+	state->pairwise = NULL;
+
+	if (cfg_get_bool(cfg, "print_pairwise")) {
+		const char *path = cfg_get_string(cfg, "pairwise_file");
+		char name[1024];
+		int rank = 0;
+
+#ifdef EFP_USE_MPI
+		MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+#endif
+		/* each process writes pairs it has computed */
+		if (rank == 0)
+			snprintf(name, sizeof(name), "%s", path);
+		else
+			snprintf(name, sizeof(name), "%s.%d", path, rank);
+
+		if ((state->pairwise = fopen(name, "w")) == NULL)
+			error("unable to open %s", name);
+	}
 
 	if (cfg_get_bool(cfg, "enable_ff")) {
 		if ((state->ff = ff_create()) == NULL)
@@ -329,6 +390,26 @@ static void state_init(struct state *state, const struct cfg *cfg, const struct
 
 		if (ff_get_atom_count(state->ff) != (int)ntotal)
 			error("total fragment number of atoms does not match .xyz file");
+
+		state->ff_xyz = xmalloc(3 * ntotal * sizeof(double));
+		state->ff_grad = xmalloc(3 * ntotal * sizeof(double));
+	}
+}
+
+static void check_cfg(const struct cfg *cfg)
+{
+	if (cfg_get_int(cfg, "xl_pol_steps") < 1)
+		error("xl_pol_steps must be at least 1");
+
+	if (cfg_get_int(cfg, "xl_pol_iter") < 1)
+		error("xl_pol_iter must be at least 1");
+
+	if (cfg_get_bool(cfg, "enable_xl_pol")) {
+		int driver = cfg_get_enum(cfg, "pol_driver");
+
+		if (driver == EFP_POL_DRIVER_DIRECT ||
+		    driver == EFP_POL_DRIVER_HODLR)
+			error("enable_xl_pol requires an iterative pol_driver");
 	}
 }
 
@@ -352,6 +433,25 @@ static void print_proc_info(void)
 	msg("RUNNING %d MPI PROCESSES WITH %d OPENMP THREADS EACH\n", n_mpi, n_omp);
 }
 
+static void print_memory_usage(struct efp *efp)
+{
+	struct efp_memory_usage usage;
+
+	check_fail(efp_get_memory_usage(efp, &usage));
+
+	msg("    MEMORY USAGE (MEGABYTES)\n\n");
+	msg("%30s %12.3lf\n", "FRAGMENTS", usage.fragments / 1048576.0);
+	msg("%30s %12.3lf\n", "DYNAMIC POLARIZABILITY",
+	    usage.dynamic_polarizability / 1048576.0);
+	msg("%30s %12.3lf\n", "FRAGMENT LIBRARY", usage.library / 1048576.0);
+	msg("%30s %12.3lf\n", "SKIP LIST", usage.skiplist / 1048576.0);
+	msg("%30s %12.3lf\n", "OTHER", usage.other / 1048576.0);
+	msg("%30s %12.3lf\n", "NODE SHARED", usage.shared / 1048576.0);
+	msg("%30s %12.3lf\n", "TOTAL", usage.resident / 1048576.0);
+	msg("%30s %12.3lf\n", "PEAK", usage.peak / 1048576.0);
+	msg("\n\n");
+}
+
 static void print_time(const time_t *t)
 {
 	msg("WALL CLOCK TIME IS %s", ctime(t));
@@ -384,6 +484,8 @@ static void convert_units(struct cfg *cfg, struct sys *sys)
 		cfg_get_double(cfg, "pressure") * BAR_TO_AU);
 	cfg_set_double(cfg, "swf_cutoff",
 		cfg_get_double(cfg, "swf_cutoff") / BOHR_RADIUS);
+	cfg_set_double(cfg, "hess_cutoff",
+		cfg_get_double(cfg, "hess_cutoff") / BOHR_RADIUS);
 	cfg_set_double(cfg, "num_step_dist",
 		cfg_get_double(cfg, "num_step_dist") / BOHR_RADIUS);
 
@@ -450,6 +552,7 @@ int main(int argc, char **argv)
 	msg("\n");
 	state.cfg = make_cfg();
 	state.sys = parse_input(state.cfg, argv[1]);
+	check_cfg(state.cfg);
 	msg("SIMULATION SETTINGS\n\n");
 	print_config(state.cfg);
 	msg("\n\n");
@@ -457,14 +560,19 @@ int main(int argc, char **argv)
 	state_init(&state, state.cfg, state.sys);
 	sim_fn_t sim_fn = get_sim_fn(cfg_get_enum(state.cfg, "run_type"));
 	sim_fn(&state);
+	print_memory_usage(state.efp);
 	end_time = time(NULL);
 	print_time(&end_time);
 	msg("TOTAL RUN TIME IS %d SECONDS\n", (int)(difftime(end_time, start_time)));
+	if (state.pairwise)
+		fclose(state.pairwise);
 	efp_shutdown(state.efp);
 	ff_free(state.ff);
 	sys_free(state.sys);
 	cfg_free(state.cfg);
 	free(state.grad);
+	free(state.ff_xyz);
+	free(state.ff_grad);
 exit:
 #ifdef EFP_USE_MPI
 	MPI_Finalize();
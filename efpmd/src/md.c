@@ -54,6 +54,31 @@ struct npt_data {
 	double eta;
 };
 
+/* number of steps between adjustments of polarization tolerance */
+#define POL_TOL_STEPS 10
+
+/* number of previous auxiliary dipoles in the dissipation term */
+#define XL_POL_K 5
+
+/*
+ * Extended Lagrangian dynamics of induced dipoles reference:
+ *
+ * Anders M. N. Niklasson, Peter Steneteg, Anders Odell, Nicolas Bock,
+ * Matt Challacombe, C. J. Tymczak, Erik Holmstrom, Guishan Zheng, and
+ * Valery Weber
+ *
+ * Extended Lagrangian Born-Oppenheimer molecular dynamics with dissipation
+ *
+ * J. Chem. Phys. 130, 214109 (2009)
+ */
+struct xl_pol_data {
+	size_t n_dip;
+	double *aux[XL_POL_K + 1]; /* auxiliary dipoles, aux[0] is the latest */
+	double *aux_conj[XL_POL_K + 1];
+	double *dip; /* dipoles obtained on the previous step */
+	double *dip_conj;
+};
+
 struct md {
 	size_t n_bodies;
 	struct body *bodies;
@@ -67,6 +92,9 @@ struct md {
 	void (*update_step)(struct md *);
 	struct state *state;
 	void *data; /* nvt/npt data */
+	struct xl_pol_data *xl_pol; /* extended Lagrangian induced dipoles */
+	double pol_tol; /* current polarization convergence threshold */
+	double pol_tol_invariant; /* invariant at the last adjustment */
 };
 
 void sim_md(struct state *state);
@@ -316,8 +344,122 @@ static void remove_system_drift(struct md *md)
 	assert(vec_len(&cv2) < EPSILON && vec_len(&am2) < EPSILON);
 }
 
+/* full scf solve on anchor steps, a few iterations in between */
+static void xl_pol_set_iter(struct md *md, bool anchor)
+{
+	struct efp_opts opts;
+	size_t n_iter = 0;
+
+	if (!anchor)
+		n_iter = (size_t)cfg_get_int(md->state->cfg, "xl_pol_iter");
+
+	check_fail(efp_get_opts(md->state->efp, &opts));
+
+	if (opts.pol_fixed_iter != n_iter) {
+		opts.pol_fixed_iter = n_iter;
+		check_fail(efp_set_opts(md->state->efp, &opts));
+	}
+}
+
+/* propagate auxiliary dipoles and use them as the starting point */
+static void xl_pol_propagate(struct md *md)
+{
+	static const double coef[XL_POL_K + 1] = { -6.0, 14.0, -8.0, -3.0,
+	    4.0, -1.0 };
+	const double kappa = 1.82;
+	const double alpha = 0.018;
+
+	struct xl_pol_data *xl = md->xl_pol;
+	double *next = xl->aux[XL_POL_K];
+	double *next_conj = xl->aux_conj[XL_POL_K];
+
+	for (size_t i = 0; i < 3 * xl->n_dip; i++) {
+		double sum = 0.0, sum_conj = 0.0;
+
+		for (size_t k = 0; k <= XL_POL_K; k++) {
+			sum += coef[k] * xl->aux[k][i];
+			sum_conj += coef[k] * xl->aux_conj[k][i];
+		}
+
+		next[i] = 2.0 * xl->aux[0][i] - xl->aux[1][i] +
+		    kappa * (xl->dip[i] - xl->aux[0][i]) + alpha * sum;
+		next_conj[i] = 2.0 * xl->aux_conj[0][i] - xl->aux_conj[1][i] +
+		    kappa * (xl->dip_conj[i] - xl->aux_conj[0][i]) +
+		    alpha * sum_conj;
+	}
+
+	/* the oldest buffer now holds the newest dipoles */
+	for (size_t k = XL_POL_K; k > 0; k--) {
+		xl->aux[k] = xl->aux[k - 1];
+		xl->aux_conj[k] = xl->aux_conj[k - 1];
+	}
+
+	xl->aux[0] = next;
+	xl->aux_conj[0] = next_conj;
+
+	check_fail(efp_set_induced_dipoles(md->state->efp, next, next_conj));
+}
+
+static void xl_pol_update(struct md *md, bool anchor)
+{
+	struct xl_pol_data *xl = md->xl_pol;
+	size_t size = 3 * xl->n_dip * sizeof(double);
+
+	check_fail(efp_get_induced_dipole_values(md->state->efp, xl->dip));
+	check_fail(efp_get_induced_dipole_conj_values(md->state->efp,
+	    xl->dip_conj));
+
+	/* restart the auxiliary trajectory from the scf solution */
+	if (anchor) {
+		for (size_t k = 0; k <= XL_POL_K; k++) {
+			memcpy(xl->aux[k], xl->dip, size);
+			memcpy(xl->aux_conj[k], xl->dip_conj, size);
+		}
+	}
+}
+
+/*
+ * Loosen polarization convergence threshold while the drift of the invariant
+ * stays well below pol_drift_max and tighten it back down to pol_scf_tol once
+ * the drift exceeds it.
+ */
+static void adjust_pol_tol(struct md *md)
+{
+	struct efp_opts opts;
+	double invariant = md->get_invariant(md);
+	double drift = fabs(invariant - md->pol_tol_invariant) / POL_TOL_STEPS;
+	double tol_min = cfg_get_double(md->state->cfg, "pol_scf_tol");
+	double tol_max = cfg_get_double(md->state->cfg, "pol_tol_max");
+	double drift_max = cfg_get_double(md->state->cfg, "pol_drift_max");
+	double tol = md->pol_tol;
+
+	md->pol_tol_invariant = invariant;
+
+	if (drift > drift_max)
+		tol = fmax(0.1 * tol, tol_min);
+	else if (drift < 0.1 * drift_max)
+		tol = fmin(10.0 * tol, tol_max);
+
+	if (tol == md->pol_tol)
+		return;
+
+	md->pol_tol = tol;
+
+	check_fail(efp_get_opts(md->state->efp, &opts));
+	opts.pol_scf_tol = tol;
+	check_fail(efp_set_opts(md->state->efp, &opts));
+}
+
 static void compute_forces(struct md *md)
 {
+	bool anchor = false;
+
+	if (md->xl_pol) {
+		anchor = md->step % cfg_get_int(md->state->cfg,
+		    "xl_pol_steps") == 0;
+		xl_pol_set_iter(md, anchor);
+	}
+
 	for (size_t i = 0; i < md->n_bodies; i++) {
 		double crd[12];
 
@@ -328,6 +470,9 @@ static void compute_forces(struct md *md)
 		    EFP_COORD_TYPE_ROTMAT, crd));
 	}
 
+	if (md->xl_pol && !anchor)
+		xl_pol_propagate(md);
+
 	if (cfg_get_bool(md->state->cfg, "enable_multistep")) {
 		struct efp_opts opts, opts_save;
 		int multistep_steps;
@@ -354,6 +499,9 @@ static void compute_forces(struct md *md)
 	} else
 		compute_energy(md->state, true);
 
+	if (md->xl_pol)
+		xl_pol_update(md, anchor);
+
 	md->potential_energy = md->state->energy;
 
 	for (size_t i = 0; i < md->n_bodies; i++) {
@@ -738,6 +886,9 @@ static void print_info(const struct md *md)
 	msg("%30s %16.10lf\n", "INVARIANT", invariant);
 	msg("%30s %16.10lf\n", "TEMPERATURE (K)", temperature);
 
+	if (cfg_get_bool(md->state->cfg, "enable_adaptive_pol_tol"))
+		msg("%30s %16.4le\n", "POLARIZATION TOLERANCE", md->pol_tol);
+
 	if (cfg_get_enum(md->state->cfg, "ensemble") == ENSEMBLE_TYPE_NPT) {
 		double pressure = get_pressure(md) / BAR_TO_AU;
 
@@ -787,6 +938,38 @@ static void print_restart(const struct md *md)
 	msg("\n");
 }
 
+static struct xl_pol_data *xl_pol_create(struct efp *efp)
+{
+	struct xl_pol_data *xl = xcalloc(1, sizeof(struct xl_pol_data));
+
+	check_fail(efp_get_induced_dipole_count(efp, &xl->n_dip));
+
+	for (size_t k = 0; k <= XL_POL_K; k++) {
+		xl->aux[k] = xcalloc(3 * xl->n_dip + 1, sizeof(double));
+		xl->aux_conj[k] = xcalloc(3 * xl->n_dip + 1, sizeof(double));
+	}
+
+	xl->dip = xcalloc(3 * xl->n_dip + 1, sizeof(double));
+	xl->dip_conj = xcalloc(3 * xl->n_dip + 1, sizeof(double));
+
+	return xl;
+}
+
+static void xl_pol_free(struct xl_pol_data *xl)
+{
+	if (xl == NULL)
+		return;
+
+	for (size_t k = 0; k <= XL_POL_K; k++) {
+		free(xl->aux[k]);
+		free(xl->aux_conj[k]);
+	}
+
+	free(xl->dip);
+	free(xl->dip_conj);
+	free(xl);
+}
+
 static struct md *md_create(struct state *state)
 {
 	struct md *md = xcalloc(1, sizeof(struct md));
@@ -813,6 +996,18 @@ static struct md *md_create(struct state *state)
 			assert(0);
 	}
 
+	if (cfg_get_enum(state->cfg, "ensemble") == ENSEMBLE_TYPE_NPT) {
+		struct efp_opts opts;
+
+		/* pressure is computed from the stress tensor */
+		check_fail(efp_get_opts(state->efp, &opts));
+		opts.enable_stress = 1;
+		check_fail(efp_set_opts(state->efp, &opts));
+	}
+
+	if (cfg_get_bool(state->cfg, "enable_xl_pol"))
+		md->xl_pol = xl_pol_create(state->efp);
+
 	md->n_bodies = state->sys->n_frags;
 	md->bodies = xcalloc(md->n_bodies, sizeof(struct body));
 	md->xr_gradient = xcalloc(6 * md->n_bodies, sizeof(double));
@@ -899,6 +1094,7 @@ static void md_shutdown(struct md *md)
 	free(md->bodies);
 	free(md->xr_gradient);
 	free(md->data);
+	xl_pol_free(md->xl_pol);
 	free(md);
 }
 
@@ -914,6 +1110,9 @@ void sim_md(struct state *state)
 	remove_system_drift(md);
 	compute_forces(md);
 
+	md->pol_tol = cfg_get_double(state->cfg, "pol_scf_tol");
+	md->pol_tol_invariant = md->get_invariant(md);
+
 	msg("    INITIAL STATE\n\n");
 	print_status(md);
 
@@ -922,6 +1121,10 @@ void sim_md(struct state *state)
 	     md->step++) {
 		md->update_step(md);
 
+		if (cfg_get_bool(state->cfg, "enable_adaptive_pol_tol") &&
+		    md->step % POL_TOL_STEPS == 0)
+			adjust_pol_tol(md);
+
 		if (md->step % cfg_get_int(state->cfg, "print_step") == 0) {
 			msg("    STATE AFTER %d STEPS\n\n", md->step);
 			print_status(md);
@@ -146,6 +146,16 @@ function efp_skip_fragments(efp, i, j, value) bind(c)
   integer(c_int), value :: value
 end function
 
+! efp_result_t efp_get_skip_fragments(struct efp *efp, size_t i, size_t j, int *value);
+function efp_get_skip_fragments(efp, i, j, value) bind(c)
+  use iso_c_binding, only: c_int, c_ptr, c_size_t
+  integer(c_int) :: efp_get_skip_fragments
+  type(c_ptr), value :: efp
+  integer(c_size_t), value :: i
+  integer(c_size_t), value :: j
+  type(c_ptr), value :: value
+end function
+
 ! efp_result_t efp_set_electron_density_field_fn(struct efp *efp, efp_electron_density_field_fn fn);
 function efp_set_electron_density_field_fn(efp, fn) bind(c)
   use iso_c_binding, only: c_int, c_ptr, c_funptr
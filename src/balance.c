@@ -36,6 +36,16 @@
 #include "private.h"
 
 #ifdef EFP_USE_MPI
+/* communicator set by efp_set_mpi_comm, MPI_COMM_WORLD if none */
+static MPI_Comm _comm;
+static int _have_comm;
+
+MPI_Comm
+efp_comm(void)
+{
+	return _have_comm ? _comm : MPI_COMM_WORLD;
+}
+
 struct master {
 	int total, range[2];
 };
@@ -67,22 +77,22 @@ master_on_master(struct master *master)
 	MPI_Status status;
 	int size, range[2];
 
-	MPI_Comm_size(MPI_COMM_WORLD, &size);
+	MPI_Comm_size(efp_comm(), &size);
 
 	while (master_get_work(master, range)) {
 		MPI_Recv(NULL, 0, MPI_INT, MPI_ANY_SOURCE, 0,
-		    MPI_COMM_WORLD, &status);
+		    efp_comm(), &status);
 		MPI_Send(range, 2, MPI_INT, status.MPI_SOURCE, 0,
-		    MPI_COMM_WORLD);
+		    efp_comm());
 	}
 
 	range[0] = range[1] = -1;
 
 	for (int i = 1; i < size; i++) {
 		MPI_Recv(NULL, 0, MPI_INT, MPI_ANY_SOURCE, 0,
-		    MPI_COMM_WORLD, &status);
+		    efp_comm(), &status);
 		MPI_Send(range, 2, MPI_INT, status.MPI_SOURCE, 0,
-		    MPI_COMM_WORLD);
+		    efp_comm());
 	}
 }
 
@@ -128,8 +138,8 @@ do_slave(struct efp *efp, work_fn fn, void *data)
 	int range[2];
 
 	for (;;) {
-		MPI_Send(NULL, 0, MPI_INT, 0, 0, MPI_COMM_WORLD);
-		MPI_Recv(range, 2, MPI_INT, 0, 0, MPI_COMM_WORLD,
+		MPI_Send(NULL, 0, MPI_INT, 0, 0, efp_comm());
+		MPI_Recv(range, 2, MPI_INT, 0, 0, efp_comm(),
 		    MPI_STATUS_IGNORE);
 
 		if (range[0] == -1 ||
@@ -141,12 +151,27 @@ do_slave(struct efp *efp, work_fn fn, void *data)
 }
 #endif /* EFP_USE_MPI */
 
+void
+efp_set_comm(const void *comm)
+{
+#ifdef EFP_USE_MPI
+	if (comm == NULL) {
+		_have_comm = 0;
+	} else {
+		_comm = *(const MPI_Comm *)comm;
+		_have_comm = 1;
+	}
+#else
+	(void)comm;
+#endif
+}
+
 void
 efp_allreduce(double *x, size_t n)
 {
 #ifdef EFP_USE_MPI
 	MPI_Allreduce(MPI_IN_PLACE, x, (int)n, MPI_DOUBLE,
-	    MPI_SUM, MPI_COMM_WORLD);
+	    MPI_SUM, efp_comm());
 #else
 	(void)x;
 	(void)n;
@@ -159,22 +184,78 @@ efp_balance_work(struct efp *efp, work_fn fn, void *data)
 #ifdef EFP_USE_MPI
 	int rank, size;
 
-	MPI_Comm_rank(MPI_COMM_WORLD, &rank);
-	MPI_Comm_size(MPI_COMM_WORLD, &size);
+	MPI_Comm_rank(efp_comm(), &rank);
+	MPI_Comm_size(efp_comm(), &size);
 
 	if (size == 1)
 		fn(efp, 0, efp->n_frag, data);
 	else {
-		MPI_Barrier(MPI_COMM_WORLD);
+		MPI_Barrier(efp_comm());
 
 		if (rank == 0)
 			do_master(efp, fn, data);
 		else
 			do_slave(efp, fn, data);
 
-		MPI_Barrier(MPI_COMM_WORLD);
+		MPI_Barrier(efp_comm());
 	}
 #else
 	fn(efp, 0, efp->n_frag, data);
 #endif
 }
+
+/* static partition of work items between MPI processes */
+void
+efp_partition_work(size_t n, size_t *from, size_t *to)
+{
+#ifdef EFP_USE_MPI
+	int rank, size;
+
+	MPI_Comm_rank(efp_comm(), &rank);
+	MPI_Comm_size(efp_comm(), &size);
+
+	*from = n * (size_t)rank / (size_t)size;
+	*to = n * (size_t)(rank + 1) / (size_t)size;
+#else
+	*from = 0;
+	*to = n;
+#endif
+}
+
+/*
+ * Loops over fragments use schedule(runtime). With enable_numa fragments are
+ * split between threads with the same static partition as the first touch in
+ * efp_prepare so that threads work on local memory. Otherwise fragments are
+ * scheduled dynamically. The previous schedule is saved so that the setting
+ * does not leak to the caller.
+ */
+void
+efp_frag_schedule(const struct efp *efp, struct frag_schedule *saved)
+{
+#ifdef _OPENMP
+	omp_sched_t kind;
+	int chunk;
+
+	omp_get_schedule(&kind, &chunk);
+	saved->kind = (int)kind;
+	saved->chunk = chunk;
+
+	if (efp->opts.enable_numa)
+		omp_set_schedule(omp_sched_static, 0);
+	else
+		omp_set_schedule(omp_sched_dynamic, 1);
+#else
+	(void)efp;
+	(void)saved;
+#endif
+}
+
+void
+efp_restore_schedule(const struct frag_schedule *saved)
+{
+#ifdef _OPENMP
+	omp_set_schedule((omp_sched_t)saved->kind, saved->chunk);
+#else
+	(void)saved;
+#endif
+}
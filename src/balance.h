@@ -29,11 +29,28 @@
 
 #include <stddef.h>
 
+#ifdef EFP_USE_MPI
+#include <mpi.h>
+#endif
+
 struct efp;
 
 typedef void (*work_fn)(struct efp *, size_t, size_t, void *);
 
+/* OpenMP loop schedule saved by efp_frag_schedule */
+struct frag_schedule {
+	int kind;
+	int chunk;
+};
+
+#ifdef EFP_USE_MPI
+MPI_Comm efp_comm(void);
+#endif
+void efp_set_comm(const void *);
 void efp_allreduce(double *, size_t);
 void efp_balance_work(struct efp *, work_fn, void *);
+void efp_partition_work(size_t, size_t *, size_t *);
+void efp_frag_schedule(const struct efp *, struct frag_schedule *);
+void efp_restore_schedule(const struct frag_schedule *);
 
 #endif /* LIBEFP_BALANCE_H */
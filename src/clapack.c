@@ -61,6 +61,23 @@ void dgesv_(fortranint_t *,
 	    fortranint_t *,
 	    fortranint_t *);
 
+void dgetrf_(fortranint_t *,
+	     fortranint_t *,
+	     double *,
+	     fortranint_t *,
+	     fortranint_t *,
+	     fortranint_t *);
+
+void dgetrs_(char *,
+	     fortranint_t *,
+	     fortranint_t *,
+	     double *,
+	     fortranint_t *,
+	     fortranint_t *,
+	     double *,
+	     fortranint_t *,
+	     fortranint_t *);
+
 void
 efp_dgemm(char transa, char transb, fortranint_t m, fortranint_t n,
     fortranint_t k, double alpha, double *a, fortranint_t lda, double *b,
@@ -96,3 +113,24 @@ efp_dgesv(fortranint_t n, fortranint_t nrhs, double *a, fortranint_t lda,
 
 	return info;
 }
+
+fortranint_t
+efp_dgetrf(fortranint_t n, double *a, fortranint_t lda, fortranint_t *ipiv)
+{
+	fortranint_t info;
+
+	dgetrf_(&n, &n, a, &lda, ipiv, &info);
+
+	return info;
+}
+
+fortranint_t
+efp_dgetrs(char trans, fortranint_t n, fortranint_t nrhs, double *a,
+    fortranint_t lda, fortranint_t *ipiv, double *b, fortranint_t ldb)
+{
+	fortranint_t info;
+
+	dgetrs_(&trans, &n, &nrhs, a, &lda, ipiv, b, &ldb, &info);
+
+	return info;
+}
@@ -62,4 +62,18 @@ fortranint_t efp_dgesv(fortranint_t,
 		       double *,
 		       fortranint_t);
 
+fortranint_t efp_dgetrf(fortranint_t,
+			double *,
+			fortranint_t,
+			fortranint_t *);
+
+fortranint_t efp_dgetrs(char,
+			fortranint_t,
+			fortranint_t,
+			double *,
+			fortranint_t,
+			fortranint_t *,
+			double *,
+			fortranint_t);
+
 #endif /* LIBEFP_CLAPACK_H */
@@ -24,6 +24,10 @@
  * SUCH DAMAGE.
  */
 
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "balance.h"
 #include "private.h"
 
 static const double weights[] = {
@@ -35,6 +39,43 @@ static const double weights[] = {
 	0.69792344511487082324E+01, 0.83248093882965845391E+02
 };
 
+#define N_FREQ ARRAY_SIZE(weights)
+
+/*
+ * Ewald splitting parameter times the distance where the switching function
+ * starts (0.8 of the cutoff, see swf.c). The real space part of 1 / r^6 falls
+ * to 4e-4 of its value there. The reciprocal space sum is truncated with the
+ * same accuracy.
+ */
+#define DISP_EWALD_X 3.5
+
+static double
+get_ewald_beta(const struct efp *efp)
+{
+	return DISP_EWALD_X / (0.8 * efp->opts.swf_cutoff);
+}
+
+/*
+ * Long range part of 1 / r^6 which is summed in reciprocal space:
+ *
+ * L(r) = (1 - exp(-x^2) * (1 + x^2 + x^4 / 2)) / r^6,  x = beta * r
+ *
+ * dl is set to (dL / dr) / r.
+ */
+static double
+get_ewald_long(double beta, double r, double *dl)
+{
+	double r2 = r * r;
+	double r6 = r2 * r2 * r2;
+	double x2 = beta * beta * r2;
+	double e = exp(-x2);
+	double p = 1.0 + x2 + x2 * x2 / 2.0;
+
+	*dl = -6.0 / (r6 * r2) * (1.0 - e * (p + x2 * x2 * x2 / 6.0));
+
+	return (1.0 - e * p) / r6;
+}
+
 static double
 get_damp_tt(double r)
 {
@@ -102,7 +143,7 @@ disp_tt(struct efp *efp, size_t fr_i_idx, size_t fr_j_idx, size_t pt_i_idx,
 		    CVEC(pt_i->x), &force, NULL);
 		efp_sub_force(efp->grad + fr_j_idx, CVEC(fr_j->x),
 		    CVEC(pt_j->x), &force, NULL);
-		efp_add_stress(&swf->dr, &force, &efp->stress);
+		efp_add_stress(efp, fr_i_idx, &swf->dr, &force);
 	}
 	return energy;
 }
@@ -175,7 +216,7 @@ disp_overlap(struct efp *efp, size_t fr_i_idx, size_t fr_j_idx,
 		six_atomic_add_abc(efp->grad + fr_i_idx, &torque_i);
 		six_atomic_sub_xyz(efp->grad + fr_j_idx, &force);
 		six_atomic_sub_abc(efp->grad + fr_j_idx, &torque_j);
-		efp_add_stress(&swf->dr, &force, &efp->stress);
+		efp_add_stress(efp, fr_i_idx, &swf->dr, &force);
 	}
 	return energy;
 }
@@ -218,23 +259,57 @@ disp_off(struct efp *efp, size_t fr_i_idx, size_t fr_j_idx, size_t pt_i_idx,
 		    CVEC(pt_i->x), &force, NULL);
 		efp_sub_force(efp->grad + fr_j_idx, CVEC(fr_j->x),
 		    CVEC(pt_j->x), &force, NULL);
-		efp_add_stress(&swf->dr, &force, &efp->stress);
+		efp_add_stress(efp, fr_i_idx, &swf->dr, &force);
 	}
 	return energy;
 }
 
+/* removes the part of the interaction which is computed by the reciprocal
+ * space Ewald sum */
 static double
-point_point_disp(struct efp *efp, size_t fr_i_idx, size_t fr_j_idx,
-    size_t pt_i_idx, size_t pt_j_idx, double s, six_t ds, const struct swf *swf)
+disp_ewald_real(struct efp *efp, size_t fr_i_idx, size_t fr_j_idx,
+    size_t pt_i_idx, size_t pt_j_idx, double sum, const struct swf *swf)
 {
-	struct frag *fr_i = efp->frags + fr_i_idx;
-	struct frag *fr_j = efp->frags + fr_j_idx;
+	const struct frag *fr_i = efp->frags + fr_i_idx;
+	const struct frag *fr_j = efp->frags + fr_j_idx;
 
 	const struct dynamic_polarizable_pt *pt_i =
 	    fr_i->dynamic_polarizable_pts + pt_i_idx;
 	const struct dynamic_polarizable_pt *pt_j =
 	    fr_j->dynamic_polarizable_pts + pt_j_idx;
 
+	vec_t dr = {
+		pt_j->x - pt_i->x - swf->cell.x,
+		pt_j->y - pt_i->y - swf->cell.y,
+		pt_j->z - pt_i->z - swf->cell.z
+	};
+
+	double dl;
+	double l = get_ewald_long(get_ewald_beta(efp), vec_len(&dr), &dl);
+	double energy = 4.0 / 3.0 * sum * l;
+
+	if (efp->do_gradient) {
+		double g = -4.0 / 3.0 * sum * dl;
+
+		vec_t force = {
+			g * dr.x * swf->swf,
+			g * dr.y * swf->swf,
+			g * dr.z * swf->swf
+		};
+
+		efp_add_force(efp->grad + fr_i_idx, CVEC(fr_i->x),
+		    CVEC(pt_i->x), &force, NULL);
+		efp_sub_force(efp->grad + fr_j_idx, CVEC(fr_j->x),
+		    CVEC(pt_j->x), &force, NULL);
+		efp_add_stress(efp, fr_i_idx, &swf->dr, &force);
+	}
+	return energy;
+}
+
+static double
+point_point_c6(const struct dynamic_polarizable_pt *pt_i,
+    const struct dynamic_polarizable_pt *pt_j)
+{
 	double sum = 0.0;
 
 	for (size_t k = 0; k < ARRAY_SIZE(weights); k++) {
@@ -247,18 +322,36 @@ point_point_disp(struct efp *efp, size_t fr_i_idx, size_t fr_j_idx,
 		sum += weights[k] * tr_i * tr_j;
 	}
 
+	return sum;
+}
+
+static double
+point_point_disp(struct efp *efp, size_t fr_i_idx, size_t fr_j_idx,
+    size_t pt_i_idx, size_t pt_j_idx, double sum, double s, six_t ds,
+    const struct swf *swf)
+{
+	double energy = 0.0;
+
 	switch (efp->opts.disp_damp) {
 	case EFP_DISP_DAMP_TT:
-		return disp_tt(efp, fr_i_idx, fr_j_idx,
+		energy = disp_tt(efp, fr_i_idx, fr_j_idx,
 		    pt_i_idx, pt_j_idx, sum, swf);
+		break;
 	case EFP_DISP_DAMP_OVERLAP:
-		return disp_overlap(efp, fr_i_idx, fr_j_idx,
+		energy = disp_overlap(efp, fr_i_idx, fr_j_idx,
 		    pt_i_idx, pt_j_idx, s, ds, sum, swf);
+		break;
 	case EFP_DISP_DAMP_OFF:
-		return disp_off(efp, fr_i_idx, fr_j_idx,
+		energy = disp_off(efp, fr_i_idx, fr_j_idx,
 		    pt_i_idx, pt_j_idx, sum, swf);
+		break;
 	}
-	assert(0);
+
+	if (efp->opts.enable_disp_ewald)
+		energy += disp_ewald_real(efp, fr_i_idx, fr_j_idx,
+		    pt_i_idx, pt_j_idx, sum, swf);
+
+	return energy;
 }
 
 /*
@@ -285,10 +378,21 @@ efp_frag_frag_disp(struct efp *efp, size_t frag_i, size_t frag_j,
 
 	struct swf swf = efp_make_swf(efp, fr_i, fr_j);
 
-	for (size_t ii = 0, idx = 0; ii < n_disp_i; ii++)
-		for (size_t jj = 0; jj < n_disp_j; jj++, idx++)
+	/* precomputed coefficients for this pair of fragment types */
+	const double *c6 = efp->disp_c6 ? efp->disp_c6[
+	    efp->disp_type[fr_i->lib_idx] * efp->n_disp_type +
+	    efp->disp_type[fr_j->lib_idx]] : NULL;
+
+	for (size_t ii = 0, idx = 0; ii < n_disp_i; ii++) {
+		for (size_t jj = 0; jj < n_disp_j; jj++, idx++) {
+			double sum = c6 ? c6[idx] : point_point_c6(
+			    fr_i->dynamic_polarizable_pts + ii,
+			    fr_j->dynamic_polarizable_pts + jj);
+
 			energy += point_point_disp(efp, frag_i, frag_j, ii, jj,
-			    s[idx], ds[idx], &swf);
+			    sum, s[idx], ds[idx], &swf);
+		}
+	}
 
 	vec_t force = {
 		swf.dswf.x * energy,
@@ -298,7 +402,7 @@ efp_frag_frag_disp(struct efp *efp, size_t frag_i, size_t frag_j,
 
 	six_atomic_add_xyz(efp->grad + frag_i, &force);
 	six_atomic_sub_xyz(efp->grad + frag_j, &force);
-	efp_add_stress(&swf.dr, &force, &efp->stress);
+	efp_add_stress(efp, frag_i, &swf.dr, &force);
 
 	return energy * swf.swf;
 }
@@ -323,3 +427,545 @@ efp_update_disp(struct frag *frag)
 		}
 	}
 }
+
+/*
+ * Isotropic dynamic polarizabilities are invariant under fragment rotation so
+ * dispersion coefficients only depend on the pair of fragment types. They are
+ * tabulated once for every pair of fragment types present in the system.
+ */
+enum efp_result
+efp_prepare_disp(struct efp *efp)
+{
+	size_t n_type = 0;
+
+	if (!(efp->opts.terms & EFP_TERM_DISP) || efp->n_frag == 0)
+		return EFP_RESULT_SUCCESS;
+
+	efp->disp_type = (size_t *)malloc(efp->n_lib * sizeof(size_t));
+	if (efp->disp_type == NULL)
+		return EFP_RESULT_NO_MEMORY;
+
+	for (size_t i = 0; i < efp->n_lib; i++)
+		efp->disp_type[i] = SIZE_MAX;
+
+	for (size_t i = 0; i < efp->n_frag; i++) {
+		size_t lib_idx = efp->frags[i].lib_idx;
+
+		if (efp->disp_type[lib_idx] == SIZE_MAX)
+			efp->disp_type[lib_idx] = n_type++;
+	}
+
+	efp->n_disp_type = n_type;
+	efp->disp_c6 = (double **)calloc(n_type * n_type, sizeof(double *));
+	if (efp->disp_c6 == NULL)
+		return EFP_RESULT_NO_MEMORY;
+
+	for (size_t i = 0; i < efp->n_lib; i++) {
+		const struct frag *lib_i = efp->lib[i];
+
+		if (efp->disp_type[i] == SIZE_MAX)
+			continue;
+
+		for (size_t j = 0; j < efp->n_lib; j++) {
+			const struct frag *lib_j = efp->lib[j];
+			const struct dynamic_polarizable_pt *pt_i, *pt_j;
+			size_t n_i = lib_i->n_dynamic_polarizable_pts;
+			size_t n_j = lib_j->n_dynamic_polarizable_pts;
+			double *c6;
+
+			if (efp->disp_type[j] == SIZE_MAX || n_i == 0 ||
+			    n_j == 0)
+				continue;
+
+			c6 = (double *)malloc(n_i * n_j * sizeof(double));
+			if (c6 == NULL)
+				return EFP_RESULT_NO_MEMORY;
+
+			pt_i = lib_i->dynamic_polarizable_pts;
+			pt_j = lib_j->dynamic_polarizable_pts;
+
+			for (size_t ii = 0, idx = 0; ii < n_i; ii++)
+				for (size_t jj = 0; jj < n_j; jj++, idx++)
+					c6[idx] = point_point_c6(pt_i + ii,
+					    pt_j + jj);
+
+			efp->disp_c6[efp->disp_type[i] * n_type +
+			    efp->disp_type[j]] = c6;
+		}
+	}
+
+	return EFP_RESULT_SUCCESS;
+}
+
+/*
+ * Reciprocal space part of the dispersion Ewald sum. The dispersion
+ * coefficient of two points is a sum over frequencies of products of their
+ * isotropic polarizabilities so every frequency is a separate lattice sum
+ * with a geometric combination rule. The sum is distributed over wave
+ * vectors between MPI processes and over fragments for the corrections.
+ *
+ * Reference:
+ *
+ * Pieter J. in 't Veld, Ahmed E. Ismail, Gary S. Grest
+ *
+ * Application of Ewald summations to long-range dispersion forces
+ *
+ * J. Chem. Phys. 127, 144711 (2007)
+ */
+
+struct ewald_k {
+	/* wave vector and its integer components */
+	vec_t k;
+	int n[3];
+
+	/* 2 as only one of k and -k is stored, 1 for k = 0 */
+	double weight;
+
+	/* Fourier transform of L(r) divided by the cell volume */
+	double lk;
+
+	/* derivative of lk with respect to |k| divided by |k| */
+	double dlk;
+};
+
+struct ewald_data {
+	/* number of dynamic polarizable points */
+	size_t n_pts;
+
+	/* offsets of points of each fragment, n_frag + 1 */
+	size_t *offset;
+
+	/* coordinates of points */
+	vec_t *xyz;
+
+	/* square roots of dispersion coefficients, n_pts * N_FREQ */
+	double *coef;
+
+	/* cos and sin of 2 pi n x / L for each dimension, n from zero to
+	 * n_max, stored by n first */
+	size_t n_max[3];
+	double *phase[3];
+
+	/* wave vectors of this process */
+	size_t n_k;
+	struct ewald_k *k;
+
+	/* structure factors, n_k * N_FREQ complex numbers */
+	double *sf;
+};
+
+/* Fourier transform of L(r) and its derivative divided by k */
+static double
+get_ewald_long_ft(double beta, double k, double *dlk)
+{
+	double b = k / (2.0 * beta);
+	double e = exp(-b * b);
+	double t = sqrt(PI) * b * erfc(b);
+
+	*dlk = PI * sqrt(PI) * beta / 2.0 * (t - e);
+
+	return PI * sqrt(PI) * beta * beta * beta / 3.0 *
+	    ((1.0 - 2.0 * b * b) * e + 2.0 * b * b * t);
+}
+
+static void
+get_phase(const struct ewald_data *data, size_t pt, const int *n, double *re,
+    double *im)
+{
+	double c = 1.0, s = 0.0;
+
+	for (size_t d = 0; d < 3; d++) {
+		size_t idx = (size_t)abs(n[d]) * data->n_pts + pt;
+		double pc = data->phase[d][2 * idx];
+		double ps = n[d] < 0 ? -data->phase[d][2 * idx + 1] :
+		    data->phase[d][2 * idx + 1];
+		double t = c * pc - s * ps;
+
+		s = c * ps + s * pc;
+		c = t;
+	}
+
+	*re = c;
+	*im = s;
+}
+
+static int
+is_half_space(int nx, int ny, int nz)
+{
+	return nx > 0 || (nx == 0 && ny > 0) || (nx == 0 && ny == 0 && nz >= 0);
+}
+
+static enum efp_result
+ewald_setup_k(struct efp *efp, struct ewald_data *data)
+{
+	double box[3] = { efp->box.x, efp->box.y, efp->box.z };
+	double beta = get_ewald_beta(efp);
+	double kmax = 2.0 * beta * DISP_EWALD_X;
+	double volume = box[0] * box[1] * box[2];
+	size_t n_k = 0, from, to;
+	int n_max[3];
+
+	for (size_t d = 0; d < 3; d++) {
+		n_max[d] = (int)(kmax * box[d] / (2.0 * PI));
+		data->n_max[d] = (size_t)n_max[d];
+	}
+
+	for (int pass = 0; pass < 2; pass++) {
+		size_t idx = 0;
+
+		for (int nx = 0; nx <= n_max[0]; nx++)
+		for (int ny = -n_max[1]; ny <= n_max[1]; ny++)
+		for (int nz = -n_max[2]; nz <= n_max[2]; nz++) {
+			vec_t k = {
+				2.0 * PI * nx / box[0],
+				2.0 * PI * ny / box[1],
+				2.0 * PI * nz / box[2]
+			};
+
+			if (!is_half_space(nx, ny, nz) ||
+			    vec_len_2(&k) > kmax * kmax)
+				continue;
+
+			if (pass == 1 && idx >= from && idx < to) {
+				struct ewald_k *out = data->k + idx - from;
+				double lk, dlk;
+
+				lk = get_ewald_long_ft(beta, vec_len(&k), &dlk);
+
+				out->k = k;
+				out->n[0] = nx;
+				out->n[1] = ny;
+				out->n[2] = nz;
+				out->weight = idx == 0 ? 1.0 : 2.0;
+				out->lk = lk / volume;
+				out->dlk = dlk / volume;
+			}
+			idx++;
+		}
+
+		if (pass == 0) {
+			n_k = idx;
+			efp_partition_work(n_k, &from, &to);
+			data->n_k = to - from;
+			data->k = (struct ewald_k *)efp_alloc(efp,
+			    (data->n_k + 1) * sizeof(struct ewald_k));
+			data->sf = (double *)efp_alloc(efp,
+			    (data->n_k * N_FREQ + 1) * 2 * sizeof(double));
+
+			if (data->k == NULL || data->sf == NULL)
+				return EFP_RESULT_NO_MEMORY;
+		}
+	}
+
+	return EFP_RESULT_SUCCESS;
+}
+
+static enum efp_result
+ewald_setup(struct efp *efp, struct ewald_data *data)
+{
+	double box[3] = { efp->box.x, efp->box.y, efp->box.z };
+
+	data->offset = (size_t *)efp_alloc(efp,
+	    (efp->n_frag + 1) * sizeof(size_t));
+
+	if (data->offset == NULL)
+		return EFP_RESULT_NO_MEMORY;
+
+	data->offset[0] = 0;
+
+	for (size_t i = 0; i < efp->n_frag; i++)
+		data->offset[i + 1] = data->offset[i] +
+		    efp->frags[i].n_dynamic_polarizable_pts;
+
+	data->n_pts = data->offset[efp->n_frag];
+	data->xyz = (vec_t *)efp_alloc(efp, (data->n_pts + 1) * sizeof(vec_t));
+	data->coef = (double *)efp_alloc(efp,
+	    (data->n_pts * N_FREQ + 1) * sizeof(double));
+
+	if (data->xyz == NULL || data->coef == NULL)
+		return EFP_RESULT_NO_MEMORY;
+
+	for (size_t i = 0; i < efp->n_frag; i++) {
+		const struct frag *frag = efp->frags + i;
+
+		for (size_t j = 0; j < frag->n_dynamic_polarizable_pts; j++) {
+			const struct dynamic_polarizable_pt *pt =
+			    frag->dynamic_polarizable_pts + j;
+			size_t idx = data->offset[i] + j;
+
+			data->xyz[idx] = *CVEC(pt->x);
+
+			for (size_t k = 0; k < N_FREQ; k++) {
+				double tr = (pt->tensor[k].xx +
+					     pt->tensor[k].yy +
+					     pt->tensor[k].zz) / 3;
+
+				data->coef[idx * N_FREQ + k] =
+				    sqrt(4.0 / 3.0 * weights[k]) * tr;
+			}
+		}
+	}
+
+	if (ewald_setup_k(efp, data))
+		return EFP_RESULT_NO_MEMORY;
+
+	for (size_t d = 0; d < 3; d++) {
+		size_t n = data->n_max[d] + 1;
+
+		data->phase[d] = (double *)efp_alloc(efp,
+		    (n * data->n_pts + 1) * 2 * sizeof(double));
+
+		if (data->phase[d] == NULL)
+			return EFP_RESULT_NO_MEMORY;
+
+		for (size_t i = 0; i < data->n_pts; i++) {
+			double x = ((const double *)(data->xyz + i))[d];
+			double t = 2.0 * PI * x / box[d];
+
+			for (size_t j = 0; j < n; j++) {
+				size_t idx = j * data->n_pts + i;
+
+				data->phase[d][2 * idx] = cos(t * j);
+				data->phase[d][2 * idx + 1] = sin(t * j);
+			}
+		}
+	}
+
+	return EFP_RESULT_SUCCESS;
+}
+
+static void
+ewald_free(struct efp *efp, struct ewald_data *data)
+{
+	efp_free(efp, data->offset);
+	efp_free(efp, data->xyz);
+	efp_free(efp, data->coef);
+	efp_free(efp, data->k);
+	efp_free(efp, data->sf);
+
+	for (size_t d = 0; d < 3; d++)
+		efp_free(efp, data->phase[d]);
+}
+
+static double
+ewald_recip_energy(struct efp *efp, struct ewald_data *data)
+{
+	double energy = 0.0;
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic) reduction(+:energy)
+#endif
+	for (size_t ik = 0; ik < data->n_k; ik++) {
+		const struct ewald_k *k = data->k + ik;
+		double *sf = data->sf + 2 * ik * N_FREQ;
+		double sf2 = 0.0;
+
+		memset(sf, 0, 2 * N_FREQ * sizeof(double));
+
+		for (size_t i = 0; i < data->n_pts; i++) {
+			const double *coef = data->coef + i * N_FREQ;
+			double re, im;
+
+			get_phase(data, i, k->n, &re, &im);
+
+			for (size_t c = 0; c < N_FREQ; c++) {
+				sf[2 * c] += coef[c] * re;
+				sf[2 * c + 1] += coef[c] * im;
+			}
+		}
+
+		for (size_t c = 0; c < N_FREQ; c++)
+			sf2 += sf[2 * c] * sf[2 * c] +
+			    sf[2 * c + 1] * sf[2 * c + 1];
+
+		energy -= 0.5 * k->weight * k->lk * sf2;
+	}
+
+	if (efp->do_gradient && efp->opts.enable_stress) {
+		/* change of the sum with the cell shape at fixed fractional
+		 * coordinates of all points */
+		for (size_t ik = 0; ik < data->n_k; ik++) {
+			const struct ewald_k *k = data->k + ik;
+			const double *sf = data->sf + 2 * ik * N_FREQ;
+			double sf2 = 0.0;
+
+			for (size_t c = 0; c < N_FREQ; c++)
+				sf2 += sf[2 * c] * sf[2 * c] +
+				    sf[2 * c + 1] * sf[2 * c + 1];
+
+			double a = -0.5 * k->weight * sf2 * k->lk;
+			double b = -0.5 * k->weight * sf2 * k->dlk;
+
+			efp->stress.xx += a + b * k->k.x * k->k.x;
+			efp->stress.xy += b * k->k.x * k->k.y;
+			efp->stress.xz += b * k->k.x * k->k.z;
+			efp->stress.yx += b * k->k.y * k->k.x;
+			efp->stress.yy += a + b * k->k.y * k->k.y;
+			efp->stress.yz += b * k->k.y * k->k.z;
+			efp->stress.zx += b * k->k.z * k->k.x;
+			efp->stress.zy += b * k->k.z * k->k.y;
+			efp->stress.zz += a + b * k->k.z * k->k.z;
+		}
+	}
+
+	return energy;
+}
+
+static void
+ewald_recip_grad(struct efp *efp, struct ewald_data *data)
+{
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+	for (size_t i = 0; i < efp->n_frag; i++) {
+		const struct frag *frag = efp->frags + i;
+
+		for (size_t j = data->offset[i]; j < data->offset[i + 1]; j++) {
+			const double *coef = data->coef + j * N_FREQ;
+			vec_t grad = { 0.0, 0.0, 0.0 };
+
+			for (size_t ik = 0; ik < data->n_k; ik++) {
+				const struct ewald_k *k = data->k + ik;
+				const double *sf = data->sf + 2 * ik * N_FREQ;
+				double re, im, t = 0.0;
+
+				get_phase(data, j, k->n, &re, &im);
+
+				for (size_t c = 0; c < N_FREQ; c++)
+					t += coef[c] * (sf[2 * c] * im -
+					    sf[2 * c + 1] * re);
+
+				t *= k->weight * k->lk;
+
+				grad.x += t * k->k.x;
+				grad.y += t * k->k.y;
+				grad.z += t * k->k.z;
+			}
+
+			/* points move with the fragment center when the cell
+			 * is deformed */
+			vec_t dr = vec_sub(data->xyz + j, CVEC(frag->x));
+
+			efp_add_force(efp->grad + i, CVEC(frag->x),
+			    data->xyz + j, &grad, NULL);
+			efp_add_stress(efp, i, &dr, &grad);
+		}
+	}
+}
+
+static double
+ewald_pair_coef(const struct ewald_data *data, size_t i, size_t j)
+{
+	double sum = 0.0;
+
+	for (size_t c = 0; c < N_FREQ; c++)
+		sum += data->coef[i * N_FREQ + c] * data->coef[j * N_FREQ + c];
+
+	return sum;
+}
+
+/* reciprocal space sum includes interaction of every point with itself, with
+ * points of the same fragment and of skipped fragment pairs */
+static double
+ewald_corrections(struct efp *efp, struct ewald_data *data)
+{
+	double beta = get_ewald_beta(efp);
+	double beta6 = beta * beta * beta * beta * beta * beta;
+	double energy = 0.0;
+	size_t from, to;
+
+	efp_partition_work(efp->n_frag, &from, &to);
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic) reduction(+:energy)
+#endif
+	for (size_t i = from; i < to; i++) {
+		for (size_t p = data->offset[i]; p < data->offset[i + 1]; p++) {
+			energy += beta6 / 12.0 * ewald_pair_coef(data, p, p);
+
+			/* fragments are rigid so there is no gradient */
+			for (size_t q = p + 1; q < data->offset[i + 1]; q++) {
+				vec_t dr = vec_sub(data->xyz + q,
+				    data->xyz + p);
+				double dl;
+
+				energy += ewald_pair_coef(data, p, q) *
+				    get_ewald_long(beta, vec_len(&dr), &dl);
+			}
+		}
+
+		for (size_t j = i + 1; j < efp->n_frag; j++) {
+			if (!efp->skiplist[i * efp->n_frag + j])
+				continue;
+
+			struct swf swf = efp_make_swf(efp, efp->frags + i,
+			    efp->frags + j);
+
+			for (size_t p = data->offset[i];
+			    p < data->offset[i + 1]; p++) {
+				for (size_t q = data->offset[j];
+				    q < data->offset[j + 1]; q++) {
+					vec_t dr = {
+						data->xyz[q].x -
+						    data->xyz[p].x - swf.cell.x,
+						data->xyz[q].y -
+						    data->xyz[p].y - swf.cell.y,
+						data->xyz[q].z -
+						    data->xyz[p].z - swf.cell.z
+					};
+					double sum = ewald_pair_coef(data, p, q);
+					double dl;
+
+					energy += sum * get_ewald_long(beta,
+					    vec_len(&dr), &dl);
+
+					if (!efp->do_gradient)
+						continue;
+
+					vec_t force = {
+						-sum * dl * dr.x,
+						-sum * dl * dr.y,
+						-sum * dl * dr.z
+					};
+
+					efp_add_force(efp->grad + i,
+					    CVEC(efp->frags[i].x),
+					    data->xyz + p, &force, NULL);
+					efp_sub_force(efp->grad + j,
+					    CVEC(efp->frags[j].x),
+					    data->xyz + q, &force, NULL);
+					efp_add_stress(efp, i, &swf.dr, &force);
+				}
+			}
+		}
+	}
+
+	return energy;
+}
+
+enum efp_result
+efp_compute_disp_ewald(struct efp *efp)
+{
+	struct ewald_data data;
+	enum efp_result res;
+	double energy = 0.0;
+
+	if (!(efp->opts.terms & EFP_TERM_DISP) ||
+	    !efp->opts.enable_disp_ewald)
+		return EFP_RESULT_SUCCESS;
+
+	memset(&data, 0, sizeof(data));
+
+	if ((res = ewald_setup(efp, &data)) == EFP_RESULT_SUCCESS) {
+		energy += ewald_recip_energy(efp, &data);
+		energy += ewald_corrections(efp, &data);
+
+		if (efp->do_gradient)
+			ewald_recip_grad(efp, &data);
+
+		efp->energy.dispersion += energy;
+	}
+
+	ewald_free(efp, &data);
+	return res;
+}
@@ -24,6 +24,7 @@
  * SUCH DAMAGE.
  */
 
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 
@@ -31,8 +32,171 @@
 #include "clapack.h"
 #include "elec.h"
 #include "private.h"
+#include "shm.h"
 #include "stream.h"
 
+static enum efp_result
+setup_lib_inertia(struct frag *lib)
+{
+	mat_t inertia = mat_zero;
+	vec_t eigen;
+
+	lib->total_mass = 0.0;
+
+	/* positions are relative to the fragment origin, which is also used
+	 * for placed fragments in efp_get_atomic_gradient */
+	for (size_t i = 0; i < lib->n_atoms; i++) {
+		const struct efp_atom *at = lib->atoms + i;
+
+		lib->total_mass += at->mass;
+
+		inertia.xx += at->mass * (at->y * at->y + at->z * at->z);
+		inertia.yy += at->mass * (at->x * at->x + at->z * at->z);
+		inertia.zz += at->mass * (at->x * at->x + at->y * at->y);
+		inertia.xy -= at->mass * at->x * at->y;
+		inertia.yx -= at->mass * at->x * at->y;
+		inertia.xz -= at->mass * at->x * at->z;
+		inertia.zx -= at->mass * at->x * at->z;
+		inertia.yz -= at->mass * at->y * at->z;
+		inertia.zy -= at->mass * at->y * at->z;
+	}
+
+	/* eigenvectors are stored in rows */
+	if (efp_dsyev('V', 'U', 3, (double *)&inertia, 3, (double *)&eigen)) {
+		efp_log("inertia tensor diagonalization failed");
+		return EFP_RESULT_FATAL;
+	}
+
+	lib->inertia_axes = inertia;
+	lib->atom_inertia = (double *)malloc(
+	    (3 * lib->n_atoms + 1) * sizeof(double));
+	if (lib->atom_inertia == NULL)
+		return EFP_RESULT_NO_MEMORY;
+
+	for (size_t l = 0; l < 3; l++) {
+		const vec_t *axis = (const vec_t *)&lib->inertia_axes + l;
+
+		for (size_t i = 0; i < lib->n_atoms; i++) {
+			vec_t r = vec_cross(axis, CVEC(lib->atoms[i].x));
+			double dist = vec_len(&r);
+
+			lib->atom_inertia[l * lib->n_atoms + i] =
+			    lib->atoms[i].mass * dist * dist;
+		}
+	}
+
+	return EFP_RESULT_SUCCESS;
+}
+
+static int
+is_pol_symmetric(const struct efp *efp)
+{
+	for (size_t i = 0; i < efp->n_frag; i++) {
+		const struct frag *lib = efp->frags[i].lib;
+
+		for (size_t j = 0; j < lib->n_polarizable_pts; j++) {
+			const mat_t *t = &lib->polarizable_pts[j].tensor;
+
+			if (t->xy != t->yx || t->xz != t->zx || t->yz != t->zy)
+				return 0;
+		}
+	}
+	return 1;
+}
+
+/* select pair kernels compiled for the sizes of this fragment type */
+static void
+select_kernels(struct frag *lib)
+{
+	lib->elec_kernel = FRAG_KERNEL_GENERIC;
+	lib->xr_kernel = FRAG_KERNEL_GENERIC;
+
+#define X(name, mult, lmo, wf) \
+	if (lib->n_multipole_pts == mult) \
+		lib->elec_kernel = FRAG_KERNEL_##name; \
+	if (lib->n_lmo == lmo && lib->xr_wf_size == wf) \
+		lib->xr_kernel = FRAG_KERNEL_##name;
+	FRAG_KERNEL_TYPES(X)
+#undef X
+}
+
+static void
+atomic_gradient_frag(const struct efp *efp, size_t frag_idx,
+    const vec_t *extra, vec_t *grad)
+{
+	const struct frag *frag = efp->frags + frag_idx;
+	const struct frag *lib = frag->lib;
+	size_t nr = frag->n_atoms;
+	six_t fgrad = efp->grad[frag_idx];
+	vec_t tq, rt, ri, rbuf, rbuf2;
+	double I, ft, sina, norm;
+
+	/* gather additional atomic forces on the fragment */
+	if (extra) {
+		for (size_t i = 0; i < nr; i++) {
+			vec_t r = vec_sub(CVEC(frag->atoms[i].x),
+			    CVEC(frag->x));
+
+			rbuf = vec_cross(&r, extra + i);
+			fgrad.x += extra[i].x;
+			fgrad.y += extra[i].y;
+			fgrad.z += extra[i].z;
+			fgrad.a += rbuf.x;
+			fgrad.b += rbuf.y;
+			fgrad.c += rbuf.z;
+		}
+	}
+
+	/* redistribute translation as grad[i] = m[i] / mm * fgrad */
+	for (size_t i = 0; i < nr; i++) {
+		double scale = frag->atoms[i].mass / lib->total_mass;
+
+		grad[i].x = fgrad.x * scale;
+		grad[i].y = fgrad.y * scale;
+		grad[i].z = fgrad.z * scale;
+	}
+
+	/* redistribute torque over the principal axes */
+	for (size_t l = 0; l < 3; l++) {
+		const vec_t *axis = (const vec_t *)&lib->inertia_axes + l;
+		const double *Ia = lib->atom_inertia + l * nr;
+		vec_t v = mat_vec(&frag->rotmat, axis);
+
+		I = 0.0;
+		for (size_t i = 0; i < nr; i++)
+			I += Ia[i];
+
+		/* project torque onto v axis */
+		tq = (vec_t){ fgrad.a, fgrad.b, fgrad.c };
+		norm = vec_dot(&tq, &v);
+		tq = v;
+		vec_scale(&tq, norm);
+
+		/* distribute torque using Ia[i] / I as a scale */
+		for (size_t i = 0; i < nr; i++) {
+			/* atom is on the current axis */
+			if (eq(Ia[i], 0.0))
+				continue;
+
+			vec_t r = vec_sub(CVEC(frag->atoms[i].x),
+			    CVEC(frag->x));
+
+			rbuf = tq;
+			vec_scale(&rbuf, Ia[i] / I);
+			ft = vec_len(&rbuf);
+			ri = r;
+			vec_normalize(&ri);
+			rt = tq;
+			vec_normalize(&rt);
+			rbuf2 = vec_cross(&rt, &ri);
+			sina = vec_len(&rbuf2);
+			vec_normalize(&rbuf2);
+			vec_scale(&rbuf2, ft / sina / vec_len(&r));
+			grad[i] = vec_add(grad + i, &rbuf2);
+		}
+	}
+}
+
 static void
 update_fragment(struct frag *frag)
 {
@@ -122,32 +286,225 @@ set_coord_rotmat(struct frag *frag, const double *coord)
 static void
 free_frag(struct frag *frag)
 {
+	int copy;
+
 	if (!frag)
 		return;
 
-	free(frag->atoms);
-	free(frag->multipole_pts);
-	free(frag->polarizable_pts);
-	free(frag->dynamic_polarizable_pts);
-	free(frag->lmo_centroids);
-	free(frag->xr_fock_mat);
-	free(frag->xr_wf);
-	free(frag->xrfit);
-	free(frag->screen_params);
-	free(frag->ai_screen_params);
+	/* position independent arrays of fragment copies belong to the
+	 * library fragment, arrays in node shared memory are released along
+	 * with their windows */
+	copy = frag->lib != frag;
+
+	if (copy || !frag->shared) {
+		free(frag->atoms);
+		free(frag->multipole_pts);
+		free(frag->polarizable_pts);
+		free(frag->dynamic_polarizable_pts);
+		free(frag->lmo_centroids);
+	}
+	if (!frag->shared)
+		free(frag->xr_wf);
+	if (!copy && !frag->shared) {
+		free(frag->xr_fock_mat);
+		free(frag->xrfit);
+		free(frag->screen_params);
+		free(frag->ai_screen_params);
+		free(frag->atom_inertia);
+	}
+	if (!copy) {
+		for (size_t i = 0; i < frag->n_xr_atoms; i++) {
+			for (size_t j = 0; j < frag->xr_atoms[i].n_shells; j++)
+				free(frag->xr_atoms[i].shells[j].coef);
+			free(frag->xr_atoms[i].shells);
+		}
+	}
+
+	free(frag->xr_atoms);
+	free(frag->lib_path);
+
+	/* don't do free(frag) here */
+}
+
+/* returns private memory of a fragment, node shared memory is added to
+ * shared */
+static size_t
+frag_memory(const struct frag *frag, size_t *dynpol, size_t *shared)
+{
+	size_t size = 0, fixed = 0, wf;
+	int copy = frag->lib != frag;
+
+	size += frag->n_atoms * sizeof(struct efp_atom);
+	size += frag->n_multipole_pts * sizeof(struct multipole_pt);
+	size += frag->n_polarizable_pts * sizeof(struct polarizable_pt);
+	size += frag->n_lmo * sizeof(vec_t);
+
+	*dynpol = frag->n_dynamic_polarizable_pts *
+	    sizeof(struct dynamic_polarizable_pt);
+
+	wf = frag->n_lmo * frag->xr_wf_size * sizeof(double);
 
-	for (size_t i = 0; i < 3; i++)
-		free(frag->xr_wf_deriv[i]);
+	/* position independent data of fragment copies is in the library */
+	if (!copy) {
+		fixed += frag->n_lmo * (frag->n_lmo + 1) / 2 * sizeof(double);
+
+		if (frag->screen_params)
+			fixed += frag->n_multipole_pts * sizeof(double);
+		if (frag->ai_screen_params)
+			fixed += frag->n_multipole_pts * sizeof(double);
+		if (frag->xrfit)
+			fixed += frag->n_lmo * 4 * sizeof(double);
+		if (frag->atom_inertia)
+			fixed += 3 * frag->n_atoms * sizeof(double);
+	}
+
+	if (frag->shared && copy) {
+		*shared += wf;
+		wf = 0;
+	}
+	if (frag->shared && !copy) {
+		*shared += size + *dynpol + wf + fixed;
+		size = *dynpol = wf = fixed = 0;
+	}
+
+	size += wf + fixed;
 
 	for (size_t i = 0; i < frag->n_xr_atoms; i++) {
-		for (size_t j = 0; j < frag->xr_atoms[i].n_shells; j++)
-			free(frag->xr_atoms[i].shells[j].coef);
-		free(frag->xr_atoms[i].shells);
+		const struct xr_atom *atom = frag->xr_atoms + i;
+
+		size += sizeof(struct xr_atom);
+
+		if (copy)
+			continue;
+
+		size += atom->n_shells * sizeof(struct shell);
+
+		for (size_t j = 0; j < atom->n_shells; j++) {
+			const struct shell *shell = atom->shells + j;
+			size_t n = shell->type == 'L' ? 3 : 2;
+
+			size += n * shell->n_funcs * sizeof(double);
+		}
 	}
 
-	free(frag->xr_atoms);
+	return size;
+}
 
-	/* don't do free(frag) here */
+static void
+get_memory_usage(const struct efp *efp, struct efp_memory_usage *usage)
+{
+	size_t dynpol;
+	size_t n_ai = efp->n_ai_core + efp->n_ai_act + efp->n_ai_vir;
+
+	memset(usage, 0, sizeof(*usage));
+
+	usage->fragments = efp->n_frag * sizeof(struct frag);
+
+	for (size_t i = 0; i < efp->n_frag; i++) {
+		usage->fragments += frag_memory(efp->frags + i, &dynpol,
+		    &usage->shared);
+		usage->dynamic_polarizability += dynpol;
+	}
+
+	for (size_t i = 0; i < efp->n_lib; i++) {
+		usage->library += sizeof(struct frag) +
+		    frag_memory(efp->lib[i], &dynpol, &usage->shared);
+		usage->library += dynpol;
+	}
+
+	if (efp->skiplist)
+		usage->skiplist = efp->n_frag * efp->n_frag;
+
+	usage->other = sizeof(struct efp);
+
+	if (efp->grad) {
+		usage->other += efp->n_frag * sizeof(six_t);
+		usage->other += 2 * efp->n_polarizable_pts * sizeof(vec_t);
+	}
+
+	usage->other += efp->n_ptc * (sizeof(double) + 2 * sizeof(vec_t));
+
+	if (efp->ai_orbital_energies)
+		usage->other += n_ai * sizeof(double);
+	if (efp->ai_dipole_integrals)
+		usage->other += 3 * n_ai * n_ai * sizeof(double);
+
+	if (efp->pair_lists) {
+		usage->other += efp->n_frag * sizeof(struct pair_list);
+
+		for (size_t i = 0; i < efp->n_frag; i++)
+			usage->other += efp->pair_lists[i].size *
+			    sizeof(struct efp_pair_energy);
+	}
+
+	if (efp->frag_pol_energy)
+		usage->other += efp->n_frag * sizeof(double);
+
+	if (efp->frag_stress)
+		usage->other += efp->n_frag * sizeof(mat_t);
+
+	if (efp->view_mult_xyz)
+		usage->other += (efp->n_multipole_pts * 23 +
+		    efp->n_polarizable_pts * 3) * sizeof(double);
+
+	if (efp->disp_c6) {
+		size_t n_type = efp->n_disp_type;
+
+		usage->other += efp->n_lib * sizeof(size_t) +
+		    n_type * n_type * sizeof(double *);
+
+		for (size_t i = 0; i < efp->n_lib; i++) {
+			size_t n_i = efp->lib[i]->n_dynamic_polarizable_pts;
+
+			if (efp->disp_type[i] == SIZE_MAX)
+				continue;
+
+			for (size_t j = 0; j < efp->n_lib; j++) {
+				const struct frag *lib_j = efp->lib[j];
+
+				if (efp->disp_type[j] == SIZE_MAX)
+					continue;
+
+				usage->other += n_i *
+				    lib_j->n_dynamic_polarizable_pts *
+				    sizeof(double);
+			}
+		}
+	}
+
+	usage->resident = usage->fragments + usage->dynamic_polarizability +
+	    usage->library + usage->skiplist +
+	    usage->other + usage->shared;
+
+#ifdef _OPENMP
+#pragma omp critical(efp_mem)
+#endif
+	{
+		usage->transient = efp->mem_transient;
+		usage->peak = efp->mem_peak;
+	}
+
+	if (usage->peak < usage->resident + usage->transient)
+		usage->peak = usage->resident + usage->transient;
+}
+
+/* called after persistent arrays are allocated or resized */
+static void
+update_resident_memory(struct efp *efp)
+{
+	struct efp_memory_usage usage;
+
+	get_memory_usage(efp, &usage);
+
+#ifdef _OPENMP
+#pragma omp critical(efp_mem)
+#endif
+	{
+		efp->mem_resident = usage.resident;
+
+		if (efp->mem_peak < usage.resident + efp->mem_transient)
+			efp->mem_peak = usage.resident + efp->mem_transient;
+	}
 }
 
 static enum efp_result
@@ -157,6 +514,14 @@ copy_frag(struct frag *dest, const struct frag *src)
 
 	memcpy(dest, src, sizeof(*dest));
 
+	/* inertia data is only kept in library fragments */
+	dest->atom_inertia = NULL;
+	dest->shared = 0;
+
+	/* screening parameters, fock matrix, basis set and fitted exchange
+	 * repulsion parameters do not depend on fragment position and are
+	 * used directly from the library fragment */
+
 	if (src->atoms) {
 		size = src->n_atoms * sizeof(struct efp_atom);
 		dest->atoms = (struct efp_atom *)malloc(size);
@@ -171,20 +536,6 @@ copy_frag(struct frag *dest, const struct frag *src)
 			return EFP_RESULT_NO_MEMORY;
 		memcpy(dest->multipole_pts, src->multipole_pts, size);
 	}
-	if (src->screen_params) {
-		size = src->n_multipole_pts * sizeof(double);
-		dest->screen_params = (double *)malloc(size);
-		if (!dest->screen_params)
-			return EFP_RESULT_NO_MEMORY;
-		memcpy(dest->screen_params, src->screen_params, size);
-	}
-	if (src->ai_screen_params) {
-		size = src->n_multipole_pts * sizeof(double);
-		dest->ai_screen_params = (double *)malloc(size);
-		if (!dest->ai_screen_params)
-			return EFP_RESULT_NO_MEMORY;
-		memcpy(dest->ai_screen_params, src->ai_screen_params, size);
-	}
 	if (src->polarizable_pts) {
 		size = src->n_polarizable_pts * sizeof(struct polarizable_pt);
 		dest->polarizable_pts = (struct polarizable_pt *)malloc(size);
@@ -215,35 +566,6 @@ copy_frag(struct frag *dest, const struct frag *src)
 		if (!dest->xr_atoms)
 			return EFP_RESULT_NO_MEMORY;
 		memcpy(dest->xr_atoms, src->xr_atoms, size);
-
-		for (size_t j = 0; j < src->n_xr_atoms; j++) {
-			const struct xr_atom *at_src = src->xr_atoms + j;
-			struct xr_atom *at_dest = dest->xr_atoms + j;
-
-			size = at_src->n_shells * sizeof(struct shell);
-			at_dest->shells = (struct shell *)malloc(size);
-			if (!at_dest->shells)
-				return EFP_RESULT_NO_MEMORY;
-			memcpy(at_dest->shells, at_src->shells, size);
-
-			for (size_t i = 0; i < at_src->n_shells; i++) {
-				size = (at_src->shells[i].type == 'L' ? 3 : 2) *
-				    at_src->shells[i].n_funcs * sizeof(double);
-				at_dest->shells[i].coef =
-				    (double *)malloc(size);
-				if (!at_dest->shells[i].coef)
-					return EFP_RESULT_NO_MEMORY;
-				memcpy(at_dest->shells[i].coef,
-				    at_src->shells[i].coef, size);
-			}
-		}
-	}
-	if (src->xr_fock_mat) {
-		size = src->n_lmo * (src->n_lmo + 1) / 2 * sizeof(double);
-		dest->xr_fock_mat = (double *)malloc(size);
-		if (!dest->xr_fock_mat)
-			return EFP_RESULT_NO_MEMORY;
-		memcpy(dest->xr_fock_mat, src->xr_fock_mat, size);
 	}
 	if (src->xr_wf) {
 		size = src->n_lmo * src->xr_wf_size * sizeof(double);
@@ -252,16 +574,231 @@ copy_frag(struct frag *dest, const struct frag *src)
 			return EFP_RESULT_NO_MEMORY;
 		memcpy(dest->xr_wf, src->xr_wf, size);
 	}
-	if (src->xrfit) {
-		size = src->n_lmo * 4 * sizeof(double);
-		dest->xrfit = (double *)malloc(size);
-		if (!dest->xrfit)
-			return EFP_RESULT_NO_MEMORY;
-		memcpy(dest->xrfit, src->xrfit, size);
+	return EFP_RESULT_SUCCESS;
+}
+
+static void *
+touch_array(void *ptr, size_t size)
+{
+	void *tmp;
+
+	if (ptr == NULL || size == 0 || (tmp = malloc(size)) == NULL)
+		return ptr;
+
+	memcpy(tmp, ptr, size);
+	free(ptr);
+
+	return tmp;
+}
+
+static void
+touch_frag(struct frag *frag)
+{
+	size_t n_mult = frag->n_multipole_pts;
+	size_t wf_size = frag->n_lmo * frag->xr_wf_size * sizeof(double);
+
+	frag->atoms = (struct efp_atom *)touch_array(frag->atoms,
+	    frag->n_atoms * sizeof(struct efp_atom));
+	frag->multipole_pts = (struct multipole_pt *)touch_array(
+	    frag->multipole_pts, n_mult * sizeof(struct multipole_pt));
+	frag->polarizable_pts = (struct polarizable_pt *)touch_array(
+	    frag->polarizable_pts,
+	    frag->n_polarizable_pts * sizeof(struct polarizable_pt));
+	frag->dynamic_polarizable_pts =
+	    (struct dynamic_polarizable_pt *)touch_array(
+	    frag->dynamic_polarizable_pts, frag->n_dynamic_polarizable_pts *
+	    sizeof(struct dynamic_polarizable_pt));
+	frag->lmo_centroids = (vec_t *)touch_array(frag->lmo_centroids,
+	    frag->n_lmo * sizeof(vec_t));
+	frag->xr_atoms = (struct xr_atom *)touch_array(frag->xr_atoms,
+	    frag->n_xr_atoms * sizeof(struct xr_atom));
+	frag->xr_wf = (double *)touch_array(frag->xr_wf, wf_size);
+}
+
+/*
+ * Fragments are added by a single thread so all their data ends up in the
+ * memory of one NUMA node. Reallocate everything from OpenMP threads using
+ * static partition of fragments so that pages are spread across nodes.
+ * Arrays which can not be reallocated stay in place.
+ */
+static void
+touch_frags(struct efp *efp)
+{
+	struct frag *frags;
+
+	frags = (struct frag *)malloc(efp->n_frag * sizeof(struct frag));
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+	for (size_t i = 0; i < efp->n_frag; i++) {
+		if (frags)
+			frags[i] = efp->frags[i];
+		touch_frag(frags ? frags + i : efp->frags + i);
+	}
+
+	if (frags) {
+		free(efp->frags);
+		efp->frags = frags;
+	}
+}
+
+struct shm_pool {
+	/* node shared memory, NULL while computing the size */
+	char *base;
+
+	/* used size */
+	size_t size;
+
+	/* nonzero on the process which fills the memory */
+	int owner;
+};
+
+/* moves an array to the shared memory pool */
+static void *
+shm_move(struct shm_pool *pool, void *ptr, size_t size)
+{
+	size_t offset = pool->size;
+	char *dest;
+
+	if (ptr == NULL || size == 0)
+		return ptr;
+
+	/* keep arrays aligned to cache lines */
+	pool->size += (size + 63) & ~(size_t)63;
+
+	if (pool->base == NULL)
+		return ptr;
+
+	dest = pool->base + offset;
+
+	if (pool->owner)
+		memcpy(dest, ptr, size);
+
+	free(ptr);
+	return dest;
+}
+
+static void
+shm_move_frag(struct shm_pool *pool, struct frag *frag)
+{
+	size_t n_mult = frag->n_multipole_pts;
+
+	if (frag->lib == frag) {
+		frag->atoms = (struct efp_atom *)shm_move(pool, frag->atoms,
+		    frag->n_atoms * sizeof(struct efp_atom));
+		frag->multipole_pts = (struct multipole_pt *)shm_move(pool,
+		    frag->multipole_pts, n_mult * sizeof(struct multipole_pt));
+		frag->screen_params = (double *)shm_move(pool,
+		    frag->screen_params, n_mult * sizeof(double));
+		frag->ai_screen_params = (double *)shm_move(pool,
+		    frag->ai_screen_params, n_mult * sizeof(double));
+		frag->polarizable_pts = (struct polarizable_pt *)shm_move(pool,
+		    frag->polarizable_pts,
+		    frag->n_polarizable_pts * sizeof(struct polarizable_pt));
+		frag->dynamic_polarizable_pts =
+		    (struct dynamic_polarizable_pt *)shm_move(pool,
+		    frag->dynamic_polarizable_pts,
+		    frag->n_dynamic_polarizable_pts *
+		    sizeof(struct dynamic_polarizable_pt));
+		frag->lmo_centroids = (vec_t *)shm_move(pool,
+		    frag->lmo_centroids, frag->n_lmo * sizeof(vec_t));
+		frag->xr_fock_mat = (double *)shm_move(pool, frag->xr_fock_mat,
+		    frag->n_lmo * (frag->n_lmo + 1) / 2 * sizeof(double));
+		frag->xrfit = (double *)shm_move(pool, frag->xrfit,
+		    frag->n_lmo * 4 * sizeof(double));
+		frag->atom_inertia = (double *)shm_move(pool,
+		    frag->atom_inertia, 3 * frag->n_atoms * sizeof(double));
+	} else {
+		/* library fragments are moved first */
+		frag->screen_params = frag->lib->screen_params;
+		frag->ai_screen_params = frag->lib->ai_screen_params;
+		frag->xr_fock_mat = frag->lib->xr_fock_mat;
+		frag->xrfit = frag->lib->xrfit;
+	}
+
+	frag->xr_wf = (double *)shm_move(pool, frag->xr_wf,
+	    frag->n_lmo * frag->xr_wf_size * sizeof(double));
+
+	if (pool->base)
+		frag->shared = 1;
+}
+
+/*
+ * Processes of a node keep one copy of library parameters and of fragment
+ * wavefunctions in shared memory. Positions of fragment points are cheap to
+ * update and stay private. The basis set is not moved as it is referenced
+ * by pointers.
+ */
+static enum efp_result
+share_frags(struct efp *efp)
+{
+	struct shm_pool pool;
+	enum efp_result res;
+
+	if ((res = efp_shm_init(&efp->shm)))
+		return res;
+
+	if (efp_shm_size(efp->shm) < 2) {
+		efp_shm_shutdown(efp->shm);
+		efp->shm = NULL;
+		return EFP_RESULT_SUCCESS;
+	}
+
+	memset(&pool, 0, sizeof(pool));
+
+	for (int pass = 0; pass < 2; pass++) {
+		if (pass == 1) {
+			pool.base = (char *)efp_shm_alloc(efp->shm, pool.size);
+			pool.owner = efp_shm_rank(efp->shm) == 0;
+
+			if (pool.base == NULL) {
+				efp_log("unable to allocate %zu bytes of node "
+				    "shared memory", pool.size);
+				return EFP_RESULT_NO_MEMORY;
+			}
+
+			pool.size = 0;
+		}
+
+		/* libraries which were never parsed are not used */
+		for (size_t i = 0; i < efp->n_lib; i++)
+			if (efp->lib[i]->lib_path == NULL)
+				shm_move_frag(&pool, efp->lib[i]);
+
+		for (size_t i = 0; i < efp->n_frag; i++)
+			shm_move_frag(&pool, efp->frags + i);
 	}
+
+	efp_shm_barrier(efp->shm);
+	efp->shm_wf_gen = efp->coord_gen;
+
 	return EFP_RESULT_SUCCESS;
 }
 
+/* rotates shared fragment wavefunctions, each process of a node takes an
+ * equal share of fragments */
+static void
+update_shared_wf(struct efp *efp)
+{
+	size_t rank, size;
+
+	if (efp->shm == NULL || efp->shm_wf_gen == efp->coord_gen)
+		return;
+
+	rank = (size_t)efp_shm_rank(efp->shm);
+	size = (size_t)efp_shm_size(efp->shm);
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+	for (size_t i = rank; i < efp->n_frag; i += size)
+		efp_update_xr_wf(efp->frags + i);
+
+	efp_shm_barrier(efp->shm);
+	efp->shm_wf_gen = efp->coord_gen;
+}
+
 static enum efp_result
 check_opts(const struct efp_opts *opts)
 {
@@ -281,12 +818,21 @@ check_opts(const struct efp_opts *opts)
 			return EFP_RESULT_FATAL;
 		}
 	}
+	if (opts->enable_disp_ewald && !opts->enable_pbc) {
+		efp_log("dispersion Ewald summation requires periodic "
+		    "boundary conditions");
+		return EFP_RESULT_FATAL;
+	}
 	if (opts->enable_cutoff) {
 		if (opts->swf_cutoff < 1.0) {
 			efp_log("interaction cutoff is too small");
 			return EFP_RESULT_FATAL;
 		}
 	}
+	if (opts->pol_scf_tol < 0.0) {
+		efp_log("polarization convergence threshold is negative");
+		return EFP_RESULT_FATAL;
+	}
 	return EFP_RESULT_SUCCESS;
 }
 
@@ -369,11 +915,61 @@ do_xr(const struct efp_opts *opts)
 	return xr || cp || dd;
 }
 
+static int
+need_xr_params(const struct efp_opts *opts)
+{
+	return do_xr(opts) || (opts->terms & EFP_TERM_AI_XR);
+}
+
+static void
+add_pair_energy(struct pair_list *list, const struct efp_pair_energy *pair)
+{
+	if (list->n == list->size) {
+		size_t size = list->size ? 2 * list->size : 16;
+		struct efp_pair_energy *pairs;
+
+		pairs = (struct efp_pair_energy *)realloc(list->pairs,
+		    size * sizeof(struct efp_pair_energy));
+		if (pairs == NULL) {
+			list->error = 1;
+			return;
+		}
+		list->pairs = pairs;
+		list->size = size;
+	}
+	list->pairs[list->n++] = *pair;
+}
+
+static enum efp_result
+reset_pair_lists(struct efp *efp)
+{
+	if (efp->pair_lists == NULL) {
+		efp->pair_lists = (struct pair_list *)calloc(efp->n_frag,
+		    sizeof(struct pair_list));
+		if (efp->pair_lists == NULL)
+			return EFP_RESULT_NO_MEMORY;
+	}
+	if (efp->frag_pol_energy == NULL) {
+		efp->frag_pol_energy = (double *)calloc(efp->n_frag,
+		    sizeof(double));
+		if (efp->frag_pol_energy == NULL)
+			return EFP_RESULT_NO_MEMORY;
+	}
+	for (size_t i = 0; i < efp->n_frag; i++) {
+		efp->pair_lists[i].n = 0;
+		efp->pair_lists[i].error = 0;
+	}
+	memset(efp->frag_pol_energy, 0, efp->n_frag * sizeof(double));
+
+	return EFP_RESULT_SUCCESS;
+}
+
 static void
 compute_two_body_range(struct efp *efp, size_t frag_from, size_t frag_to,
     void *data)
 {
 	double e_elec = 0.0, e_disp = 0.0, e_xr = 0.0, e_cp = 0.0;
+	int do_pairwise = efp->opts.enable_pairwise;
 
 	(void)data;
 
@@ -393,26 +989,34 @@ compute_two_body_range(struct efp *efp, size_t frag_from, size_t frag_to,
 				six_t *ds;
 				size_t n_lmo_ij = efp->frags[i].n_lmo *
 				    efp->frags[fr_j].n_lmo;
+				struct efp_pair_energy pair = {
+					.frag_i = i < fr_j ? i : fr_j,
+					.frag_j = i < fr_j ? fr_j : i
+				};
 
 				s = (double *)calloc(n_lmo_ij, sizeof(double));
 				ds = (six_t *)calloc(n_lmo_ij, sizeof(six_t));
 
 				if (do_xr(&efp->opts)) {
-					double exr, ecp;
-
-					efp_frag_frag_xr(efp, i, fr_j,
-					    s, ds, &exr, &ecp);
-					e_xr += exr;
-					e_cp += ecp;
+					efp_frag_frag_xr(efp, i, fr_j, s, ds,
+					    &pair.exchange_repulsion,
+					    &pair.charge_penetration);
+					e_xr += pair.exchange_repulsion;
+					e_cp += pair.charge_penetration;
 				}
 				if (do_elec(&efp->opts)) {
-					e_elec += efp_frag_frag_elec(efp,
-					    i, fr_j);
+					pair.electrostatic =
+					    efp_frag_frag_elec(efp, i, fr_j);
+					e_elec += pair.electrostatic;
 				}
 				if (do_disp(&efp->opts)) {
-					e_disp += efp_frag_frag_disp(efp,
-					    i, fr_j, s, ds);
+					pair.dispersion = efp_frag_frag_disp(
+					    efp, i, fr_j, s, ds);
+					e_disp += pair.dispersion;
 				}
+				if (do_pairwise)
+					add_pair_energy(efp->pair_lists + i,
+					    &pair);
 				free(s);
 				free(ds);
 			}
@@ -435,6 +1039,81 @@ efp_get_energy(struct efp *efp, struct efp_energy *energy)
 	return EFP_RESULT_SUCCESS;
 }
 
+EFP_EXPORT enum efp_result
+efp_get_pair_energy_count(struct efp *efp, size_t *n_pairs)
+{
+	assert(efp);
+	assert(n_pairs);
+
+	*n_pairs = 0;
+
+	if (efp->pair_lists == NULL)
+		return EFP_RESULT_SUCCESS;
+
+	for (size_t i = 0; i < efp->n_frag; i++)
+		*n_pairs += efp->pair_lists[i].n;
+
+	return EFP_RESULT_SUCCESS;
+}
+
+EFP_EXPORT int
+efp_next_pair_energy(struct efp *efp, struct efp_pair_iter *iter,
+    struct efp_pair_energy *pair)
+{
+	assert(efp);
+	assert(iter);
+	assert(pair);
+
+	if (efp->pair_lists == NULL)
+		return 0;
+
+	while (iter->frag < efp->n_frag) {
+		const struct pair_list *list = efp->pair_lists + iter->frag;
+
+		if (iter->pos < list->n) {
+			*pair = list->pairs[iter->pos++];
+			return 1;
+		}
+		iter->frag++;
+		iter->pos = 0;
+	}
+	return 0;
+}
+
+EFP_EXPORT enum efp_result
+efp_get_frag_pol_energy(struct efp *efp, double *energy)
+{
+	assert(efp);
+	assert(energy);
+
+	if (efp->frag_pol_energy == NULL) {
+		efp_log("per fragment energies were not requested");
+		return EFP_RESULT_FATAL;
+	}
+	memcpy(energy, efp->frag_pol_energy, efp->n_frag * sizeof(double));
+	return EFP_RESULT_SUCCESS;
+}
+
+EFP_EXPORT enum efp_result
+efp_get_memory_usage(struct efp *efp, struct efp_memory_usage *usage)
+{
+	assert(efp);
+	assert(usage);
+
+	get_memory_usage(efp, usage);
+	return EFP_RESULT_SUCCESS;
+}
+
+EFP_EXPORT enum efp_result
+efp_set_memory_limit(struct efp *efp, size_t limit)
+{
+	assert(efp);
+
+	efp->mem_limit = limit;
+	update_resident_memory(efp);
+	return EFP_RESULT_SUCCESS;
+}
+
 EFP_EXPORT enum efp_result
 efp_get_gradient(struct efp *efp, double *grad)
 {
@@ -452,22 +1131,16 @@ efp_get_gradient(struct efp *efp, double *grad)
 EFP_EXPORT enum efp_result
 efp_get_atomic_gradient(struct efp *efp, double *grad)
 {
-	six_t *efpgrad = NULL; /* Calculated EFP gradient */
-	vec_t *pgrad; /* Conversion of grad to vec_t type */
-	size_t i, j, k, l;
-	size_t nr; /* Number of atoms in the current fragment */
-	size_t maxa; /* Maximum number of size of m, Ia, r arrays */
-	vec_t *r = NULL; /* Radius-vector of each atom inside current fragment
-			    with respect to CoM of that fragment */
-	double mm, *m = NULL; /* Total Mass of fragments and individual atoms */
-	double I, *Ia = NULL; /* Inertia along axis and contribution of each
-				 individual atom */
-	mat_t Id; /* Total inertia tensor of a fragment */
-	vec_t v, g; /* Principal axis and Inertia along that axis */
-	vec_t rbuf, rbuf2, tq, ri, rt;
-	double dist, sina, ft, norm;
-	enum efp_result res;
+	assert(efp);
+	assert(grad);
+
+	return efp_get_atomic_gradient_into(efp, grad, grad);
+}
 
+EFP_EXPORT enum efp_result
+efp_get_atomic_gradient_into(struct efp *efp, const double *extra,
+    double *grad)
+{
 	assert(efp);
 	assert(grad);
 
@@ -475,141 +1148,21 @@ efp_get_atomic_gradient(struct efp *efp, double *grad)
 		efp_log("gradient calculation was not requested");
 		return EFP_RESULT_FATAL;
 	}
-	pgrad = (vec_t *)grad;
-
-	/* Calculate maximum size of a fragment */
-	maxa = 0;
-	for (j = 0; j < efp->n_frag; j++) {
-		if (efp->frags[j].n_atoms > maxa)
-			maxa = efp->frags[j].n_atoms;
-	}
-
-	res = EFP_RESULT_NO_MEMORY;
-	/* Create and initialize some arrays for work */
-	if ((r = (vec_t *)malloc(maxa * sizeof(*r))) == NULL)
-		goto error;
-	if ((m = (double *)malloc(maxa * sizeof(*m))) == NULL)
-		goto error;
-	if ((Ia = (double *)malloc(maxa * sizeof(*Ia))) == NULL)
-		goto error;
-
-	/* Copy computed efp->grad */
-	if ((efpgrad = (six_t *)malloc(efp->n_frag * sizeof(*efpgrad))) == NULL)
-		goto error;
-	memcpy(efpgrad, efp->grad, efp->n_frag * sizeof(*efpgrad));
-
-	/* Main cycle (iterate fragments, distribute forces and torques) */
-	for (k = 0, j = 0; j < efp->n_frag; j++) {
-		nr = efp->frags[j].n_atoms;
-		memset(r, 0, maxa * sizeof(*r));
-		memset(m, 0, maxa * sizeof(*m));
-		memset(Ia, 0, maxa * sizeof(*Ia));
-		mm = 0.0;
-		Id = mat_zero;
-		v = vec_zero;
-		g = vec_zero;
-
-		for (i = 0; i < nr ; i++) {
-			r[i].x = efp->frags[j].atoms[i].x - efp->frags[j].x;
-			r[i].y = efp->frags[j].atoms[i].y - efp->frags[j].y;
-			r[i].z = efp->frags[j].atoms[i].z - efp->frags[j].z;
-			m[i] = efp->frags[j].atoms[i].mass;
-			mm += m[i];
-
-			/* Inertia tensor contribution calculations */
-			Id.xx += m[i] * (r[i].y*r[i].y + r[i].z*r[i].z);
-			Id.yy += m[i] * (r[i].x*r[i].x + r[i].z*r[i].z);
-			Id.zz += m[i] * (r[i].x*r[i].x + r[i].y*r[i].y);
-			Id.xy -= m[i] * r[i].x * r[i].y;
-			Id.yx -= m[i] * r[i].x * r[i].y;
-			Id.xz -= m[i] * r[i].x * r[i].z;
-			Id.zx -= m[i] * r[i].x * r[i].z;
-			Id.yz -= m[i] * r[i].y * r[i].z;
-			Id.zy -= m[i] * r[i].y * r[i].z;
-		}
 
-		/* Try to diagonalize Id and get principal axis */
-		if (efp_dsyev('V', 'U', 3, (double *)&Id, 3, (double *)&g)) {
-			efp_log("inertia tensor diagonalization failed");
-			res = EFP_RESULT_FATAL;
-			goto error;
-		}
-
-		/* Add any additional forces from grad array to efpgrad array */
-		for (i = 0; i < nr; i++) {
-			efpgrad[j].x += pgrad[k+i].x;
-			efpgrad[j].y += pgrad[k+i].y;
-			efpgrad[j].z += pgrad[k+i].z;
-			rbuf = vec_cross(&r[i], &pgrad[k+i]);
-			efpgrad[j].a += rbuf.x;
-			efpgrad[j].b += rbuf.y;
-			efpgrad[j].c += rbuf.z;
-			pgrad[k+i] = vec_zero;
-		}
-
-		/* Now we are ready to redistribute efpgrad over the atoms */
-
-		/* Redistribute total translation grad[i]=m[i]/mm*efpgrad[j] */
-		for (i = 0; i < nr; i++) {
-			pgrad[k+i].x = efpgrad[j].x;
-			pgrad[k+i].y = efpgrad[j].y;
-			pgrad[k+i].z = efpgrad[j].z;
-			vec_scale(&pgrad[k+i], m[i] / mm);
-		}
-
-		/* Redistribution of torque should be done over 3 principal
-		   axes computed previously */
-		for (l = 0; l < 3; l++) {
-			v = ((vec_t *)&Id)[l];
-			tq.x = efpgrad[j].a;
-			tq.y = efpgrad[j].b;
-			tq.z = efpgrad[j].c;
-
-			/* Calculate contribution of each atom to moment of
-			   inertia with respect to current axis */
-			I = 0.0;
-			for (i = 0; i < nr; i++) {
-				rbuf = vec_cross(&v, &r[i]);
-				dist = vec_len(&rbuf);
-				Ia[i] = m[i] * dist * dist;
-				I += Ia[i];
-			}
-
-			/* Project torque onto v axis */
-			norm = vec_dot(&tq, &v);
-			tq = v;
-			vec_scale(&tq, norm);
+	/* each fragment reads and writes only its own atoms, so extra and
+	 * grad may point to the same array */
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+	for (size_t j = 0; j < efp->n_frag; j++) {
+		size_t k = efp->frags[j].atom_offset;
 
-			/* Now distribute torque using Ia[i]/I as a scale */
-			for (i = 0; i < nr; i++) {
-				if (eq(Ia[i], 0.0))
-					continue;
-				/* If atom is not on the current axis */
-				rbuf = tq;
-				vec_scale(&rbuf, Ia[i]/I);
-				ft = vec_len(&rbuf);
-				ri = r[i];
-				vec_normalize(&ri);
-				rt = tq;
-				vec_normalize(&rt);
-				rbuf2 = vec_cross(&rt, &ri);
-				sina = vec_len(&rbuf2);
-				vec_normalize(&rbuf2);
-				vec_scale(&rbuf2, ft/sina/vec_len(&r[i]));
-				/* Update grad with torque contribution of
-				   atom i over axis v */
-				pgrad[k+i] = vec_add(&pgrad[k+i], &rbuf2);
-			}
-		}
-		k += nr;
+		atomic_gradient_frag(efp, j,
+		    extra ? (const vec_t *)extra + k : NULL,
+		    (vec_t *)grad + k);
 	}
-	res = EFP_RESULT_SUCCESS;
-error:
-	free(r);
-	free(m);
-	free(Ia);
-	free(efpgrad);
-	return res;
+
+	return EFP_RESULT_SUCCESS;
 }
 
 EFP_EXPORT enum efp_result
@@ -618,6 +1171,7 @@ efp_set_point_charges(struct efp *efp, size_t n_ptc, const double *ptc,
 {
 	assert(efp);
 	efp->n_ptc = n_ptc;
+	efp->coord_gen++;
 
 	if (n_ptc == 0) {
 		free(efp->ptc);
@@ -640,6 +1194,7 @@ efp_set_point_charges(struct efp *efp, size_t n_ptc, const double *ptc,
 	memcpy(efp->ptc_xyz, xyz, n_ptc * sizeof(vec_t));
 	memset(efp->ptc_grad, 0, n_ptc * sizeof(vec_t));
 
+	update_resident_memory(efp);
 	return EFP_RESULT_SUCCESS;
 }
 
@@ -685,6 +1240,7 @@ efp_set_point_charge_coordinates(struct efp *efp, const double *xyz)
 	assert(xyz);
 
 	memcpy(efp->ptc_xyz, xyz, efp->n_ptc * sizeof(vec_t));
+	efp->coord_gen++;
 	return EFP_RESULT_SUCCESS;
 }
 
@@ -705,6 +1261,7 @@ efp_set_point_charge_values(struct efp *efp, const double *ptc)
 	assert(ptc);
 
 	memcpy(efp->ptc, ptc, efp->n_ptc * sizeof(double));
+	efp->coord_gen++;
 	return EFP_RESULT_SUCCESS;
 }
 
@@ -748,6 +1305,7 @@ efp_set_frag_coordinates(struct efp *efp, size_t frag_idx,
 	assert(frag_idx < efp->n_frag);
 
 	frag = efp->frags + frag_idx;
+	efp->coord_gen++;
 
 	switch (coord_type) {
 	case EFP_COORD_TYPE_XYZABC:
@@ -821,6 +1379,7 @@ efp_set_periodic_box(struct efp *efp, double x, double y, double z)
 	efp->box.x = x;
 	efp->box.y = y;
 	efp->box.z = z;
+	efp->coord_gen++;
 
 	return EFP_RESULT_SUCCESS;
 }
@@ -848,6 +1407,10 @@ efp_get_stress_tensor(struct efp *efp, double *stress)
 		efp_log("gradient calculation was not requested");
 		return EFP_RESULT_FATAL;
 	}
+	if (!efp->opts.enable_stress) {
+		efp_log("stress tensor computation was not requested");
+		return EFP_RESULT_FATAL;
+	}
 
 	*(mat_t *)stress = efp->stress;
 
@@ -880,19 +1443,96 @@ efp_get_ai_screen(struct efp *efp, size_t frag_idx, double *screen)
 EFP_EXPORT enum efp_result
 efp_prepare(struct efp *efp)
 {
+	enum efp_result res;
+	size_t n_pts;
+	int huge;
+
 	assert(efp);
 
 	efp->n_polarizable_pts = 0;
 
-	for (size_t i = 0; i < efp->n_frag; i++) {
+	for (size_t i = 0, n_atoms = 0; i < efp->n_frag; i++) {
 		efp->frags[i].polarizable_offset = efp->n_polarizable_pts;
 		efp->n_polarizable_pts += efp->frags[i].n_polarizable_pts;
+		efp->frags[i].atom_offset = n_atoms;
+		n_atoms += efp->frags[i].n_atoms;
 	}
 
-	efp->indip = (vec_t *)calloc(efp->n_polarizable_pts, sizeof(vec_t));
-	efp->indipconj = (vec_t *)calloc(efp->n_polarizable_pts, sizeof(vec_t));
-	efp->grad = (six_t *)calloc(efp->n_frag, sizeof(six_t));
-	efp->skiplist = (char *)calloc(efp->n_frag * efp->n_frag, 1);
+	for (size_t i = 0; i < efp->n_lib; i++) {
+		/* skip libraries which were never parsed */
+		if (efp->lib[i]->lib_path || efp->lib[i]->atom_inertia)
+			continue;
+		if ((res = setup_lib_inertia(efp->lib[i])))
+			return res;
+	}
+
+	/* fragments inherit the pair kernels of their type */
+	for (size_t i = 0; i < efp->n_lib; i++)
+		if (efp->lib[i]->lib_path == NULL)
+			select_kernels(efp->lib[i]);
+
+	for (size_t i = 0; i < efp->n_frag; i++) {
+		efp->frags[i].elec_kernel = efp->frags[i].lib->elec_kernel;
+		efp->frags[i].xr_kernel = efp->frags[i].lib->xr_kernel;
+	}
+
+	if (efp->opts.enable_numa)
+		touch_frags(efp);
+
+	if (efp->opts.enable_shm && efp->shm == NULL)
+		if ((res = share_frags(efp)))
+			return res;
+
+	n_pts = efp->n_polarizable_pts;
+	huge = efp->opts.enable_huge_pages;
+
+	efp->indip = (vec_t *)efp_alloc_large((n_pts + 1) * sizeof(vec_t),
+	    huge);
+	efp->indipconj = (vec_t *)efp_alloc_large((n_pts + 1) * sizeof(vec_t),
+	    huge);
+	efp->grad = (six_t *)efp_alloc_large((efp->n_frag + 1) * sizeof(six_t),
+	    huge);
+	efp->skiplist = (char *)efp_alloc_large(efp->n_frag * efp->n_frag + 1,
+	    huge);
+
+	if (efp->indip == NULL || efp->indipconj == NULL ||
+	    efp->grad == NULL || efp->skiplist == NULL)
+		return EFP_RESULT_NO_MEMORY;
+
+	/* first touch follows the same static partition as touch_frags */
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static) if (efp->opts.enable_numa)
+#endif
+	for (size_t i = 0; i < efp->n_frag; i++) {
+		const struct frag *frag = efp->frags + i;
+		size_t size = frag->n_polarizable_pts * sizeof(vec_t);
+
+		memset(efp->indip + frag->polarizable_offset, 0, size);
+		memset(efp->indipconj + frag->polarizable_offset, 0, size);
+		memset(efp->grad + i, 0, sizeof(six_t));
+		memset(efp->skiplist + i * efp->n_frag, 0, efp->n_frag);
+	}
+
+	for (size_t i = 0; i < efp->n_frag; i++) {
+		struct frag *frag = efp->frags + i;
+
+		for (size_t j = 0; j < efp->n_lib; j++)
+			if (efp->lib[j] == frag->lib)
+				frag->lib_idx = j;
+	}
+
+	efp->pol_symmetric = is_pol_symmetric(efp);
+
+	if ((res = efp_prepare_disp(efp)))
+		return res;
+
+	update_resident_memory(efp);
+
+	if (efp->mem_limit > 0 && efp->mem_resident > efp->mem_limit) {
+		efp_log("memory limit of %zu bytes is less than %zu bytes "
+		    "required", efp->mem_limit, efp->mem_resident);
+		return EFP_RESULT_NO_MEMORY;
+	}
 
 	return EFP_RESULT_SUCCESS;
 }
@@ -916,6 +1556,7 @@ efp_set_orbital_energies(struct efp *efp, size_t n_core, size_t n_act,
 	    size);
 	memcpy(efp->ai_orbital_energies, oe, size);
 
+	update_resident_memory(efp);
 	return EFP_RESULT_SUCCESS;
 }
 
@@ -937,6 +1578,7 @@ efp_set_dipole_integrals(struct efp *efp, size_t n_core, size_t n_act,
 	    size * sizeof(double));
 	memcpy(efp->ai_dipole_integrals, dipint, size * sizeof(double));
 
+	update_resident_memory(efp);
 	return EFP_RESULT_SUCCESS;
 }
 
@@ -974,16 +1616,52 @@ efp_compute(struct efp *efp, int do_gradient)
 	memset(&efp->energy, 0, sizeof(efp->energy));
 	memset(&efp->stress, 0, sizeof(efp->stress));
 	memset(efp->grad, 0, efp->n_frag * sizeof(six_t));
+
+	if (efp->opts.enable_stress) {
+		if (efp->frag_stress == NULL) {
+			efp->frag_stress = (mat_t *)malloc(efp->n_frag *
+			    sizeof(mat_t));
+			if (efp->frag_stress == NULL)
+				return EFP_RESULT_NO_MEMORY;
+		}
+		memset(efp->frag_stress, 0, efp->n_frag * sizeof(mat_t));
+	}
 	memset(efp->ptc_grad, 0, efp->n_ptc * sizeof(vec_t));
 
+	if (efp->opts.enable_pairwise)
+		if ((res = reset_pair_lists(efp)))
+			return res;
+
+	update_shared_wf(efp);
 	efp_balance_work(efp, compute_two_body_range, NULL);
 
+	if (efp->opts.enable_pairwise) {
+		for (size_t i = 0; i < efp->n_frag; i++) {
+			if (efp->pair_lists[i].error) {
+				efp_log("unable to store fragment pair "
+				    "energies");
+				return EFP_RESULT_NO_MEMORY;
+			}
+		}
+	}
+
 	if ((res = efp_compute_pol(efp)))
 		return res;
 	if ((res = efp_compute_ai_elec(efp)))
 		return res;
 	if ((res = efp_compute_ai_disp(efp)))
 		return res;
+	if ((res = efp_compute_disp_ewald(efp)))
+		return res;
+
+	if (efp->do_gradient && efp->opts.enable_stress) {
+		for (size_t i = 0; i < efp->n_frag; i++) {
+			const double *in = (const double *)(efp->frag_stress + i);
+
+			for (size_t k = 0; k < 9; k++)
+				((double *)&efp->stress)[k] += in[k];
+		}
+	}
 
 #ifdef EFP_USE_MPI
 	efp_allreduce(&efp->energy.electrostatic, 1);
@@ -1005,6 +1683,8 @@ efp_compute(struct efp *efp, int do_gradient)
 			    efp->energy.ai_dispersion +
 			    efp->energy.exchange_repulsion;
 
+	/* pair lists and per fragment arrays grow during the computation */
+	update_resident_memory(efp);
 	return EFP_RESULT_SUCCESS;
 }
 
@@ -1055,15 +1735,10 @@ efp_get_frag_multipole_count(struct efp *efp, size_t frag_idx, size_t *n_mult)
 EFP_EXPORT enum efp_result
 efp_get_multipole_count(struct efp *efp, size_t *n_mult)
 {
-	size_t sum = 0;
-
 	assert(efp);
 	assert(n_mult);
 
-	for (size_t i = 0; i < efp->n_frag; i++)
-		sum += efp->frags[i].n_multipole_pts;
-
-	*n_mult = sum;
+	*n_mult = efp->n_multipole_pts;
 	return EFP_RESULT_SUCCESS;
 }
 
@@ -1115,15 +1790,10 @@ efp_get_multipole_values(struct efp *efp, double *mult)
 EFP_EXPORT enum efp_result
 efp_get_induced_dipole_count(struct efp *efp, size_t *n_dip)
 {
-	size_t sum = 0;
-
 	assert(efp);
 	assert(n_dip);
 
-	for (size_t i = 0; i < efp->n_frag; i++)
-		sum += efp->frags[i].n_polarizable_pts;
-
-	*n_dip = sum;
+	*n_dip = efp->n_polarizable_pts;
 	return EFP_RESULT_SUCCESS;
 }
 
@@ -1157,6 +1827,19 @@ efp_get_induced_dipole_values(struct efp *efp, double *dip)
 	return EFP_RESULT_SUCCESS;
 }
 
+EFP_EXPORT enum efp_result
+efp_get_pol_convergence(struct efp *efp, size_t *n_iter, double *residual)
+{
+	assert(efp);
+	assert(n_iter);
+	assert(residual);
+
+	*n_iter = efp->pol_iter;
+	*residual = efp->pol_residual;
+
+	return EFP_RESULT_SUCCESS;
+}
+
 EFP_EXPORT enum efp_result
 efp_get_induced_dipole_conj_values(struct efp *efp, double *dip)
 {
@@ -1167,6 +1850,109 @@ efp_get_induced_dipole_conj_values(struct efp *efp, double *dip)
 	return EFP_RESULT_SUCCESS;
 }
 
+EFP_EXPORT enum efp_result
+efp_set_induced_dipoles(struct efp *efp, const double *dip,
+    const double *dip_conj)
+{
+	assert(efp);
+	assert(dip);
+	assert(dip_conj);
+
+	if (efp->skiplist == NULL) {
+		efp_log("call efp_prepare after all fragments are added");
+		return EFP_RESULT_FATAL;
+	}
+
+	memcpy(efp->indip, dip, efp->n_polarizable_pts * sizeof(vec_t));
+	memcpy(efp->indipconj, dip_conj,
+	    efp->n_polarizable_pts * sizeof(vec_t));
+
+	efp->indip_guess = 1;
+	efp->dipole_gen++;
+	return EFP_RESULT_SUCCESS;
+}
+
+static enum efp_result
+update_views(struct efp *efp)
+{
+	if (efp->skiplist == NULL) {
+		efp_log("call efp_prepare after all fragments are added");
+		return EFP_RESULT_FATAL;
+	}
+	if (efp->view_gen == efp->coord_gen)
+		return EFP_RESULT_SUCCESS;
+
+	if (efp->view_mult_xyz == NULL) {
+		efp->view_mult_xyz = (double *)malloc(
+		    efp->n_multipole_pts * 3 * sizeof(double));
+		efp->view_mult = (double *)malloc(
+		    efp->n_multipole_pts * 20 * sizeof(double));
+		efp->view_indip_xyz = (double *)malloc(
+		    efp->n_polarizable_pts * 3 * sizeof(double));
+		update_resident_memory(efp);
+	}
+	if (efp->view_mult_xyz == NULL || efp->view_mult == NULL ||
+	    efp->view_indip_xyz == NULL)
+		return EFP_RESULT_NO_MEMORY;
+
+	efp_get_multipole_coordinates(efp, efp->view_mult_xyz);
+	efp_get_multipole_values(efp, efp->view_mult);
+	efp_get_induced_dipole_coordinates(efp, efp->view_indip_xyz);
+
+	efp->view_gen = efp->coord_gen;
+	return EFP_RESULT_SUCCESS;
+}
+
+EFP_EXPORT enum efp_result
+efp_get_multipole_view(struct efp *efp, const double **xyz,
+    const double **mult)
+{
+	enum efp_result res;
+
+	assert(efp);
+	assert(xyz);
+	assert(mult);
+
+	if ((res = update_views(efp)))
+		return res;
+
+	*xyz = efp->view_mult_xyz;
+	*mult = efp->view_mult;
+	return EFP_RESULT_SUCCESS;
+}
+
+EFP_EXPORT enum efp_result
+efp_get_induced_dipole_view(struct efp *efp, const double **xyz,
+    const double **dip, const double **dip_conj)
+{
+	enum efp_result res;
+
+	assert(efp);
+	assert(xyz);
+	assert(dip);
+	assert(dip_conj);
+
+	if ((res = update_views(efp)))
+		return res;
+
+	*xyz = efp->view_indip_xyz;
+	*dip = (const double *)efp->indip;
+	*dip_conj = (const double *)efp->indipconj;
+	return EFP_RESULT_SUCCESS;
+}
+
+EFP_EXPORT enum efp_result
+efp_get_generation(struct efp *efp, size_t *coord_gen, size_t *dipole_gen)
+{
+	assert(efp);
+	assert(coord_gen);
+	assert(dipole_gen);
+
+	*coord_gen = efp->coord_gen;
+	*dipole_gen = efp->dipole_gen;
+	return EFP_RESULT_SUCCESS;
+}
+
 EFP_EXPORT enum efp_result
 efp_get_lmo_count(struct efp *efp, size_t frag_idx, size_t *n_lmo)
 {
@@ -1227,6 +2013,12 @@ efp_shutdown(struct efp *efp)
 		free_frag(efp->lib[i]);
 		free(efp->lib[i]);
 	}
+	if (efp->disp_c6) {
+		for (size_t i = 0; i < efp->n_disp_type * efp->n_disp_type; i++)
+			free(efp->disp_c6[i]);
+		free(efp->disp_c6);
+	}
+	free(efp->disp_type);
 	free(efp->frags);
 	free(efp->lib);
 	free(efp->grad);
@@ -1238,6 +2030,17 @@ efp_shutdown(struct efp *efp)
 	free(efp->ai_orbital_energies);
 	free(efp->ai_dipole_integrals);
 	free(efp->skiplist);
+	if (efp->pair_lists) {
+		for (size_t i = 0; i < efp->n_frag; i++)
+			free(efp->pair_lists[i].pairs);
+		free(efp->pair_lists);
+	}
+	free(efp->frag_pol_energy);
+	free(efp->frag_stress);
+	free(efp->view_mult_xyz);
+	free(efp->view_mult);
+	free(efp->view_indip_xyz);
+	efp_shm_shutdown(efp->shm);
 	free(efp);
 }
 
@@ -1252,7 +2055,19 @@ efp_set_opts(struct efp *efp, const struct efp_opts *opts)
 	if ((res = check_opts(opts)))
 		return res;
 
+	if (need_xr_params(opts)) {
+		for (size_t i = 0; i < efp->n_lib; i++) {
+			if (efp->lib[i]->xr_skipped) {
+				efp_log("exchange repulsion parameters of "
+				    "fragment \"%s\" were not loaded",
+				    efp->lib[i]->name);
+				return EFP_RESULT_FATAL;
+			}
+		}
+	}
+
 	efp->opts = *opts;
+	efp->coord_gen++;
 	return EFP_RESULT_SUCCESS;
 }
 
@@ -1282,10 +2097,19 @@ efp_set_error_log(void (*cb)(const char *))
 	efp_set_log_cb(cb);
 }
 
+EFP_EXPORT void
+efp_set_mpi_comm(const void *comm)
+{
+	efp_set_comm(comm);
+}
+
 EFP_EXPORT enum efp_result
 efp_add_fragment(struct efp *efp, const char *name)
 {
-	const struct frag *lib;
+	enum efp_result res;
+	struct frag *lib;
+	size_t size, dynpol, shared = 0;
+	int fail;
 
 	assert(efp);
 	assert(name);
@@ -1298,6 +2122,10 @@ efp_add_fragment(struct efp *efp, const char *name)
 		efp_log("cannot find \"%s\" in any of .efp files", name);
 		return EFP_RESULT_UNKNOWN_FRAGMENT;
 	}
+	if (lib->lib_path) {
+		if ((res = efp_parse_lib(lib, !need_xr_params(&efp->opts))))
+			return res;
+	}
 
 	efp->n_frag++;
 	efp->frags = (struct frag *)realloc(efp->frags,
@@ -1305,19 +2133,35 @@ efp_add_fragment(struct efp *efp, const char *name)
 	if (efp->frags == NULL)
 		return EFP_RESULT_NO_MEMORY;
 
-	enum efp_result res;
 	struct frag *frag = efp->frags + efp->n_frag - 1;
 
 	if ((res = copy_frag(frag, lib)))
 		return res;
 
-	for (size_t a = 0; a < 3; a++) {
-		size_t size = frag->xr_wf_size * frag->n_lmo;
+	size = sizeof(struct frag) + frag_memory(frag, &dynpol, &shared) +
+	    dynpol;
 
-		frag->xr_wf_deriv[a] = (double *)calloc(size, sizeof(double));
-		if (frag->xr_wf_deriv[a] == NULL)
-			return EFP_RESULT_NO_MEMORY;
+#ifdef _OPENMP
+#pragma omp critical(efp_mem)
+#endif
+	{
+		fail = efp->mem_limit > 0 &&
+		    efp->mem_resident + size > efp->mem_limit;
+
+		if (!fail)
+			efp->mem_resident += size;
 	}
+
+	if (fail) {
+		efp_log("memory limit of %zu bytes exceeded", efp->mem_limit);
+		free_frag(frag);
+		efp->n_frag--;
+		return EFP_RESULT_NO_MEMORY;
+	}
+
+	efp->n_multipole_pts += frag->n_multipole_pts;
+	efp->n_polarizable_pts += frag->n_polarizable_pts;
+
 	return EFP_RESULT_SUCCESS;
 }
 
@@ -1331,6 +2175,21 @@ efp_skip_fragments(struct efp *efp, size_t i, size_t j, int value)
 
 	efp->skiplist[i * efp->n_frag + j] = value ? 1 : 0;
 	efp->skiplist[j * efp->n_frag + i] = value ? 1 : 0;
+	efp->coord_gen++;
+
+	return EFP_RESULT_SUCCESS;
+}
+
+EFP_EXPORT enum efp_result
+efp_get_skip_fragments(struct efp *efp, size_t i, size_t j, int *value)
+{
+	assert(efp);
+	assert(efp->skiplist); /* call efp_prepare first */
+	assert(i < efp->n_frag);
+	assert(j < efp->n_frag);
+	assert(value);
+
+	*value = efp->skiplist[i * efp->n_frag + j];
 
 	return EFP_RESULT_SUCCESS;
 }
@@ -1344,6 +2203,7 @@ efp_create(void)
 		return NULL;
 
 	efp_opts_default(&efp->opts);
+	efp->coord_gen = 1;
 
 	return efp;
 }
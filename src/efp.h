@@ -119,7 +119,15 @@ enum efp_pol_driver {
 	/** Iterative solution of polarization equations. */
 	EFP_POL_DRIVER_ITERATIVE = 0,
 	/** Direct solution of polarization equations. */
-	EFP_POL_DRIVER_DIRECT
+	EFP_POL_DRIVER_DIRECT,
+	/** Iterative solution which only propagates changes of induced
+	 * dipoles that are not yet converged. */
+	EFP_POL_DRIVER_ADAPTIVE,
+	/** Direct solution with the matrix compressed in hierarchical
+	 * off-diagonal low-rank format. Memory and time grow much slower
+	 * than with ::EFP_POL_DRIVER_DIRECT, but faster than linearly with
+	 * the number of polarizable points for bulk systems. */
+	EFP_POL_DRIVER_HODLR
 };
 
 /** \struct efp
@@ -150,6 +158,57 @@ struct efp_opts {
 	int enable_cutoff;
 	/** Cutoff distance for fragment-fragment interactions. */
 	double swf_cutoff;
+	/** If nonzero, dispersion is summed over all periodic images using
+	 * Ewald summation with isotropic dispersion coefficients. Only the
+	 * short range real space part is truncated at swf_cutoff. Requires
+	 * periodic boundary conditions. The reciprocal space part is not
+	 * included in fragment pair energies. */
+	int enable_disp_ewald;
+	/** Record energies of individual fragment pairs and per fragment
+	 * polarization energies if nonzero (see efp_next_pair_energy). */
+	int enable_pairwise;
+	/** If nonzero, efp_prepare reallocates fragment data and per point
+	 * arrays from all OpenMP threads so that memory pages are spread
+	 * across NUMA nodes. Loops over fragments in the polarization solver
+	 * then use the same static partition of fragments between threads
+	 * instead of dynamic scheduling. Must be set before efp_prepare. */
+	int enable_numa;
+	/** Request transparent huge pages for large arrays if nonzero. */
+	int enable_huge_pages;
+	/** If nonzero and libefp is built with MPI, efp_prepare moves library
+	 * parameters and fragment wavefunctions to memory shared by all
+	 * processes of a node using MPI-3 shared windows, and the processes
+	 * of a node update the shared data together. With this option
+	 * efp_prepare, efp_compute and efp_shutdown must be called by all
+	 * processes. Must be set before efp_prepare. */
+	int enable_shm;
+	/** Compute the stress tensor along with the gradient if nonzero (see
+	 * efp_get_stress_tensor). */
+	int enable_stress;
+	/** If nonzero, efp_add_potential only indexes fragments in the file
+	 * and their parameters are parsed by the first efp_add_fragment call
+	 * which references them. Exchange repulsion data is then not loaded
+	 * unless enabled terms need it. Must be set before
+	 * efp_add_potential. */
+	int enable_lazy_library;
+	/** If nonzero, the iterative and adaptive polarization drivers stop
+	 * after this many iterations and accept the induced dipoles without
+	 * checking convergence. Meant for extended Lagrangian dynamics where
+	 * the starting dipoles are propagated by the caller and set with
+	 * efp_set_induced_dipoles. */
+	size_t pol_fixed_iter;
+	/** Convergence threshold of the iterative and adaptive polarization
+	 * drivers. Iterations stop when the average change of induced dipoles
+	 * per polarizable point is below this value. Default of 1.0e-10 is
+	 * used if zero. */
+	double pol_scf_tol;
+	/** Maximum number of iterations of the iterative and adaptive
+	 * polarization drivers. Default of 80 is used if zero. */
+	size_t pol_scf_max_iter;
+	/** Number of previous iterations used for DIIS extrapolation of
+	 * induced dipoles in the iterative polarization driver. DIIS is
+	 * disabled if zero. */
+	size_t pol_diis_size;
 };
 
 /** EFP energy terms. */
@@ -183,6 +242,47 @@ struct efp_energy {
 	double total;
 };
 
+/** Memory used by an efp object, all values are in bytes. */
+struct efp_memory_usage {
+	/** Fragment parameters copied from the library, excluding dynamic
+	 * polarizability tensors. */
+	size_t fragments;
+	/** Dynamic polarizability tensors of fragments. */
+	size_t dynamic_polarizability;
+	/** Parameters of library fragments loaded from .efp files. */
+	size_t library;
+	/** Fragment pair skip list. */
+	size_t skiplist;
+	/** Other persistent data: induced dipoles, gradient, point charges,
+	 * pairwise energies and precomputed tables. */
+	size_t other;
+	/** Data in node shared memory, present once per node (see
+	 * efp_opts::enable_shm). */
+	size_t shared;
+	/** Total persistent memory, sum of all the above. */
+	size_t resident;
+	/** Temporary buffers of polarization solvers currently allocated. */
+	size_t transient;
+	/** Peak of resident plus transient memory. */
+	size_t peak;
+};
+
+/** Interaction energy of a pair of fragments. */
+struct efp_pair_energy {
+	size_t frag_i;              /**< Index of the first fragment. */
+	size_t frag_j;              /**< Index of the second fragment. */
+	double electrostatic;       /**< Electrostatic energy. */
+	double charge_penetration;  /**< Charge penetration energy. */
+	double dispersion;          /**< Dispersion energy. */
+	double exchange_repulsion;  /**< Exchange-repulsion energy. */
+};
+
+/** Iterator over fragment pair energies (see efp_next_pair_energy). */
+struct efp_pair_iter {
+	size_t frag;  /**< Current fragment. */
+	size_t pos;   /**< Current position in fragment pair list. */
+};
+
 /** EFP atom info. */
 struct efp_atom {
 	char label[32];   /**< Atom label. */
@@ -262,6 +362,18 @@ void efp_opts_default(struct efp_opts *opts);
  */
 void efp_set_error_log(void (*cb)(const char *));
 
+/**
+ * Set the MPI communicator used by libefp.
+ *
+ * Work is distributed between the processes of this communicator and results
+ * are summed over it. By default MPI_COMM_WORLD is used. The communicator must
+ * stay valid while libefp uses it. Has no effect if libefp is built without
+ * MPI support.
+ *
+ * \param[in] comm Pointer to an MPI_Comm or NULL to use MPI_COMM_WORLD.
+ */
+void efp_set_mpi_comm(const void *comm);
+
 /**
  * Set computation options.
  *
@@ -333,6 +445,22 @@ enum efp_result efp_prepare(struct efp *efp);
 enum efp_result efp_skip_fragments(struct efp *efp, size_t i, size_t j,
     int value);
 
+/**
+ * Check whether interactions between the fragments are skipped.
+ *
+ * \param[in] efp The efp structure.
+ *
+ * \param[in] i Index of the first fragment.
+ *
+ * \param[in] j Index of the second fragment.
+ *
+ * \param[out] value Set to nonzero if i-j interactions are skipped.
+ *
+ * \return ::EFP_RESULT_SUCCESS on success or error code otherwise.
+ */
+enum efp_result efp_get_skip_fragments(struct efp *efp, size_t i, size_t j,
+    int *value);
+
 /**
  * Set the callback function which computes electric field from electrons
  * in \a ab \a initio subsystem.
@@ -579,9 +707,43 @@ enum efp_result efp_set_periodic_box(struct efp *efp, double x, double y,
  */
 enum efp_result efp_get_periodic_box(struct efp *efp, double *xyz);
 
+/**
+ * Get memory used by the efp object.
+ *
+ * \param[in] efp The efp structure.
+ * \param[out] usage Memory usage broken down by category
+ * (see efp_memory_usage).
+ *
+ * \return ::EFP_RESULT_SUCCESS on success or error code otherwise.
+ */
+enum efp_result efp_get_memory_usage(struct efp *efp,
+    struct efp_memory_usage *usage);
+
+/**
+ * Limit memory used by the efp object.
+ *
+ * The limit is enforced at three points: efp_add_fragment fails if the copy
+ * of the fragment does not fit, efp_prepare fails if all persistent data does
+ * not fit, and temporary buffers of polarization solvers fail to allocate
+ * during efp_compute. These calls then return ::EFP_RESULT_NO_MEMORY. Other
+ * persistent arrays, such as point charges, data views and pair energy
+ * lists, are allocated directly. They are counted in ::efp_memory_usage and
+ * in later checks but never fail because of the limit. Library parameters
+ * parsed by efp_add_fragment in lazy mode are counted from efp_prepare on.
+ * Set the limit before fragments are added to have it checked for them.
+ *
+ * \param[in] efp The efp structure.
+ * \param[in] limit Memory limit in bytes. Zero means no limit.
+ *
+ * \return ::EFP_RESULT_SUCCESS on success or error code otherwise.
+ */
+enum efp_result efp_set_memory_limit(struct efp *efp, size_t limit);
+
 /**
  * Get the stress tensor.
  *
+ * Stress is only computed if efp_opts::enable_stress is set.
+ *
  * \param[in] efp The efp structure.
  *
  * \param[out] stress Array of 9 elements where the stress tensor will be
@@ -648,7 +810,9 @@ enum efp_result efp_set_dipole_integrals(struct efp *efp, size_t n_core,
 /**
  * Update wave function dependent energy terms.
  *
- * This function must be called during \a ab \a initio SCF.
+ * This function must be called during \a ab \a initio SCF. If coordinates
+ * did not change since the previous call, the field of fragments is reused
+ * and induced dipoles of the previous call are used as an initial guess.
  *
  * \param[in] efp The efp structure.
  *
@@ -801,9 +965,29 @@ enum efp_result efp_get_induced_dipole_coordinates(struct efp *efp,
  */
 enum efp_result efp_get_induced_dipole_values(struct efp *efp, double *dip);
 
+/**
+ * Get convergence information of the last polarization solve.
+ *
+ * \param[in] efp The efp structure.
+ *
+ * \param[out] n_iter Number of iterations done. Zero for the direct driver.
+ *
+ * \param[out] residual Average change of induced dipoles per polarizable
+ * point on the last iteration. Zero for the direct driver.
+ *
+ * \return ::EFP_RESULT_SUCCESS on success or error code otherwise.
+ */
+enum efp_result efp_get_pol_convergence(struct efp *efp, size_t *n_iter,
+    double *residual);
+
 /**
  * Get values of polarization conjugated induced dipoles.
  *
+ * Conjugated induced dipoles are solved for only if they can differ from
+ * induced dipoles and are needed, i.e., when polarizability tensors are not
+ * symmetric and either gradient or ::EFP_TERM_AI_POL is requested. Otherwise
+ * they are equal to induced dipoles.
+ *
  * \param[in] efp The efp structure.
  *
  * \param[out] dip Array where induced dipoles will be stored. The size of the
@@ -814,6 +998,90 @@ enum efp_result efp_get_induced_dipole_values(struct efp *efp, double *dip);
 enum efp_result efp_get_induced_dipole_conj_values(struct efp *efp,
     double *dip);
 
+/**
+ * Set values of polarization induced dipoles.
+ *
+ * Dipoles are used as the starting point of the next iterative solve
+ * instead of the previous solution, even if coordinates change in between.
+ * Must be called after efp_prepare.
+ *
+ * \param[in] efp The efp structure.
+ *
+ * \param[in] dip Array of [3 * \p n_dip] induced dipoles.
+ *
+ * \param[in] dip_conj Array of [3 * \p n_dip] conjugate induced dipoles.
+ *
+ * \return ::EFP_RESULT_SUCCESS on success or error code otherwise.
+ */
+enum efp_result efp_set_induced_dipoles(struct efp *efp, const double *dip,
+    const double *dip_conj);
+
+/**
+ * Get read-only pointers to coordinates and values of multipoles.
+ *
+ * Arrays have the same layout as the ones filled by
+ * efp_get_multipole_coordinates and efp_get_multipole_values. They are a copy
+ * cached inside the efp structure, not the internal fragment storage. The copy
+ * is rebuilt by this function when coordinates changed since the previous call
+ * (see efp_get_generation) and goes stale after coordinates change until this
+ * function is called again. Pointers stay valid until efp_shutdown. Must be
+ * called after efp_prepare.
+ *
+ * \param[in] efp The efp structure.
+ *
+ * \param[out] xyz Pointer to [3 * \p n_mult] coordinates of multipoles.
+ *
+ * \param[out] mult Pointer to [20 * \p n_mult] values of multipoles.
+ *
+ * \return ::EFP_RESULT_SUCCESS on success or error code otherwise.
+ */
+enum efp_result efp_get_multipole_view(struct efp *efp, const double **xyz,
+    const double **mult);
+
+/**
+ * Get read-only pointers to coordinates and values of induced dipoles.
+ *
+ * Induced dipoles point directly to the internal arrays and are always
+ * current. Coordinates of polarizable points are a cached copy which is
+ * rebuilt by this function when coordinates changed since the previous call
+ * and goes stale after coordinates change until this function is called
+ * again. Pointers stay valid until efp_shutdown. Must be called after
+ * efp_prepare.
+ *
+ * \param[in] efp The efp structure.
+ *
+ * \param[out] xyz Pointer to [3 * \p n_dip] coordinates of polarizable
+ * points.
+ *
+ * \param[out] dip Pointer to [3 * \p n_dip] induced dipoles.
+ *
+ * \param[out] dip_conj Pointer to [3 * \p n_dip] conjugate induced dipoles.
+ *
+ * \return ::EFP_RESULT_SUCCESS on success or error code otherwise.
+ */
+enum efp_result efp_get_induced_dipole_view(struct efp *efp,
+    const double **xyz, const double **dip, const double **dip_conj);
+
+/**
+ * Get generation counters of EFP data.
+ *
+ * Host codes can compare counters with the values from a previous call to
+ * find out whether data returned by efp_get_multipole_view and
+ * efp_get_induced_dipole_view changed. When \p coord_gen changes the views
+ * must be requested again to refresh the cached coordinates and multipoles.
+ *
+ * \param[in] efp The efp structure.
+ *
+ * \param[out] coord_gen Changes when coordinates, point charges, periodic
+ * box or options change.
+ *
+ * \param[out] dipole_gen Changes every time induced dipoles are computed.
+ *
+ * \return ::EFP_RESULT_SUCCESS on success or error code otherwise.
+ */
+enum efp_result efp_get_generation(struct efp *efp, size_t *coord_gen,
+    size_t *dipole_gen);
+
 /**
  * Get the number of LMOs in a fragment.
  *
@@ -871,6 +1139,59 @@ enum efp_result efp_get_xrfit(struct efp *efp, size_t frag_idx, double *xrfit);
  */
 enum efp_result efp_get_energy(struct efp *efp, struct efp_energy *energy);
 
+/**
+ * Get the number of fragment pairs recorded during the last efp_compute call.
+ *
+ * Pairs are only recorded if efp_opts::enable_pairwise is set. Pairs skipped
+ * because of the interaction cutoff or the skip list are not recorded. When
+ * libefp is built with MPI each process only holds pairs it has computed.
+ *
+ * \param[in] efp The efp structure.
+ * \param[out] n_pairs Number of recorded fragment pairs.
+ *
+ * \return ::EFP_RESULT_SUCCESS on success or error code otherwise.
+ */
+enum efp_result efp_get_pair_energy_count(struct efp *efp, size_t *n_pairs);
+
+/**
+ * Get the next recorded fragment pair energy.
+ *
+ * All fields of \p iter must be set to zero before the first call. Energies
+ * are scaled by the switching function if the cutoff is enabled.
+ *
+ * \code
+ * struct efp_pair_iter iter = { 0, 0 };
+ * struct efp_pair_energy pair;
+ *
+ * while (efp_next_pair_energy(efp, &iter, &pair))
+ *     printf("%zu %zu %lf\n", pair.frag_i, pair.frag_j, pair.dispersion);
+ * \endcode
+ *
+ * \param[in] efp The efp structure.
+ * \param[in,out] iter Iterator state.
+ * \param[out] pair Energy components of the next fragment pair. Index
+ * \a frag_i is always less than \a frag_j.
+ *
+ * \return Nonzero if \p pair was filled or zero if there are no more pairs.
+ */
+int efp_next_pair_energy(struct efp *efp, struct efp_pair_iter *iter,
+    struct efp_pair_energy *pair);
+
+/**
+ * Get polarization energy of each fragment.
+ *
+ * Only available if efp_opts::enable_pairwise was set during the last
+ * efp_compute call. Energies of all fragments sum up to the total
+ * polarization energy.
+ *
+ * \param[in] efp The efp structure.
+ * \param[out] energy Array of [\a n] elements where \a n is the total number
+ * of fragments.
+ *
+ * \return ::EFP_RESULT_SUCCESS on success or error code otherwise.
+ */
+enum efp_result efp_get_frag_pol_energy(struct efp *efp, double *energy);
+
 /**
  * Get computed EFP energy gradient.
  *
@@ -902,6 +1223,30 @@ enum efp_result efp_get_gradient(struct efp *efp, double *grad);
  */
 enum efp_result efp_get_atomic_gradient(struct efp *efp, double *grad);
 
+/**
+ * Get computed EFP energy gradient on individual atoms into a separate array.
+ *
+ * Same as ::efp_get_atomic_gradient but the additional atomic gradient is
+ * read from \a extra and the result is written to \a grad, so a persistent
+ * output buffer does not need to be cleared before each call. Principal axes
+ * of inertia are computed once for each fragment type in ::efp_prepare.
+ *
+ * \param[in] efp The efp structure.
+ *
+ * \param[in] extra Additional gradient on atoms which is gathered on
+ * fragments before redistribution. The size is the same as of \a grad. Can be
+ * NULL. Can be the same array as \a grad.
+ *
+ * \param[out] grad For each atom, \a x \a y \a z components of negative force
+ * will be written to this array. The size of this array must be at least
+ * [3 * \a n] elements, where \a n is the total number of atoms from all
+ * fragments.
+ *
+ * \return ::EFP_RESULT_SUCCESS on success or error code otherwise.
+ */
+enum efp_result efp_get_atomic_gradient_into(struct efp *efp,
+    const double *extra, double *grad);
+
 /**
  * Get the number of fragments in this computation.
  *
@@ -100,9 +100,11 @@ atom_mult_energy(struct efp *efp, struct frag *fr_i, struct frag *fr_j,
 	return energy;
 }
 
+/* stress is accumulated for fragment owner_idx which computes the pair */
 static void
 atom_mult_grad(struct efp *efp, size_t fr_i_idx, size_t fr_j_idx,
-    size_t atom_i_idx, size_t pt_j_idx, const struct swf *swf)
+    size_t atom_i_idx, size_t pt_j_idx, const struct swf *swf,
+    size_t owner_idx)
 {
 	const struct frag *fr_i = efp->frags + fr_i_idx;
 	const struct frag *fr_j = efp->frags + fr_j_idx;
@@ -158,25 +160,37 @@ atom_mult_grad(struct efp *efp, size_t fr_i_idx, size_t fr_j_idx,
 	    &force, &torque_i);
 	efp_sub_force(efp->grad + fr_j_idx, CVEC(fr_j->x), CVEC(pt_j->x),
 	    &force, &torque_j);
-	efp_add_stress(&swf->dr, &force, &efp->stress);
+	efp_add_stress(efp, owner_idx, &swf->dr, &force);
 }
 
-static double
-mult_mult_energy(struct efp *efp, size_t fr_i_idx, size_t fr_j_idx,
-    size_t pt_i_idx, size_t pt_j_idx, const struct swf *swf)
+static void
+pack_mult(const struct multipole_pt *pt, double *out, size_t stride)
 {
-	struct frag *fr_i = efp->frags + fr_i_idx;
-	struct frag *fr_j = efp->frags + fr_j_idx;
-	struct multipole_pt *pt_i = fr_i->multipole_pts + pt_i_idx;
-	struct multipole_pt *pt_j = fr_j->multipole_pts + pt_j_idx;
+	out[0 * stride] = pt->monopole;
+	out[1 * stride] = pt->dipole.x;
+	out[2 * stride] = pt->dipole.y;
+	out[3 * stride] = pt->dipole.z;
 
-	vec_t dr = {
-		pt_j->x - pt_i->x - swf->cell.x,
-		pt_j->y - pt_i->y - swf->cell.y,
-		pt_j->z - pt_i->z - swf->cell.z
-	};
+	for (size_t a = 0; a < 6; a++)
+		out[(4 + a) * stride] = pt->quadrupole[a];
 
-	double energy = 0.0, ccdamp = 1.0;
+	for (size_t a = 0; a < 10; a++)
+		out[(10 + a) * stride] = pt->octupole[a];
+}
+
+/* energy of one point pair of the block with the monopole damping correction,
+ * on gradient runs also returns the force and torques scaled by swf */
+static ALWAYS_INLINE double
+mult_mult_pair(const struct efp *efp, const struct frag *fr_i,
+    const struct frag *fr_j, size_t pt_i_idx, size_t pt_j_idx,
+    const struct swf *swf, const struct mult_block *blk, size_t k,
+    vec_t *force, vec_t *torque_i, vec_t *torque_j)
+{
+	const struct multipole_pt *pt_i = fr_i->multipole_pts + pt_i_idx;
+	const struct multipole_pt *pt_j = fr_j->multipole_pts + pt_j_idx;
+
+	vec_t dr = { blk->dr[0][k], blk->dr[1][k], blk->dr[2][k] };
+	double energy = blk->energy[k], ccdamp = 1.0, gdamp = 1.0;
 
 	if (efp->opts.elec_damp == EFP_ELEC_DAMP_SCREEN) {
 		double r = vec_len(&dr);
@@ -184,154 +198,219 @@ mult_mult_energy(struct efp *efp, size_t fr_i_idx, size_t fr_j_idx,
 		double screen_j = fr_j->screen_params[pt_j_idx];
 
 		ccdamp = get_screen_damping(r, screen_i, screen_j);
+
+		if (efp->do_gradient)
+			gdamp = get_screen_damping_grad(r, screen_i, screen_j);
 	}
 
-	/* monopole - monopole */
-	energy += ccdamp * efp_charge_charge_energy(pt_i->monopole,
+	/* monopole - monopole damping correction */
+	energy += (ccdamp - 1.0) * efp_charge_charge_energy(pt_i->monopole,
 	    pt_j->monopole, &dr);
 
-	/* monopole - dipole */
-	energy += efp_charge_dipole_energy(pt_i->monopole, &pt_j->dipole, &dr);
-
-	/* dipole - monopole */
-	energy -= efp_charge_dipole_energy(pt_j->monopole, &pt_i->dipole, &dr);
-
-	/* monopole - quadrupole */
-	energy += efp_charge_quadrupole_energy(pt_i->monopole,
-	    pt_j->quadrupole, &dr);
-
-	/* quadrupole - monopole */
-	energy += efp_charge_quadrupole_energy(pt_j->monopole,
-	    pt_i->quadrupole, &dr);
+	if (!efp->do_gradient)
+		return energy;
 
-	/* monopole - octupole */
-	energy += efp_charge_octupole_energy(pt_i->monopole,
-	    pt_j->octupole, &dr);
-
-	/* octupole - monopole */
-	energy -= efp_charge_octupole_energy(pt_j->monopole,
-	    pt_i->octupole, &dr);
+	vec_t force_, torque_i_, torque_j_;
 
-	/* dipole - dipole */
-	energy += efp_dipole_dipole_energy(&pt_i->dipole, &pt_j->dipole, &dr);
+	*force = (vec_t){ blk->force[0][k], blk->force[1][k],
+	    blk->force[2][k] };
+	*torque_i = (vec_t){ blk->add_i[0][k], blk->add_i[1][k],
+	    blk->add_i[2][k] };
+	*torque_j = (vec_t){ blk->add_j[0][k], blk->add_j[1][k],
+	    blk->add_j[2][k] };
 
-	/* dipole - quadrupole */
-	energy += efp_dipole_quadrupole_energy(&pt_i->dipole,
-	    pt_j->quadrupole, &dr);
+	efp_charge_charge_grad(pt_i->monopole, pt_j->monopole, &dr,
+	    &force_, &torque_i_, &torque_j_);
 
-	/* quadrupole - dipole */
-	energy -= efp_dipole_quadrupole_energy(&pt_j->dipole,
-	    pt_i->quadrupole, &dr);
+	force->x += (gdamp - 1.0) * force_.x;
+	force->y += (gdamp - 1.0) * force_.y;
+	force->z += (gdamp - 1.0) * force_.z;
 
-	/* quadrupole - quadrupole */
-	energy += efp_quadrupole_quadrupole_energy(pt_i->quadrupole,
-	    pt_j->quadrupole, &dr);
+	vec_scale(force, swf->swf);
+	vec_scale(torque_i, swf->swf);
+	vec_scale(torque_j, swf->swf);
 
 	return energy;
 }
 
+/* fills dr and ri of the block for point pt_i and the packed points of fr_j
+ * starting at jj, padding past n repeats the first point of the block */
+static ALWAYS_INLINE void
+mult_block_geometry(struct mult_block *blk, const struct multipole_pt *pt_i,
+    const struct frag *fr_j, size_t jj, size_t n, const struct swf *swf)
+{
+	for (size_t k = 0; k < MULT_BLOCK; k++) {
+		const struct multipole_pt *pt_j = fr_j->multipole_pts + jj +
+		    (k < n ? k : 0);
+
+		vec_t dr = {
+			pt_j->x - pt_i->x - swf->cell.x,
+			pt_j->y - pt_i->y - swf->cell.y,
+			pt_j->z - pt_i->z - swf->cell.z
+		};
+
+		blk->dr[0][k] = dr.x;
+		blk->dr[1][k] = dr.y;
+		blk->dr[2][k] = dr.z;
+		blk->ri[k] = 1.0 / vec_len(&dr);
+	}
+}
+
 static void
-mult_mult_grad(struct efp *efp, size_t fr_i_idx, size_t fr_j_idx,
-    size_t pt_i_idx, size_t pt_j_idx, const struct swf *swf)
+pack_mult_block(struct mult_block *blk, const struct frag *fr_j, size_t jj,
+    size_t n)
+{
+	/* pad the last block with a copy of its first pair */
+	for (size_t k = 0; k < MULT_BLOCK; k++)
+		pack_mult(fr_j->multipole_pts + jj + (k < n ? k : 0),
+		    &blk->mult_j[0][k], MULT_BLOCK);
+}
+
+/* interaction of one multipole point of fr_i with all points of fr_j */
+static double
+mult_mult(struct efp *efp, size_t fr_i_idx, size_t fr_j_idx,
+    size_t pt_i_idx, const struct swf *swf)
 {
 	struct frag *fr_i = efp->frags + fr_i_idx;
 	struct frag *fr_j = efp->frags + fr_j_idx;
 	struct multipole_pt *pt_i = fr_i->multipole_pts + pt_i_idx;
-	struct multipole_pt *pt_j = fr_j->multipole_pts + pt_j_idx;
+	struct mult_block blk;
+	double energy = 0.0;
 
-	vec_t dr = {
-		pt_j->x - pt_i->x - swf->cell.x,
-		pt_j->y - pt_i->y - swf->cell.y,
-		pt_j->z - pt_i->z - swf->cell.z
-	};
+	pack_mult(pt_i, blk.mult_i, 1);
 
-	vec_t force_, torque_i_, torque_j_;
-	vec_t force = vec_zero, torque_i = vec_zero, torque_j = vec_zero;
+	for (size_t jj = 0; jj < fr_j->n_multipole_pts; jj += MULT_BLOCK) {
+		size_t n = fr_j->n_multipole_pts - jj;
 
-	/* monopole - monopole */
-	efp_charge_charge_grad(pt_i->monopole, pt_j->monopole, &dr,
-	    &force_, &torque_i_, &torque_j_);
+		if (n > MULT_BLOCK)
+			n = MULT_BLOCK;
 
-	if (efp->opts.elec_damp == EFP_ELEC_DAMP_SCREEN) {
-		double r = vec_len(&dr);
-		double screen_i = fr_i->screen_params[pt_i_idx];
-		double screen_j = fr_j->screen_params[pt_j_idx];
-		double gdamp = get_screen_damping_grad(r, screen_i, screen_j);
+		pack_mult_block(&blk, fr_j, jj, n);
+		mult_block_geometry(&blk, pt_i, fr_j, jj, n, swf);
+		efp_mult_mult_block(&blk, efp->do_gradient);
 
-		force_.x *= gdamp;
-		force_.y *= gdamp;
-		force_.z *= gdamp;
+		for (size_t k = 0; k < n; k++) {
+			struct multipole_pt *pt_j = fr_j->multipole_pts +
+			    jj + k;
+			vec_t force, torque_i, torque_j;
+
+			energy += mult_mult_pair(efp, fr_i, fr_j, pt_i_idx,
+			    jj + k, swf, &blk, k, &force, &torque_i, &torque_j);
+
+			if (!efp->do_gradient)
+				continue;
+
+			efp_add_force(efp->grad + fr_i_idx, CVEC(fr_i->x),
+			    CVEC(pt_i->x), &force, &torque_i);
+			efp_sub_force(efp->grad + fr_j_idx, CVEC(fr_j->x),
+			    CVEC(pt_j->x), &force, &torque_j);
+			efp_add_stress(efp, fr_i_idx, &swf->dr, &force);
+		}
 	}
 
-	add_3(&force, &force_, &torque_i, &torque_i_, &torque_j, &torque_j_);
+	return energy;
+}
 
-	/* monopole - dipole */
-	efp_charge_dipole_grad(pt_i->monopole, &pt_j->dipole, &dr,
-	    &force_, &torque_i_, &torque_j_);
-	add_3(&force, &force_, &torque_i, &torque_i_, &torque_j, &torque_j_);
+/* force and torque of a point on a fragment gradient kept on the stack */
+static inline void
+accum_force(six_t *grad, const vec_t *com, const vec_t *pt,
+    const vec_t *force, const vec_t *add)
+{
+	vec_t dr = vec_sub(pt, com);
+	vec_t torque = vec_cross(&dr, force);
+
+	grad->x += force->x;
+	grad->y += force->y;
+	grad->z += force->z;
+	grad->a += torque.x + add->x;
+	grad->b += torque.y + add->y;
+	grad->c += torque.z + add->z;
+}
 
-	/* dipole - monopole */
-	efp_charge_dipole_grad(pt_j->monopole, &pt_i->dipole, &dr,
-	    &force_, &torque_j_, &torque_i_);
-	vec_negate(&force_);
-	add_3(&force, &force_, &torque_i, &torque_i_, &torque_j, &torque_j_);
+/*
+ * All multipole point pairs of two fragments with n points each. Used for
+ * fragment types listed in kernel.h, where n is a compile time constant after
+ * inlining. Each block of fr_j is packed once for all points of fr_i, and the
+ * gradient is summed locally and added to the fragments once per pair.
+ */
+static ALWAYS_INLINE double
+mult_mult_fixed(struct efp *efp, size_t fr_i_idx, size_t fr_j_idx,
+    const struct swf *swf, size_t n)
+{
+	struct frag *fr_i = efp->frags + fr_i_idx;
+	struct frag *fr_j = efp->frags + fr_j_idx;
+	struct mult_block blk;
+	six_t grad_i = six_zero, grad_j = six_zero;
+	vec_t force_sum = vec_zero;
+	double energy = 0.0;
 
-	/* monopole - quadrupole */
-	efp_charge_quadrupole_grad(pt_i->monopole, pt_j->quadrupole, &dr,
-	    &force_, &torque_i_, &torque_j_);
-	vec_negate(&torque_j_);
-	add_3(&force, &force_, &torque_i, &torque_i_, &torque_j, &torque_j_);
+	assert(fr_i->n_multipole_pts == n);
+	assert(fr_j->n_multipole_pts == n);
 
-	/* quadrupole - monopole */
-	efp_charge_quadrupole_grad(pt_j->monopole, pt_i->quadrupole, &dr,
-	    &force_, &torque_j_, &torque_i_);
-	add_3(&force, &force_, &torque_i, &torque_i_, &torque_j, &torque_j_);
+	for (size_t jj = 0; jj < n; jj += MULT_BLOCK) {
+		size_t cnt = n - jj < MULT_BLOCK ? n - jj : MULT_BLOCK;
 
-	/* monopole - octupole */
-	efp_charge_octupole_grad(pt_i->monopole, pt_j->octupole, &dr,
-	    &force_, &torque_i_, &torque_j_);
-	add_3(&force, &force_, &torque_i, &torque_i_, &torque_j, &torque_j_);
+		pack_mult_block(&blk, fr_j, jj, cnt);
 
-	/* octupole - monopole */
-	efp_charge_octupole_grad(pt_j->monopole, pt_i->octupole, &dr,
-	    &force_, &torque_j_, &torque_i_);
-	vec_negate(&force_);
-	add_3(&force, &force_, &torque_i, &torque_i_, &torque_j, &torque_j_);
+		for (size_t ii = 0; ii < n; ii++) {
+			struct multipole_pt *pt_i = fr_i->multipole_pts + ii;
 
-	/* dipole - dipole */
-	efp_dipole_dipole_grad(&pt_i->dipole, &pt_j->dipole, &dr,
-	    &force_, &torque_i_, &torque_j_);
-	vec_negate(&torque_j_);
-	add_3(&force, &force_, &torque_i, &torque_i_, &torque_j, &torque_j_);
+			pack_mult(pt_i, blk.mult_i, 1);
+			mult_block_geometry(&blk, pt_i, fr_j, jj, cnt, swf);
+			efp_mult_mult_block(&blk, efp->do_gradient);
 
-	/* dipole - quadrupole */
-	efp_dipole_quadrupole_grad(&pt_i->dipole, pt_j->quadrupole, &dr,
-	    &force_, &torque_i_, &torque_j_);
-	add_3(&force, &force_, &torque_i, &torque_i_, &torque_j, &torque_j_);
+			for (size_t k = 0; k < cnt; k++) {
+				struct multipole_pt *pt_j =
+				    fr_j->multipole_pts + jj + k;
+				vec_t force, torque_i, torque_j;
 
-	/* quadrupole - dipole */
-	efp_dipole_quadrupole_grad(&pt_j->dipole, pt_i->quadrupole, &dr,
-	    &force_, &torque_j_, &torque_i_);
-	vec_negate(&force_);
-	add_3(&force, &force_, &torque_i, &torque_i_, &torque_j, &torque_j_);
+				energy += mult_mult_pair(efp, fr_i, fr_j, ii,
+				    jj + k, swf, &blk, k, &force, &torque_i,
+				    &torque_j);
 
-	/* quadrupole - quadrupole */
-	efp_quadrupole_quadrupole_grad(pt_i->quadrupole, pt_j->quadrupole,
-	    &dr, &force_, &torque_i_, &torque_j_);
-	vec_negate(&torque_j_);
-	add_3(&force, &force_, &torque_i, &torque_i_, &torque_j, &torque_j_);
+				if (!efp->do_gradient)
+					continue;
 
-	vec_scale(&force, swf->swf);
-	vec_scale(&torque_i, swf->swf);
-	vec_scale(&torque_j, swf->swf);
+				accum_force(&grad_i, CVEC(fr_i->x),
+				    CVEC(pt_i->x), &force, &torque_i);
+				accum_force(&grad_j, CVEC(fr_j->x),
+				    CVEC(pt_j->x), &force, &torque_j);
+				force_sum = vec_add(&force_sum, &force);
+			}
+		}
+	}
 
-	efp_add_force(efp->grad + fr_i_idx, CVEC(fr_i->x), CVEC(pt_i->x),
-	    &force, &torque_i);
-	efp_sub_force(efp->grad + fr_j_idx, CVEC(fr_j->x), CVEC(pt_j->x),
-	    &force, &torque_j);
-	efp_add_stress(&swf->dr, &force, &efp->stress);
+	if (efp->do_gradient) {
+		six_atomic_add_xyz(efp->grad + fr_i_idx, CVEC(grad_i.x));
+		six_atomic_add_abc(efp->grad + fr_i_idx, CVEC(grad_i.a));
+		six_atomic_sub_xyz(efp->grad + fr_j_idx, CVEC(grad_j.x));
+		six_atomic_sub_abc(efp->grad + fr_j_idx, CVEC(grad_j.a));
+		efp_add_stress(efp, fr_i_idx, &swf->dr, &force_sum);
+	}
+
+	return energy;
 }
 
+typedef double (*mult_mult_kernel_fn)(struct efp *, size_t, size_t,
+    const struct swf *);
+
+#define X(name, n_mult, n_lmo, wf_size) \
+static double \
+mult_mult_##name(struct efp *efp, size_t fr_i_idx, size_t fr_j_idx, \
+    const struct swf *swf) \
+{ \
+	return mult_mult_fixed(efp, fr_i_idx, fr_j_idx, swf, n_mult); \
+}
+FRAG_KERNEL_TYPES(X)
+#undef X
+
+static const mult_mult_kernel_fn mult_mult_kernels[FRAG_KERNEL_COUNT] = {
+	NULL,
+#define X(name, n_mult, n_lmo, wf_size) mult_mult_##name,
+	FRAG_KERNEL_TYPES(X)
+#undef X
+};
+
 double
 efp_frag_frag_elec(struct efp *efp, size_t fr_i_idx, size_t fr_j_idx)
 {
@@ -364,7 +443,7 @@ efp_frag_frag_elec(struct efp *efp, size_t fr_i_idx, size_t fr_j_idx)
 				    CVEC(fr_i->x), CVEC(at_i->x), &force, NULL);
 				efp_sub_force(efp->grad + fr_j_idx,
 				    CVEC(fr_j->x), CVEC(at_j->x), &force, NULL);
-				efp_add_stress(&swf.dr, &force, &efp->stress);
+				efp_add_stress(efp, fr_i_idx, &swf.dr, &force);
 			}
 		}
 	}
@@ -376,7 +455,7 @@ efp_frag_frag_elec(struct efp *efp, size_t fr_i_idx, size_t fr_j_idx)
 			    ii, jj, &swf);
 			if (efp->do_gradient) {
 				atom_mult_grad(efp, fr_i_idx, fr_j_idx,
-				    ii, jj, &swf);
+				    ii, jj, &swf, fr_i_idx);
 			}
 		}
 	}
@@ -394,21 +473,20 @@ efp_frag_frag_elec(struct efp *efp, size_t fr_i_idx, size_t fr_j_idx)
 			    jj, ii, &swf2);
 			if (efp->do_gradient) {
 				atom_mult_grad(efp, fr_j_idx, fr_i_idx,
-				    jj, ii, &swf2);
+				    jj, ii, &swf2, fr_i_idx);
 			}
 		}
 	}
 
 	/* mult points - mult points */
-	for (size_t ii = 0; ii < fr_i->n_multipole_pts; ii++) {
-		for (size_t jj = 0; jj < fr_j->n_multipole_pts; jj++) {
-			energy += mult_mult_energy(efp, fr_i_idx, fr_j_idx,
-			    ii, jj, &swf);
-			if (efp->do_gradient) {
-				mult_mult_grad(efp, fr_i_idx, fr_j_idx,
-				    ii, jj, &swf);
-			}
-		}
+	if (fr_i->elec_kernel != FRAG_KERNEL_GENERIC &&
+	    fr_i->elec_kernel == fr_j->elec_kernel) {
+		energy += mult_mult_kernels[fr_i->elec_kernel](efp, fr_i_idx,
+		    fr_j_idx, &swf);
+	}
+	else {
+		for (size_t ii = 0; ii < fr_i->n_multipole_pts; ii++)
+			energy += mult_mult(efp, fr_i_idx, fr_j_idx, ii, &swf);
 	}
 
 	vec_t force = {
@@ -419,7 +497,7 @@ efp_frag_frag_elec(struct efp *efp, size_t fr_i_idx, size_t fr_j_idx)
 
 	six_atomic_add_xyz(efp->grad + fr_i_idx, &force);
 	six_atomic_sub_xyz(efp->grad + fr_j_idx, &force);
-	efp_add_stress(&swf.dr, &force, &efp->stress);
+	efp_add_stress(efp, fr_i_idx, &swf.dr, &force);
 
 	return energy * swf.swf;
 }
@@ -29,6 +29,24 @@
 
 #include "mathutil.h"
 
+/* number of elements in a packed multipole: charge to octupole */
+#define MULT_SIZE 20
+
+/* number of point pairs processed by one call of efp_mult_mult_block */
+#define MULT_BLOCK 8
+
+/* one multipole point against a block of points, structure of arrays */
+struct mult_block {
+	double mult_i[MULT_SIZE];
+	double mult_j[MULT_SIZE][MULT_BLOCK];
+	double dr[3][MULT_BLOCK];
+	double ri[MULT_BLOCK];
+	double energy[MULT_BLOCK];
+	double force[3][MULT_BLOCK];
+	double add_i[3][MULT_BLOCK];
+	double add_j[3][MULT_BLOCK];
+};
+
 static inline void
 add_3(vec_t *a, const vec_t *aa,
       vec_t *b, const vec_t *bb,
@@ -118,4 +136,6 @@ void efp_dipole_quadrupole_grad(const vec_t *, const double *, const vec_t *,
 void efp_quadrupole_quadrupole_grad(const double *, const double *,
     const vec_t *, vec_t *, vec_t *, vec_t *);
 
+void efp_mult_mult_block(struct mult_block *, int);
+
 #endif /* LIBEFP_ELEC_H */
@@ -25,6 +25,7 @@
  */
 
 #include "elec.h"
+#include "kernel.h"
 
 static double
 octupole_sum(const double *oct, const vec_t *dr)
@@ -471,3 +472,242 @@ efp_quadrupole_quadrupole_grad(const double *quad1, const double *quad2,
 	add2->y = 2.0 / 3.0 * (q2q1tt[2][0] - q2q1tt[0][2]);
 	add2->z = 2.0 / 3.0 * (q2q1tt[0][1] - q2q1tt[1][0]);
 }
+
+static inline void
+quad_vec(const double *quad, const double *vec, double *out)
+{
+#pragma GCC unroll 20
+	for (size_t a = 0; a < 3; a++)
+		out[a] = quad[quad_idx(a, 0)] * vec[0] +
+			 quad[quad_idx(a, 1)] * vec[1] +
+			 quad[quad_idx(a, 2)] * vec[2];
+}
+
+static inline void
+oct_vec_vec(const double *oct, const double *vec, double *out)
+{
+#pragma GCC unroll 20
+	for (size_t a = 0; a < 3; a++) {
+		out[a] = 0.0;
+
+#pragma GCC unroll 20
+		for (size_t b = 0; b < 3; b++)
+#pragma GCC unroll 20
+			for (size_t c = 0; c < 3; c++)
+				out[a] += oct[oct_idx(a, b, c)] *
+				    vec[b] * vec[c];
+	}
+}
+
+static inline double
+dot3(const double *a, const double *b)
+{
+	return a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+}
+
+static inline void
+cross3_add(double f, const double *a, const double *b, double *out)
+{
+	out[0] += f * (a[1] * b[2] - a[2] * b[1]);
+	out[1] += f * (a[2] * b[0] - a[0] * b[2]);
+	out[2] += f * (a[0] * b[1] - a[1] * b[0]);
+}
+
+/*
+ * Interaction of two packed multipoles (charge, dipole, quadrupole and
+ * octupole in the storage order of struct multipole_pt). The interaction
+ * tensors T0..T5 are never built explicitly: for traceless multipoles every
+ * contraction reduces to the radial factors 1/r^(2n+1) times products of
+ * the scalars below, which are computed once per point pair and shared by
+ * the energy, the force and both torques. All terms up to the
+ * quadrupole-quadrupole one are included as in the separate functions
+ * above.
+ *
+ * On return force is the derivative of energy with respect to the position
+ * of the first point, add1 is the derivative with respect to the rotation of
+ * the first multipole and add2 is the negated derivative with respect to the
+ * rotation of the second multipole. Gradient is skipped if do_grad is zero.
+ * The inverse distance ri is passed in, so that the function has no libm
+ * calls and can be vectorized across point pairs. All loops are fully
+ * unrolled for the same reason.
+ */
+static ALWAYS_INLINE double
+mult_mult_pair(const double *mult1, const double *mult2, const double *r,
+    double ri, int do_grad, double *force, double *add1, double *add2)
+{
+	const double *d1 = mult1 + 1, *d2 = mult2 + 1;
+	const double *q1 = mult1 + 4, *q2 = mult2 + 4;
+	const double *o1 = mult1 + 10, *o2 = mult2 + 10;
+
+	double ri2 = ri * ri;
+	double ri3 = ri * ri2;
+	double ri5 = ri3 * ri2;
+	double ri7 = ri5 * ri2;
+	double ri9 = ri7 * ri2;
+
+	double qr1[3], qr2[3], orr1[3], orr2[3];
+
+	quad_vec(q1, r, qr1);
+	quad_vec(q2, r, qr2);
+	oct_vec_vec(o1, r, orr1);
+	oct_vec_vec(o2, r, orr2);
+
+	double c1 = mult1[0], c2 = mult2[0];
+	double dr1 = dot3(d1, r), dr2 = dot3(d2, r);
+	double qrr1 = dot3(qr1, r), qrr2 = dot3(qr2, r);
+	double orrr1 = dot3(orr1, r), orrr2 = dot3(orr2, r);
+	double d1d2 = dot3(d1, d2);
+	double d1qr2 = dot3(d1, qr2), d2qr1 = dot3(d2, qr1);
+	double qr1qr2 = dot3(qr1, qr2);
+	double q1q2 = 0.0;
+
+#pragma GCC unroll 20
+	for (size_t a = 0; a < 6; a++)
+		q1q2 += (a < 3 ? 1.0 : 2.0) * q1[a] * q2[a];
+
+	/* energy grouped by powers of 1/r */
+	double e1 = c1 * c2;
+	double e3 = c2 * dr1 - c1 * dr2 + d1d2;
+	double e5 = c1 * qrr2 + c2 * qrr1 - 3.0 * dr1 * dr2 -
+	    2.0 * d1qr2 + 2.0 * d2qr1 + 2.0 / 3.0 * q1q2;
+	double e7 = c2 * orrr1 - c1 * orrr2 + 5.0 * dr1 * qrr2 -
+	    5.0 * dr2 * qrr1 - 20.0 / 3.0 * qr1qr2;
+	double e9 = 35.0 / 3.0 * qrr1 * qrr2;
+
+	double energy = e1 * ri + e3 * ri3 + e5 * ri5 + e7 * ri7 + e9 * ri9;
+
+	if (!do_grad)
+		return energy;
+
+	/* derivatives of energy with respect to the scalars above */
+	double g_dr1 = c2 * ri3 - 3.0 * dr2 * ri5 + 5.0 * qrr2 * ri7;
+	double g_dr2 = -c1 * ri3 - 3.0 * dr1 * ri5 - 5.0 * qrr1 * ri7;
+	double g_qrr1 = c2 * ri5 - 5.0 * dr2 * ri7 + 35.0 / 3.0 * qrr2 * ri9;
+	double g_qrr2 = c1 * ri5 + 5.0 * dr1 * ri7 + 35.0 / 3.0 * qrr1 * ri9;
+	double g_orrr1 = c2 * ri7;
+	double g_orrr2 = -c1 * ri7;
+	double g_d1d2 = ri3;
+	double g_d1qr2 = -2.0 * ri5;
+	double g_d2qr1 = 2.0 * ri5;
+	double g_qr1qr2 = -20.0 / 3.0 * ri7;
+	double g_q1q2 = 2.0 / 3.0 * ri5;
+
+	double g_r = -(e1 * ri3 + 3.0 * e3 * ri5 + 5.0 * e5 * ri7 +
+	    7.0 * e7 * ri9 + 9.0 * e9 * ri9 * ri2);
+
+	double q1d2[3], q2d1[3], q1qr2[3], q2qr1[3], de[3];
+
+	quad_vec(q1, d2, q1d2);
+	quad_vec(q2, d1, q2d1);
+	quad_vec(q1, qr2, q1qr2);
+	quad_vec(q2, qr1, q2qr1);
+
+#pragma GCC unroll 20
+	for (size_t a = 0; a < 3; a++)
+		de[a] = g_r * r[a] + g_dr1 * d1[a] + g_dr2 * d2[a] +
+		    2.0 * g_qrr1 * qr1[a] + 2.0 * g_qrr2 * qr2[a] +
+		    3.0 * g_orrr1 * orr1[a] + 3.0 * g_orrr2 * orr2[a] +
+		    g_d1qr2 * q2d1[a] + g_d2qr1 * q1d2[a] +
+		    g_qr1qr2 * (q1qr2[a] + q2qr1[a]);
+
+	double t1[3] = { 0.0, 0.0, 0.0 };
+	double t2[3] = { 0.0, 0.0, 0.0 };
+
+	cross3_add(g_dr1, d1, r, t1);
+	cross3_add(2.0 * g_qrr1, qr1, r, t1);
+	cross3_add(3.0 * g_orrr1, orr1, r, t1);
+	cross3_add(g_d1d2, d1, d2, t1);
+	cross3_add(g_d1qr2, d1, qr2, t1);
+	cross3_add(-g_d2qr1, d2, qr1, t1);
+	cross3_add(-g_d2qr1, r, q1d2, t1);
+	cross3_add(g_qr1qr2, q1qr2, r, t1);
+	cross3_add(g_qr1qr2, qr1, qr2, t1);
+
+	cross3_add(g_dr2, d2, r, t2);
+	cross3_add(2.0 * g_qrr2, qr2, r, t2);
+	cross3_add(3.0 * g_orrr2, orr2, r, t2);
+	cross3_add(g_d1d2, d2, d1, t2);
+	cross3_add(-g_d1qr2, d1, qr2, t2);
+	cross3_add(-g_d1qr2, r, q2d1, t2);
+	cross3_add(g_d2qr1, d2, qr1, t2);
+	cross3_add(g_qr1qr2, q2qr1, r, t2);
+	cross3_add(g_qr1qr2, qr2, qr1, t2);
+
+	/* quadrupole - quadrupole rotation term */
+	double qq[3][3];
+
+#pragma GCC unroll 20
+	for (size_t a = 0; a < 3; a++)
+#pragma GCC unroll 20
+		for (size_t b = 0; b < 3; b++)
+			qq[a][b] = q1[quad_idx(a, 0)] * q2[quad_idx(0, b)] +
+				   q1[quad_idx(a, 1)] * q2[quad_idx(1, b)] +
+				   q1[quad_idx(a, 2)] * q2[quad_idx(2, b)];
+
+	double tq[3] = {
+		2.0 * g_q1q2 * (qq[1][2] - qq[2][1]),
+		2.0 * g_q1q2 * (qq[2][0] - qq[0][2]),
+		2.0 * g_q1q2 * (qq[0][1] - qq[1][0])
+	};
+
+#pragma GCC unroll 20
+	for (size_t a = 0; a < 3; a++) {
+		force[a] = -de[a];
+		add1[a] = t1[a] + tq[a];
+
+		/* q2 q1 is the transpose of q1 q2 */
+		add2[a] = -t2[a] + tq[a];
+	}
+
+	return energy;
+}
+
+/*
+ * Interaction of blk->mult_i with all MULT_BLOCK multipoles in blk->mult_j.
+ * The loop over the block has a fixed trip count and a branch-free body, so
+ * the compiler vectorizes it across point pairs. Unused entries of the block
+ * must hold finite values and are ignored by the caller.
+ */
+void
+efp_mult_mult_block(struct mult_block *blk, int do_grad)
+{
+	if (!do_grad) {
+		for (size_t k = 0; k < MULT_BLOCK; k++) {
+			double mult_j[MULT_SIZE], r[3];
+
+#pragma GCC unroll 20
+			for (size_t a = 0; a < MULT_SIZE; a++)
+				mult_j[a] = blk->mult_j[a][k];
+
+#pragma GCC unroll 20
+			for (size_t a = 0; a < 3; a++)
+				r[a] = blk->dr[a][k];
+
+			blk->energy[k] = mult_mult_pair(blk->mult_i, mult_j, r,
+			    blk->ri[k], 0, NULL, NULL, NULL);
+		}
+		return;
+	}
+
+	for (size_t k = 0; k < MULT_BLOCK; k++) {
+		double mult_j[MULT_SIZE], r[3], force[3], add_i[3], add_j[3];
+
+#pragma GCC unroll 20
+		for (size_t a = 0; a < MULT_SIZE; a++)
+			mult_j[a] = blk->mult_j[a][k];
+
+#pragma GCC unroll 20
+		for (size_t a = 0; a < 3; a++)
+			r[a] = blk->dr[a][k];
+
+		blk->energy[k] = mult_mult_pair(blk->mult_i, mult_j, r,
+		    blk->ri[k], 1, force, add_i, add_j);
+
+#pragma GCC unroll 20
+		for (size_t a = 0; a < 3; a++) {
+			blk->force[a][k] = force[a];
+			blk->add_i[a][k] = add_i[a];
+			blk->add_j[a][k] = add_j[a];
+		}
+	}
+}
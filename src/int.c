@@ -380,6 +380,9 @@ efp_st_int(size_t n_atoms_i, const struct xr_atom *atoms_i, size_t n_atoms_j,
 							yin[idx + j] = iout.y * taa;
 							zin[idx + j] = iout.z * taa;
 
+							if (!t)
+								continue;
+
 							make_int(i, j + 2, taa, &a, CVEC(at_i->x), CVEC(at_j->x), &iout);
 							xin[idx + j + 30] = iout.x * t1;
 							yin[idx + j + 30] = iout.y * t1;
@@ -404,10 +407,14 @@ efp_st_int(size_t n_atoms_i, const struct xr_atom *atoms_i, size_t n_atoms_j,
 						size_t ny = shift_y[i];
 						size_t nz = shift_z[i];
 						double xyz = xin[nx] * yin[ny] * zin[nz];
+						sblk[i] = sblk[i] + dij[i] * xyz;
+
+						if (!t)
+							continue;
+
 						double add = (xin[nx + 30] + xin[nx + 60]) * yin[ny] * zin[nz] +
 							     (yin[ny + 30] + yin[ny + 60]) * xin[nx] * zin[nz] +
 							     (zin[nz + 30] + zin[nz + 60]) * xin[nx] * yin[ny];
-						sblk[i] = sblk[i] + dij[i] * xyz;
 						tblk[i] = tblk[i] + dij[i] * (xyz * aj * ft[i] + add);
 					}
 				}
@@ -419,7 +426,8 @@ efp_st_int(size_t n_atoms_i, const struct xr_atom *atoms_i, size_t n_atoms_j,
 
 				for (size_t j = 0; j < count_j; j++, idx++, idx2++) {
 					s[idx2] = sblk[idx];
-					t[idx2] = tblk[idx];
+					if (t)
+						t[idx2] = tblk[idx];
 				}
 			}
 			loc_j += count_j;
@@ -446,7 +454,8 @@ efp_st_int_deriv(size_t n_atoms_i, const struct xr_atom *atoms_i,
 	double dxt[4][4], dyt[4][4], dzt[4][4];
 
 	memset(ds, 0, size_i * size_j * sizeof(six_t));
-	memset(dt, 0, size_i * size_j * sizeof(six_t));
+	if (dt)
+		memset(dt, 0, size_i * size_j * sizeof(six_t));
 
 	for (size_t iii = 0, loc_i = 0; iii < n_atoms_i; iii++) {
 		const struct xr_atom *at_i = atoms_i + iii;
@@ -519,8 +528,11 @@ efp_st_int_deriv(size_t n_atoms_i, const struct xr_atom *atoms_i,
 						(ai * at_i->z + aj * at_j->z) * aa
 					};
 
+					/* kinetic integrals need two extra orders in j */
+					size_t n_j = dt ? sl_j + 2 : sl_j;
+
 					for (size_t i = 0; i < sl_i + 1; i++) {
-						for (size_t j = 0; j < sl_j + 2; j++) {
+						for (size_t j = 0; j < n_j; j++) {
 							vec_t iout;
 							make_int(i, j, taa, &a, CVEC(at_i->x), CVEC(at_j->x), &iout);
 							xs[i][j] = iout.x * taa;
@@ -532,26 +544,28 @@ efp_st_int_deriv(size_t n_atoms_i, const struct xr_atom *atoms_i,
 					double ai2 = 2.0 * ai;
 					double aj2 = 2.0 * aj;
 
-					for (size_t i = 0; i < sl_i + 1; i++) {
-						xt[i][0] = (xs[i][0] - xs[i][2] * aj2) * aj;
-						yt[i][0] = (ys[i][0] - ys[i][2] * aj2) * aj;
-						zt[i][0] = (zs[i][0] - zs[i][2] * aj2) * aj;
-					}
-
-					if (sl_j > 1) {
+					if (dt) {
 						for (size_t i = 0; i < sl_i + 1; i++) {
-							xt[i][1] = (xs[i][1] * 3.0 - xs[i][3] * aj2) * aj;
-							yt[i][1] = (ys[i][1] * 3.0 - ys[i][3] * aj2) * aj;
-							zt[i][1] = (zs[i][1] * 3.0 - zs[i][3] * aj2) * aj;
+							xt[i][0] = (xs[i][0] - xs[i][2] * aj2) * aj;
+							yt[i][0] = (ys[i][0] - ys[i][2] * aj2) * aj;
+							zt[i][0] = (zs[i][0] - zs[i][2] * aj2) * aj;
 						}
 
-						for (size_t j = 2; j < sl_j; j++) {
+						if (sl_j > 1) {
 							for (size_t i = 0; i < sl_i + 1; i++) {
-								size_t n1 = 2 * j + 1;
-								size_t n2 = j * (j - 1) / 2;
-								xt[i][j] = (xs[i][j] * n1 - xs[i][j + 2] * aj2) * aj - xs[i][j - 2] * n2;
-								yt[i][j] = (ys[i][j] * n1 - ys[i][j + 2] * aj2) * aj - ys[i][j - 2] * n2;
-								zt[i][j] = (zs[i][j] * n1 - zs[i][j + 2] * aj2) * aj - zs[i][j - 2] * n2;
+								xt[i][1] = (xs[i][1] * 3.0 - xs[i][3] * aj2) * aj;
+								yt[i][1] = (ys[i][1] * 3.0 - ys[i][3] * aj2) * aj;
+								zt[i][1] = (zs[i][1] * 3.0 - zs[i][3] * aj2) * aj;
+							}
+
+							for (size_t j = 2; j < sl_j; j++) {
+								for (size_t i = 0; i < sl_i + 1; i++) {
+									size_t n1 = 2 * j + 1;
+									size_t n2 = j * (j - 1) / 2;
+									xt[i][j] = (xs[i][j] * n1 - xs[i][j + 2] * aj2) * aj - xs[i][j - 2] * n2;
+									yt[i][j] = (ys[i][j] * n1 - ys[i][j + 2] * aj2) * aj - ys[i][j - 2] * n2;
+									zt[i][j] = (zs[i][j] * n1 - zs[i][j + 2] * aj2) * aj - zs[i][j - 2] * n2;
+								}
 							}
 						}
 					}
@@ -561,6 +575,9 @@ efp_st_int_deriv(size_t n_atoms_i, const struct xr_atom *atoms_i,
 						dys[0][j] = ys[1][j] * ai2;
 						dzs[0][j] = zs[1][j] * ai2;
 
+						if (!dt)
+							continue;
+
 						dxt[0][j] = xt[1][j] * ai2;
 						dyt[0][j] = yt[1][j] * ai2;
 						dzt[0][j] = zt[1][j] * ai2;
@@ -572,6 +589,9 @@ efp_st_int_deriv(size_t n_atoms_i, const struct xr_atom *atoms_i,
 							dys[i][j] = ys[i + 1][j] * ai2 - ys[i - 1][j] * i;
 							dzs[i][j] = zs[i + 1][j] * ai2 - zs[i - 1][j] * i;
 
+							if (!dt)
+								continue;
+
 							dxt[i][j] = xt[i + 1][j] * ai2 - xt[i - 1][j] * i;
 							dyt[i][j] = yt[i + 1][j] * ai2 - yt[i - 1][j] * i;
 							dzt[i][j] = zt[i + 1][j] * ai2 - zt[i - 1][j] * i;
@@ -592,6 +612,18 @@ efp_st_int_deriv(size_t n_atoms_i, const struct xr_atom *atoms_i,
 							double tys = xs[ix][jx] * dys[iy][jy] * zs[iz][jz];
 							double tzs = xs[ix][jx] * ys[iy][jy] * dzs[iz][jz];
 
+							size_t idx2 = (loc_i + i - start_i) * size_j + (loc_j + j - start_j);
+
+							ds[idx2].x += txs * dij[idx];
+							ds[idx2].y += tys * dij[idx];
+							ds[idx2].z += tzs * dij[idx];
+							ds[idx2].a += (tys * (at_i->z - com_i->z) - tzs * (at_i->y - com_i->y)) * dij[idx];
+							ds[idx2].b += (tzs * (at_i->x - com_i->x) - txs * (at_i->z - com_i->z)) * dij[idx];
+							ds[idx2].c += (txs * (at_i->y - com_i->y) - tys * (at_i->x - com_i->x)) * dij[idx];
+
+							if (!dt)
+								continue;
+
 							double txt = dxt[ix][jx] * ys[iy][jy] * zs[iz][jz] +
 								     dxs[ix][jx] * yt[iy][jy] * zs[iz][jz] +
 								     dxs[ix][jx] * ys[iy][jy] * zt[iz][jz];
@@ -602,15 +634,6 @@ efp_st_int_deriv(size_t n_atoms_i, const struct xr_atom *atoms_i,
 								     xs[ix][jx] * yt[iy][jy] * dzs[iz][jz] +
 								     xs[ix][jx] * ys[iy][jy] * dzt[iz][jz];
 
-							size_t idx2 = (loc_i + i - start_i) * size_j + (loc_j + j - start_j);
-
-							ds[idx2].x += txs * dij[idx];
-							ds[idx2].y += tys * dij[idx];
-							ds[idx2].z += tzs * dij[idx];
-							ds[idx2].a += (tys * (at_i->z - com_i->z) - tzs * (at_i->y - com_i->y)) * dij[idx];
-							ds[idx2].b += (tzs * (at_i->x - com_i->x) - txs * (at_i->z - com_i->z)) * dij[idx];
-							ds[idx2].c += (txs * (at_i->y - com_i->y) - tys * (at_i->x - com_i->x)) * dij[idx];
-
 							dt[idx2].x += txt * dij[idx];
 							dt[idx2].y += tyt * dij[idx];
 							dt[idx2].z += tzt * dij[idx];
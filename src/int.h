@@ -42,6 +42,7 @@ struct xr_atom {
 	struct shell *shells;
 };
 
+/* t and dt can be NULL in which case only overlap integrals are computed */
 void efp_st_int(size_t n_atoms_i,
 		const struct xr_atom *atoms_i,
 		size_t n_atoms_j,
@@ -0,0 +1,60 @@
+/*-
+ * Copyright (c) 2012-2017 Ilya Kaliman
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef LIBEFP_KERNEL_H
+#define LIBEFP_KERNEL_H
+
+/*
+ * Fragment types from fraglib for which pair kernels are compiled with fixed
+ * sizes. Each entry gives the number of multipole points, the number of LMOs
+ * and the size of the exchange repulsion wavefunction of the type. Kernels are
+ * instantiated from this list in elec.c and xr.c. In efp_prepare a library
+ * fragment is assigned a kernel if its sizes match an entry; the specialized
+ * kernel is used for a pair when both fragments have the same one, otherwise
+ * the generic code is used.
+ */
+#define FRAG_KERNEL_TYPES(X) \
+	X(H2O, 5, 4, 65) \
+	X(NH3, 7, 4, 75) \
+	X(CH3OH, 11, 7, 130) \
+	X(DMSO, 19, 13, 248)
+
+enum frag_kernel {
+	FRAG_KERNEL_GENERIC = 0,
+#define X(name, n_mult, n_lmo, wf_size) FRAG_KERNEL_##name,
+	FRAG_KERNEL_TYPES(X)
+#undef X
+	FRAG_KERNEL_COUNT
+};
+
+/* the specialized kernels rely on inlining to propagate the fixed sizes */
+#ifdef __GNUC__
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+#else
+#define ALWAYS_INLINE inline
+#endif
+
+#endif /* LIBEFP_KERNEL_H */
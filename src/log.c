@@ -31,6 +31,7 @@
 #include <mpi.h>
 #endif
 
+#include "balance.h"
 #include "log.h"
 
 static void
@@ -57,7 +58,7 @@ efp_log(const char *fmt, ...)
 #ifdef EFP_USE_MPI
 	int rank;
 
-	MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+	MPI_Comm_rank(efp_comm(), &rank);
 
 	if (rank == 0) {
 		va_start(ap, fmt);
@@ -562,17 +562,10 @@ parse_projection_wf(struct frag *frag, struct stream *stream)
 }
 
 static enum efp_result
-parse_fock_mat(struct frag *frag, struct stream *stream)
+read_fock_mat(struct stream *stream, size_t size, double *fock)
 {
-	efp_stream_next_line(stream);
-
-	size_t size = frag->n_lmo * (frag->n_lmo + 1) / 2;
-	frag->xr_fock_mat = (double *)malloc(size * sizeof(double));
-	if (frag->xr_fock_mat == NULL)
-		return EFP_RESULT_NO_MEMORY;
-
 	for (size_t i = 0; i < size; i++)
-		if (!tok_double(stream, frag->xr_fock_mat + i))
+		if (!tok_double(stream, fock ? fock + i : NULL))
 			return EFP_RESULT_SYNTAX_ERROR;
 
 	/* work around GAMESS bug */
@@ -587,6 +580,19 @@ parse_fock_mat(struct frag *frag, struct stream *stream)
 	return EFP_RESULT_SUCCESS;
 }
 
+static enum efp_result
+parse_fock_mat(struct frag *frag, struct stream *stream)
+{
+	efp_stream_next_line(stream);
+
+	size_t size = frag->n_lmo * (frag->n_lmo + 1) / 2;
+	frag->xr_fock_mat = (double *)malloc(size * sizeof(double));
+	if (frag->xr_fock_mat == NULL)
+		return EFP_RESULT_NO_MEMORY;
+
+	return read_fock_mat(stream, size, frag->xr_fock_mat);
+}
+
 static enum efp_result
 parse_lmo_centroids(struct frag *frag, struct stream *stream)
 {
@@ -788,50 +794,101 @@ parse_polab(struct frag *frag, struct stream *stream)
 	return EFP_RESULT_SUCCESS;
 }
 
+/*
+ * The functions below skip exchange repulsion data without storing it. They
+ * are used in lazy library mode when no term needs the wavefunction. The
+ * number of LMOs is kept in the fragment while parsing because the sizes of
+ * the following groups depend on it.
+ */
+
+static enum efp_result
+skip_to_stop(struct frag *frag, struct stream *stream)
+{
+	(void)frag;
+
+	efp_stream_next_line(stream);
+
+	while (!efp_stream_eof(stream)) {
+		if (tok_stop(stream))
+			return EFP_RESULT_SUCCESS;
+
+		efp_stream_next_line(stream);
+	}
+
+	return EFP_RESULT_SYNTAX_ERROR;
+}
+
+static enum efp_result
+skip_projection_wf(struct frag *frag, struct stream *stream)
+{
+	if (!tok_uint(stream, &frag->n_lmo) ||
+	    !tok_uint(stream, &frag->xr_wf_size))
+		return EFP_RESULT_SYNTAX_ERROR;
+
+	efp_stream_next_line(stream);
+
+	for (size_t j = 0; j < frag->n_lmo; j++)
+		for (size_t i = 0; i < (frag->xr_wf_size + 4) / 5; i++)
+			efp_stream_next_line(stream);
+
+	return EFP_RESULT_SUCCESS;
+}
+
+static enum efp_result
+skip_fock_mat(struct frag *frag, struct stream *stream)
+{
+	efp_stream_next_line(stream);
+
+	return read_fock_mat(stream, frag->n_lmo * (frag->n_lmo + 1) / 2,
+	    NULL);
+}
+
 typedef enum efp_result (*parse_fn)(struct frag *, struct stream *);
 
 static parse_fn
-get_parse_fn(struct stream *stream)
+get_parse_fn(struct stream *stream, int skip_xr)
 {
 	static const struct {
 		const char *label;
 		parse_fn fn;
+		parse_fn skip_fn;
 	} funcs[] = {
-		{ "COORDINATES",                parse_coordinates             },
-		{ "MONOPOLES",                  parse_monopoles               },
-		{ "DIPOLES",                    parse_dipoles                 },
-		{ "QUADRUPOLES",                parse_quadrupoles             },
-		{ "OCTUPOLES",                  parse_octupoles               },
-		{ "POLARIZABLE POINTS",         parse_polarizable_pts         },
-		{ "DYNAMIC POLARIZABLE POINTS", parse_dynamic_polarizable_pts },
-		{ "PROJECTION BASIS SET",       parse_projection_basis        },
-		{ "MULTIPLICITY",               parse_multiplicity            },
-		{ "PROJECTION WAVEFUNCTION",    parse_projection_wf           },
-		{ "FOCK MATRIX ELEMENTS",       parse_fock_mat                },
-		{ "LMO CENTROIDS",              parse_lmo_centroids           },
-		{ "CANONVEC",                   skip_canonvec                 },
-		{ "CANONFOK",                   skip_canonfok                 },
-		{ "CTVEC",                      skip_ctvec                    },
-		{ "CTFOK",                      skip_ctfok                    },
-		{ "SCREEN",                     parse_screen                  },
-		{ "XRFIT",                      parse_xrfit                   },
-		{ "POLAB",                      parse_polab                   },
+		{ "COORDINATES",                parse_coordinates,             NULL               },
+		{ "MONOPOLES",                  parse_monopoles,               NULL               },
+		{ "DIPOLES",                    parse_dipoles,                 NULL               },
+		{ "QUADRUPOLES",                parse_quadrupoles,             NULL               },
+		{ "OCTUPOLES",                  parse_octupoles,               NULL               },
+		{ "POLARIZABLE POINTS",         parse_polarizable_pts,         NULL               },
+		{ "DYNAMIC POLARIZABLE POINTS", parse_dynamic_polarizable_pts, NULL               },
+		{ "PROJECTION BASIS SET",       parse_projection_basis,        skip_to_stop       },
+		{ "MULTIPLICITY",               parse_multiplicity,            NULL               },
+		{ "PROJECTION WAVEFUNCTION",    parse_projection_wf,           skip_projection_wf },
+		{ "FOCK MATRIX ELEMENTS",       parse_fock_mat,                skip_fock_mat      },
+		{ "LMO CENTROIDS",              parse_lmo_centroids,           skip_to_stop       },
+		{ "CANONVEC",                   skip_canonvec,                 NULL               },
+		{ "CANONFOK",                   skip_canonfok,                 NULL               },
+		{ "CTVEC",                      skip_ctvec,                    NULL               },
+		{ "CTFOK",                      skip_ctfok,                    NULL               },
+		{ "SCREEN",                     parse_screen,                  NULL               },
+		{ "XRFIT",                      parse_xrfit,                   skip_to_stop       },
+		{ "POLAB",                      parse_polab,                   NULL               },
 	};
 
 	for (size_t i = 0; i < ARRAY_SIZE(funcs); i++)
 		if (tok(stream, funcs[i].label))
-			return funcs[i].fn;
+			return skip_xr && funcs[i].skip_fn ?
+			    funcs[i].skip_fn : funcs[i].fn;
 
 	return NULL;
 }
 
 static enum efp_result
-parse_fragment(struct frag *frag, struct stream *stream)
+parse_fragment(struct frag *frag, struct stream *stream, int skip_xr)
 {
 	enum efp_result res;
 
 	while (!efp_stream_eof(stream)) {
-		parse_fn fn = get_parse_fn(stream);
+		parse_fn fn = get_parse_fn(stream, skip_xr);
 
 		if (!fn) {
 			if (tok_end(stream))
@@ -851,7 +908,53 @@ parse_fragment(struct frag *frag, struct stream *stream)
 }
 
 static enum efp_result
-parse_file(struct efp *efp, struct stream *stream)
+parse_lib(struct frag *frag, struct stream *stream, int skip_xr)
+{
+	enum efp_result res;
+
+	if ((res = parse_fragment(frag, stream, skip_xr)))
+		return res;
+
+	if (skip_xr) {
+		frag->n_lmo = 0;
+		frag->xr_wf_size = 0;
+		frag->xr_skipped = 1;
+	}
+	if (frag->n_lmo > 0 && frag->lmo_centroids == NULL) {
+		efp_log("LMO centroids are missing");
+		return EFP_RESULT_FATAL;
+	}
+	return EFP_RESULT_SUCCESS;
+}
+
+/*
+ * In lazy library mode only the position of the fragment parameters in the
+ * file is recorded. They are parsed by efp_parse_lib when the fragment is
+ * first added to the system.
+ */
+static enum efp_result
+index_lib(struct frag *frag, struct stream *stream, const char *path)
+{
+	frag->lib_offset = efp_stream_tell(stream);
+	frag->lib_path = (char *)malloc(strlen(path) + 1);
+	if (frag->lib_path == NULL)
+		return EFP_RESULT_NO_MEMORY;
+
+	strcpy(frag->lib_path, path);
+
+	while (!efp_stream_eof(stream)) {
+		efp_stream_next_line(stream);
+
+		if (tok_end(stream))
+			return EFP_RESULT_SUCCESS;
+	}
+
+	efp_log("unexpected end of EFP potential data file");
+	return EFP_RESULT_SYNTAX_ERROR;
+}
+
+static enum efp_result
+parse_file(struct efp *efp, struct stream *stream, const char *path)
 {
 	char name[32];
 	enum efp_result res;
@@ -895,18 +998,54 @@ parse_file(struct efp *efp, struct stream *stream)
 		frag->pol_damp = 0.6;
 
 		efp_stream_next_line(stream);
+
+		if (efp->opts.enable_lazy_library) {
+			if ((res = index_lib(frag, stream, path)))
+				return res;
+			continue;
+		}
+
 		efp_stream_next_line(stream);
 
-		if ((res = parse_fragment(frag, stream)))
+		if ((res = parse_lib(frag, stream, 0)))
 			return res;
-		if (frag->n_lmo > 0 && frag->lmo_centroids == NULL) {
-			efp_log("LMO centroids are missing");
-			return EFP_RESULT_FATAL;
-		}
 	}
 	return EFP_RESULT_SUCCESS;
 }
 
+enum efp_result
+efp_parse_lib(struct frag *frag, int skip_xr)
+{
+	enum efp_result res;
+	struct stream *stream;
+
+	assert(frag->lib_path);
+
+	if ((stream = efp_stream_open(frag->lib_path)) == NULL) {
+		efp_log("unable to open file %s", frag->lib_path);
+		return EFP_RESULT_FILE_NOT_FOUND;
+	}
+
+	efp_stream_set_split_char(stream, '>');
+
+	if (!efp_stream_seek(stream, frag->lib_offset)) {
+		efp_log("unable to read fragment \"%s\" from %s",
+		    frag->name, frag->lib_path);
+		efp_stream_close(stream);
+		return EFP_RESULT_FATAL;
+	}
+
+	efp_stream_next_line(stream);
+	res = parse_lib(frag, stream, skip_xr);
+	efp_stream_close(stream);
+
+	if (res == EFP_RESULT_SUCCESS) {
+		free(frag->lib_path);
+		frag->lib_path = NULL;
+	}
+	return res;
+}
+
 EFP_EXPORT enum efp_result
 efp_add_potential(struct efp *efp, const char *path)
 {
@@ -923,7 +1062,7 @@ efp_add_potential(struct efp *efp, const char *path)
 
 	efp_stream_set_split_char(stream, '>');
 	efp_stream_next_line(stream);
-	res = parse_file(efp, stream);
+	res = parse_file(efp, stream, path);
 	efp_stream_close(stream);
 
 	return res;
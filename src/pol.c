@@ -27,21 +27,58 @@
 #include <stdlib.h>
 
 #include "balance.h"
+#include "clapack.h"
 #include "elec.h"
 #include "private.h"
 
+/* defaults used when the corresponding options are zero */
 #define POL_SCF_TOL 1.0e-10
 #define POL_SCF_MAX_ITER 80
 
 double efp_get_pol_damp_tt(double, double, double);
-enum efp_result efp_compute_id_direct(struct efp *);
+enum efp_result efp_compute_id_direct(struct efp *, int);
+enum efp_result efp_compute_id_hodlr(struct efp *, int);
 
 struct id_work_data {
+	int conj;
 	double conv;
 	vec_t *id_new;
 	vec_t *id_conj_new;
 };
 
+/* DIIS extrapolation of induced dipoles in the iterative driver */
+struct id_diis {
+	/* maximum number of stored vectors */
+	size_t size;
+	/* length of vectors, induced dipoles followed by conjugate ones */
+	size_t n;
+	/* total number of vectors added so far */
+	size_t count;
+	/* dipoles before the current iteration */
+	double *prev;
+	/* stored dipoles and their residuals, size vectors each */
+	double *x;
+	double *r;
+	/* overlaps of residuals, size x size */
+	double *b;
+};
+
+struct id_adaptive_data {
+	/* nonzero if conjugate dipoles are solved for */
+	int conj;
+	/* per fragment flags of dipoles which are propagated this sweep */
+	char *active;
+	/* change of dipoles since they were last propagated */
+	vec_t *delta;
+	vec_t *delta_conj;
+	/* cached field of all propagated induced dipoles */
+	vec_t *field;
+	vec_t *field_conj;
+	/* change of the field in the current sweep */
+	vec_t *field_new;
+	vec_t *field_conj_new;
+};
+
 double
 efp_get_pol_damp_tt(double r, double pa, double pb)
 {
@@ -202,8 +239,13 @@ add_electron_density_field(struct efp *efp)
 	if (efp->get_electron_density_field == NULL)
 		return EFP_RESULT_SUCCESS;
 
-	xyz = (vec_t *)malloc(efp->n_polarizable_pts * sizeof(vec_t));
-	field = (vec_t *)malloc(efp->n_polarizable_pts * sizeof(vec_t));
+	xyz = (vec_t *)efp_alloc(efp, efp->n_polarizable_pts * sizeof(vec_t));
+	field = (vec_t *)efp_alloc(efp, efp->n_polarizable_pts * sizeof(vec_t));
+
+	if (xyz == NULL || field == NULL) {
+		res = EFP_RESULT_NO_MEMORY;
+		goto error;
+	}
 
 	for (size_t i = 0, idx = 0; i < efp->n_frag; i++) {
 		struct frag *frag = efp->frags + i;
@@ -231,18 +273,21 @@ add_electron_density_field(struct efp *efp)
 		}
 	}
 error:
-	free(xyz);
-	free(field);
+	efp_free(efp, xyz);
+	efp_free(efp, field);
 	return res;
 }
 
 static void
 compute_elec_field_range(struct efp *efp, size_t from, size_t to, void *data)
 {
+	struct frag_schedule sched;
 	vec_t *elec_field = (vec_t *)data;
 
+	efp_frag_schedule(efp, &sched);
+
 #ifdef _OPENMP
-#pragma omp parallel for schedule(dynamic)
+#pragma omp parallel for schedule(runtime)
 #endif
 	for (size_t i = from; i < to; i++) {
 		const struct frag *frag = efp->frags + i;
@@ -252,20 +297,28 @@ compute_elec_field_range(struct efp *efp, size_t from, size_t to, void *data)
 			    get_elec_field(efp, i, j);
 		}
 	}
+
+	efp_restore_schedule(&sched);
 }
 
 static enum efp_result
-compute_elec_field(struct efp *efp)
+compute_static_field(struct efp *efp)
 {
+	struct frag_schedule sched;
 	vec_t *elec_field;
-	enum efp_result res;
 
-	elec_field = (vec_t *)calloc(efp->n_polarizable_pts, sizeof(vec_t));
+	elec_field = (vec_t *)efp_alloc(efp,
+	    efp->n_polarizable_pts * sizeof(vec_t));
+	if (elec_field == NULL)
+		return EFP_RESULT_NO_MEMORY;
+
 	efp_balance_work(efp, compute_elec_field_range, elec_field);
 	efp_allreduce((double *)elec_field, 3 * efp->n_polarizable_pts);
 
+	efp_frag_schedule(efp, &sched);
+
 #ifdef _OPENMP
-#pragma omp parallel for schedule(dynamic)
+#pragma omp parallel for schedule(runtime)
 #endif
 	for (size_t i = 0; i < efp->n_frag; i++) {
 		struct frag *frag = efp->frags + i;
@@ -273,10 +326,38 @@ compute_elec_field(struct efp *efp)
 		for (size_t j = 0; j < frag->n_polarizable_pts; j++) {
 			frag->polarizable_pts[j].elec_field =
 			    elec_field[frag->polarizable_offset + j];
-			frag->polarizable_pts[j].elec_field_wf = vec_zero;
 		}
 	}
-	free(elec_field);
+
+	efp_restore_schedule(&sched);
+	efp_free(efp, elec_field);
+
+	return EFP_RESULT_SUCCESS;
+}
+
+/*
+ * Field from fragments and point charges only depends on geometry so it is
+ * recomputed only when coordinates change. During QM/EFP SCF only the field
+ * from the ab initio electron density is updated on each call.
+ */
+static enum efp_result
+compute_elec_field(struct efp *efp)
+{
+	enum efp_result res;
+
+	if (efp->elec_field_gen != efp->coord_gen) {
+		if ((res = compute_static_field(efp)))
+			return res;
+
+		efp->elec_field_gen = efp->coord_gen;
+	}
+
+	for (size_t i = 0; i < efp->n_frag; i++) {
+		struct frag *frag = efp->frags + i;
+
+		for (size_t j = 0; j < frag->n_polarizable_pts; j++)
+			frag->polarizable_pts[j].elec_field_wf = vec_zero;
+	}
 
 	if (efp->opts.terms & EFP_TERM_AI_POL)
 		if ((res = add_electron_density_field(efp)))
@@ -285,9 +366,15 @@ compute_elec_field(struct efp *efp)
 	return EFP_RESULT_SUCCESS;
 }
 
+/*
+ * Field of induced dipoles id and id_conj at point pt. If active is not NULL
+ * only dipoles of fragments with nonzero active flag are included. If id_conj
+ * is NULL field_conj is set to zero.
+ */
 static void
 get_induced_dipole_field(struct efp *efp, size_t frag_idx,
-    struct polarizable_pt *pt, vec_t *field, vec_t *field_conj)
+    struct polarizable_pt *pt, const vec_t *id, const vec_t *id_conj,
+    const char *active, vec_t *field, vec_t *field_conj)
 {
 	struct frag *fr_i = efp->frags + frag_idx;
 
@@ -298,6 +385,9 @@ get_induced_dipole_field(struct efp *efp, size_t frag_idx,
 		if (j == frag_idx || efp_skip_frag_pair(efp, frag_idx, j))
 			continue;
 
+		if (active && !active[j])
+			continue;
+
 		struct frag *fr_j = efp->frags + j;
 		struct swf swf = efp_make_swf(efp, fr_i, fr_j);
 
@@ -315,8 +405,7 @@ get_induced_dipole_field(struct efp *efp, size_t frag_idx,
 			double r3 = r * r * r;
 			double r5 = r3 * r * r;
 
-			double t1 = vec_dot(&efp->indip[idx], &dr);
-			double t2 = vec_dot(&efp->indipconj[idx], &dr);
+			double t1 = vec_dot(&id[idx], &dr);
 
 			double p1 = 1.0;
 
@@ -324,19 +413,24 @@ get_induced_dipole_field(struct efp *efp, size_t frag_idx,
 				p1 = efp_get_pol_damp_tt(r, fr_i->pol_damp,
 				    fr_j->pol_damp);
 			}
-			field->x -= swf.swf * p1 * (efp->indip[idx].x / r3 -
+			field->x -= swf.swf * p1 * (id[idx].x / r3 -
 			    3.0 * t1 * dr.x / r5);
-			field->y -= swf.swf * p1 * (efp->indip[idx].y / r3 -
+			field->y -= swf.swf * p1 * (id[idx].y / r3 -
 			    3.0 * t1 * dr.y / r5);
-			field->z -= swf.swf * p1 * (efp->indip[idx].z / r3 -
+			field->z -= swf.swf * p1 * (id[idx].z / r3 -
 			    3.0 * t1 * dr.z / r5);
 
+			if (id_conj == NULL)
+				continue;
+
+			double t2 = vec_dot(&id_conj[idx], &dr);
+
 			field_conj->x -= swf.swf * p1 *
-			    (efp->indipconj[idx].x / r3 - 3.0 * t2 * dr.x / r5);
+			    (id_conj[idx].x / r3 - 3.0 * t2 * dr.x / r5);
 			field_conj->y -= swf.swf * p1 *
-			    (efp->indipconj[idx].y / r3 - 3.0 * t2 * dr.y / r5);
+			    (id_conj[idx].y / r3 - 3.0 * t2 * dr.y / r5);
 			field_conj->z -= swf.swf * p1 *
-			    (efp->indipconj[idx].z / r3 - 3.0 * t2 * dr.z / r5);
+			    (id_conj[idx].z / r3 - 3.0 * t2 * dr.z / r5);
 		}
 	}
 }
@@ -344,14 +438,19 @@ get_induced_dipole_field(struct efp *efp, size_t frag_idx,
 static void
 compute_id_range(struct efp *efp, size_t from, size_t to, void *data)
 {
+	struct frag_schedule sched;
 	double conv = 0.0;
 	vec_t *id_new, *id_conj_new;
+	int conj;
 
 	id_new = ((struct id_work_data *)data)->id_new;
 	id_conj_new = ((struct id_work_data *)data)->id_conj_new;
+	conj = ((struct id_work_data *)data)->conj;
+
+	efp_frag_schedule(efp, &sched);
 
 #ifdef _OPENMP
-#pragma omp parallel for schedule(dynamic) reduction(+:conv)
+#pragma omp parallel for schedule(runtime) reduction(+:conv)
 #endif
 	for (size_t i = from; i < to; i++) {
 		struct frag *frag = efp->frags + i;
@@ -362,7 +461,8 @@ compute_id_range(struct efp *efp, size_t from, size_t to, void *data)
 			vec_t field, field_conj;
 
 			/* electric field from other induced dipoles */
-			get_induced_dipole_field(efp, i, pt, &field,
+			get_induced_dipole_field(efp, i, pt, efp->indip,
+			    conj ? efp->indipconj : NULL, NULL, &field,
 			    &field_conj);
 
 			/* add field that doesn't change during scf */
@@ -370,114 +470,543 @@ compute_id_range(struct efp *efp, size_t from, size_t to, void *data)
 			field.y += pt->elec_field.y + pt->elec_field_wf.y;
 			field.z += pt->elec_field.z + pt->elec_field_wf.z;
 
+			id_new[idx] = mat_vec(&pt->tensor, &field);
+			conv += vec_dist(&id_new[idx], &efp->indip[idx]);
+
+			if (!conj)
+				continue;
+
 			field_conj.x += pt->elec_field.x + pt->elec_field_wf.x;
 			field_conj.y += pt->elec_field.y + pt->elec_field_wf.y;
 			field_conj.z += pt->elec_field.z + pt->elec_field_wf.z;
 
-			id_new[idx] = mat_vec(&pt->tensor, &field);
 			id_conj_new[idx] = mat_trans_vec(&pt->tensor,
 			    &field_conj);
-
-			conv += vec_dist(&id_new[idx], &efp->indip[idx]);
 			conv += vec_dist(&id_conj_new[idx],
 			    &efp->indipconj[idx]);
 		}
 	}
 
+	efp_restore_schedule(&sched);
+
 	((struct id_work_data *)data)->conv += conv;
 }
 
-static double
-pol_scf_iter(struct efp *efp)
+static enum efp_result
+pol_scf_iter(struct efp *efp, int conj, double *conv)
 {
 	struct id_work_data data;
 	size_t npts = efp->n_polarizable_pts;
 
+	data.conj = conj;
 	data.conv = 0.0;
-	data.id_new = (vec_t *)calloc(npts, sizeof(vec_t));
-	data.id_conj_new = (vec_t *)calloc(npts, sizeof(vec_t));
+	data.id_new = (vec_t *)efp_alloc(efp, npts * sizeof(vec_t));
+	data.id_conj_new = conj ?
+	    (vec_t *)efp_alloc(efp, npts * sizeof(vec_t)) : NULL;
+
+	if (data.id_new == NULL || (conj && data.id_conj_new == NULL)) {
+		efp_free(efp, data.id_new);
+		efp_free(efp, data.id_conj_new);
+		return EFP_RESULT_NO_MEMORY;
+	}
 
 	efp_balance_work(efp, compute_id_range, &data);
 
 	efp_allreduce((double *)data.id_new, 3 * npts);
-	efp_allreduce((double *)data.id_conj_new, 3 * npts);
 	efp_allreduce(&data.conv, 1);
-
 	memcpy(efp->indip, data.id_new, npts * sizeof(vec_t));
-	memcpy(efp->indipconj, data.id_conj_new, npts * sizeof(vec_t));
 
-	free(data.id_new);
-	free(data.id_conj_new);
+	if (conj) {
+		efp_allreduce((double *)data.id_conj_new, 3 * npts);
+		memcpy(efp->indipconj, data.id_conj_new, npts * sizeof(vec_t));
+	}
+
+	efp_free(efp, data.id_new);
+	efp_free(efp, data.id_conj_new);
 
-	return data.conv / npts / 2;
+	*conv = data.conv / npts / (conj ? 2 : 1);
+	return EFP_RESULT_SUCCESS;
 }
 
 static void
 compute_energy_range(struct efp *efp, size_t from, size_t to, void *data)
 {
+	struct frag_schedule sched;
 	double energy = 0.0;
 
+	efp_frag_schedule(efp, &sched);
+
 #ifdef _OPENMP
-#pragma omp parallel for schedule(dynamic) reduction(+:energy)
+#pragma omp parallel for schedule(runtime) reduction(+:energy)
 #endif
 	for (size_t i = from; i < to; i++) {
 		struct frag *frag = efp->frags + i;
+		double e_frag = 0.0;
 
 		for (size_t j = 0; j < frag->n_polarizable_pts; j++) {
 			struct polarizable_pt *pt = frag->polarizable_pts + j;
 			size_t idx = frag->polarizable_offset + j;
 
-			energy += 0.5 * vec_dot(&efp->indipconj[idx],
+			e_frag += 0.5 * vec_dot(&efp->indipconj[idx],
 						&pt->elec_field_wf) -
 				  0.5 * vec_dot(&efp->indip[idx],
 						&pt->elec_field);
 		}
+
+		if (efp->opts.enable_pairwise && efp->frag_pol_energy)
+			efp->frag_pol_energy[i] = e_frag;
+
+		energy += e_frag;
 	}
 
+	efp_restore_schedule(&sched);
+
 	*(double *)data += energy;
 }
 
-static enum efp_result
-efp_compute_id_iterative(struct efp *efp)
+static double
+get_pol_scf_tol(const struct efp *efp)
+{
+	return efp->opts.pol_scf_tol > 0.0 ? efp->opts.pol_scf_tol :
+	    POL_SCF_TOL;
+}
+
+static size_t
+get_pol_scf_max_iter(const struct efp *efp)
+{
+	return efp->opts.pol_scf_max_iter > 0 ? efp->opts.pol_scf_max_iter :
+	    POL_SCF_MAX_ITER;
+}
+
+/*
+ * Iterations start from dipoles of the previous solution if the geometry did
+ * not change since then, e.g. between QM/EFP SCF iterations where only the
+ * field of the ab initio electron density changes, or from dipoles set by
+ * efp_set_induced_dipoles.
+ */
+static int
+warm_start_id(struct efp *efp)
 {
+	if (efp->indip_guess || efp->indip_gen == efp->coord_gen) {
+		efp->indip_guess = 0;
+		return 1;
+	}
+
 	memset(efp->indip, 0, efp->n_polarizable_pts * sizeof(vec_t));
 	memset(efp->indipconj, 0, efp->n_polarizable_pts * sizeof(vec_t));
 
-	for (size_t iter = 1; iter <= POL_SCF_MAX_ITER; iter++) {
-		if (pol_scf_iter(efp) < POL_SCF_TOL)
+	return 0;
+}
+
+static void
+diis_get(const struct efp *efp, const struct id_diis *diis, double *x)
+{
+	size_t n = 3 * efp->n_polarizable_pts;
+
+	memcpy(x, efp->indip, n * sizeof(double));
+	if (diis->n > n)
+		memcpy(x + n, efp->indipconj, n * sizeof(double));
+}
+
+static void
+diis_set(struct efp *efp, const struct id_diis *diis, const double *x)
+{
+	size_t n = 3 * efp->n_polarizable_pts;
+
+	memcpy(efp->indip, x, n * sizeof(double));
+	if (diis->n > n)
+		memcpy(efp->indipconj, x + n, n * sizeof(double));
+}
+
+/*
+ * Replace dipoles after an iteration with the linear combination of stored
+ * dipoles which minimizes the norm of the combined residual. The history is
+ * dropped if the DIIS equations become singular.
+ */
+static void
+diis_extrapolate(struct efp *efp, struct id_diis *diis)
+{
+	size_t slot = diis->count % diis->size;
+	size_t k, n = diis->n;
+	double *x = diis->x + slot * n;
+	double *r = diis->r + slot * n;
+
+	diis_get(efp, diis, x);
+
+	for (size_t i = 0; i < n; i++)
+		r[i] = x[i] - diis->prev[i];
+
+	diis->count++;
+	k = diis->count < diis->size ? diis->count : diis->size;
+
+	for (size_t j = 0; j < k; j++) {
+		double dot = 0.0;
+
+		for (size_t i = 0; i < n; i++)
+			dot += r[i] * diis->r[j * n + i];
+
+		diis->b[slot * diis->size + j] = dot;
+		diis->b[j * diis->size + slot] = dot;
+	}
+
+	if (k < 2)
+		return;
+
+	double a[(k + 1) * (k + 1)], c[k + 1];
+	fortranint_t ipiv[k + 1];
+
+	for (size_t i = 0; i < k; i++) {
+		for (size_t j = 0; j < k; j++)
+			a[i * (k + 1) + j] = diis->b[i * diis->size + j];
+
+		a[i * (k + 1) + k] = -1.0;
+		a[k * (k + 1) + i] = -1.0;
+		c[i] = 0.0;
+	}
+
+	a[k * (k + 1) + k] = 0.0;
+	c[k] = -1.0;
+
+	if (efp_dgesv((fortranint_t)(k + 1), 1, a, (fortranint_t)(k + 1),
+	    ipiv, c, (fortranint_t)(k + 1)) != 0) {
+		diis->count = 0;
+		return;
+	}
+
+	for (size_t i = 0; i < n; i++) {
+		double sum = 0.0;
+
+		for (size_t j = 0; j < k; j++)
+			sum += c[j] * diis->x[j * n + i];
+
+		diis->prev[i] = sum;
+	}
+
+	diis_set(efp, diis, diis->prev);
+}
+
+static enum efp_result
+efp_compute_id_iterative(struct efp *efp, int conj)
+{
+	struct id_diis diis;
+	size_t max_iter = get_pol_scf_max_iter(efp);
+	double tol = get_pol_scf_tol(efp);
+	enum efp_result res = EFP_RESULT_POL_NOT_CONVERGED;
+
+	diis.size = efp->opts.pol_diis_size;
+	diis.n = 3 * efp->n_polarizable_pts * (conj ? 2 : 1);
+	diis.count = 0;
+	diis.prev = NULL;
+	diis.x = NULL;
+	diis.r = NULL;
+	diis.b = NULL;
+
+	if (diis.size > 0) {
+		size_t size = diis.size * diis.n * sizeof(double);
+
+		diis.prev = (double *)efp_alloc(efp, diis.n * sizeof(double));
+		diis.x = (double *)efp_alloc(efp, size);
+		diis.r = (double *)efp_alloc(efp, size);
+		diis.b = (double *)efp_alloc(efp,
+		    diis.size * diis.size * sizeof(double));
+
+		if (diis.prev == NULL || diis.x == NULL || diis.r == NULL ||
+		    diis.b == NULL) {
+			res = EFP_RESULT_NO_MEMORY;
+			goto error;
+		}
+	}
+
+	warm_start_id(efp);
+
+	for (size_t iter = 1; iter <= max_iter; iter++) {
+		double conv;
+
+		if (diis.size > 0)
+			diis_get(efp, &diis, diis.prev);
+		if ((res = pol_scf_iter(efp, conj, &conv)))
+			goto error;
+
+		efp->pol_iter = iter;
+		efp->pol_residual = conv;
+
+		if (conv < tol || iter == efp->opts.pol_fixed_iter) {
+			res = EFP_RESULT_SUCCESS;
 			break;
-		if (iter == POL_SCF_MAX_ITER)
-			return EFP_RESULT_POL_NOT_CONVERGED;
+		}
+
+		res = EFP_RESULT_POL_NOT_CONVERGED;
+
+		if (diis.size > 0)
+			diis_extrapolate(efp, &diis);
 	}
-	return EFP_RESULT_SUCCESS;
+error:
+	efp_free(efp, diis.prev);
+	efp_free(efp, diis.x);
+	efp_free(efp, diis.r);
+	efp_free(efp, diis.b);
+	return res;
+}
+
+/*
+ * Adaptive iterative solver. The field of induced dipoles is cached and only
+ * the change of dipoles of fragments which are not yet converged is
+ * propagated to other points on each sweep. Dipoles of a fragment are
+ * propagated once their accumulated change exceeds the convergence threshold
+ * per point so the cached field never lags behind by more than that. In
+ * inhomogeneous systems most fragments converge after a few sweeps and the
+ * remaining sweeps only evaluate fields of the strongly coupled region.
+ */
+static void
+compute_id_field_range(struct efp *efp, size_t from, size_t to, void *data)
+{
+	struct frag_schedule sched;
+	struct id_adaptive_data *ad = (struct id_adaptive_data *)data;
+
+	efp_frag_schedule(efp, &sched);
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(runtime)
+#endif
+	for (size_t i = from; i < to; i++) {
+		struct frag *frag = efp->frags + i;
+
+		for (size_t j = 0; j < frag->n_polarizable_pts; j++) {
+			struct polarizable_pt *pt = frag->polarizable_pts + j;
+			size_t idx = frag->polarizable_offset + j;
+
+			get_induced_dipole_field(efp, i, pt, ad->delta,
+			    ad->conj ? ad->delta_conj : NULL, ad->active,
+			    ad->field_new + idx, ad->field_conj_new + idx);
+		}
+	}
+
+	efp_restore_schedule(&sched);
+}
+
+static double
+update_id_adaptive(struct efp *efp, struct id_adaptive_data *ad)
+{
+	struct frag_schedule sched;
+	double conv = 0.0;
+
+	efp_frag_schedule(efp, &sched);
+
+#ifdef _OPENMP
+#pragma omp parallel for schedule(runtime) reduction(+:conv)
+#endif
+	for (size_t i = 0; i < efp->n_frag; i++) {
+		struct frag *frag = efp->frags + i;
+		double delta = 0.0;
+
+		for (size_t j = 0; j < frag->n_polarizable_pts; j++) {
+			struct polarizable_pt *pt = frag->polarizable_pts + j;
+			size_t idx = frag->polarizable_offset + j;
+			vec_t field, field_conj, id, id_conj;
+
+			field.x = pt->elec_field.x + pt->elec_field_wf.x +
+			    ad->field[idx].x;
+			field.y = pt->elec_field.y + pt->elec_field_wf.y +
+			    ad->field[idx].y;
+			field.z = pt->elec_field.z + pt->elec_field_wf.z +
+			    ad->field[idx].z;
+
+			id = mat_vec(&pt->tensor, &field);
+			conv += vec_dist(&id, &efp->indip[idx]);
+
+			ad->delta[idx].x += id.x - efp->indip[idx].x;
+			ad->delta[idx].y += id.y - efp->indip[idx].y;
+			ad->delta[idx].z += id.z - efp->indip[idx].z;
+
+			efp->indip[idx] = id;
+			delta += vec_len(&ad->delta[idx]);
+
+			if (!ad->conj)
+				continue;
+
+			field_conj.x = pt->elec_field.x + pt->elec_field_wf.x +
+			    ad->field_conj[idx].x;
+			field_conj.y = pt->elec_field.y + pt->elec_field_wf.y +
+			    ad->field_conj[idx].y;
+			field_conj.z = pt->elec_field.z + pt->elec_field_wf.z +
+			    ad->field_conj[idx].z;
+
+			id_conj = mat_trans_vec(&pt->tensor, &field_conj);
+			conv += vec_dist(&id_conj, &efp->indipconj[idx]);
+
+			ad->delta_conj[idx].x += id_conj.x -
+			    efp->indipconj[idx].x;
+			ad->delta_conj[idx].y += id_conj.y -
+			    efp->indipconj[idx].y;
+			ad->delta_conj[idx].z += id_conj.z -
+			    efp->indipconj[idx].z;
+
+			efp->indipconj[idx] = id_conj;
+			delta += vec_len(&ad->delta_conj[idx]);
+		}
+
+		ad->active[i] = delta > (ad->conj ? 2.0 : 1.0) *
+		    get_pol_scf_tol(efp) * frag->n_polarizable_pts;
+	}
+
+	efp_restore_schedule(&sched);
+
+	return conv / efp->n_polarizable_pts / (ad->conj ? 2 : 1);
+}
+
+static void
+propagate_id_field(struct efp *efp, struct id_adaptive_data *ad)
+{
+	size_t npts = efp->n_polarizable_pts;
+
+	memset(ad->field_new, 0, npts * sizeof(vec_t));
+	memset(ad->field_conj_new, 0, npts * sizeof(vec_t));
+
+	efp_balance_work(efp, compute_id_field_range, ad);
+
+	efp_allreduce((double *)ad->field_new, 3 * npts);
+	if (ad->conj)
+		efp_allreduce((double *)ad->field_conj_new, 3 * npts);
+
+	for (size_t i = 0; i < npts; i++) {
+		ad->field[i] = vec_add(ad->field + i, ad->field_new + i);
+		ad->field_conj[i] = vec_add(ad->field_conj + i,
+		    ad->field_conj_new + i);
+	}
+
+	for (size_t i = 0; i < efp->n_frag; i++) {
+		struct frag *frag = efp->frags + i;
+
+		if (!ad->active[i])
+			continue;
+
+		memset(ad->delta + frag->polarizable_offset, 0,
+		    frag->n_polarizable_pts * sizeof(vec_t));
+		memset(ad->delta_conj + frag->polarizable_offset, 0,
+		    frag->n_polarizable_pts * sizeof(vec_t));
+	}
+}
+
+static enum efp_result
+efp_compute_id_adaptive(struct efp *efp, int conj)
+{
+	struct id_adaptive_data ad;
+	size_t npts = efp->n_polarizable_pts;
+	enum efp_result res = EFP_RESULT_POL_NOT_CONVERGED;
+
+	ad.conj = conj;
+
+	ad.active = (char *)efp_alloc(efp, efp->n_frag);
+	ad.delta = (vec_t *)efp_alloc(efp, npts * sizeof(vec_t));
+	ad.delta_conj = (vec_t *)efp_alloc(efp, npts * sizeof(vec_t));
+	ad.field = (vec_t *)efp_alloc(efp, npts * sizeof(vec_t));
+	ad.field_conj = (vec_t *)efp_alloc(efp, npts * sizeof(vec_t));
+	ad.field_new = (vec_t *)efp_alloc(efp, npts * sizeof(vec_t));
+	ad.field_conj_new = (vec_t *)efp_alloc(efp, npts * sizeof(vec_t));
+
+	if (ad.active == NULL || ad.delta == NULL || ad.delta_conj == NULL ||
+	    ad.field == NULL || ad.field_conj == NULL ||
+	    ad.field_new == NULL || ad.field_conj_new == NULL) {
+		res = EFP_RESULT_NO_MEMORY;
+		goto error;
+	}
+
+	/* field of the initial dipoles is propagated in full */
+	if (warm_start_id(efp)) {
+		memcpy(ad.delta, efp->indip, npts * sizeof(vec_t));
+		memcpy(ad.delta_conj, efp->indipconj, npts * sizeof(vec_t));
+		memset(ad.active, 1, efp->n_frag);
+		propagate_id_field(efp, &ad);
+	}
+
+	for (size_t iter = 1; iter <= get_pol_scf_max_iter(efp); iter++) {
+		efp->pol_iter = iter;
+		efp->pol_residual = update_id_adaptive(efp, &ad);
+
+		if (efp->pol_residual < get_pol_scf_tol(efp) ||
+		    iter == efp->opts.pol_fixed_iter) {
+			res = EFP_RESULT_SUCCESS;
+			break;
+		}
+		propagate_id_field(efp, &ad);
+	}
+error:
+	efp_free(efp, ad.active);
+	efp_free(efp, ad.delta);
+	efp_free(efp, ad.delta_conj);
+	efp_free(efp, ad.field);
+	efp_free(efp, ad.field_conj);
+	efp_free(efp, ad.field_new);
+	efp_free(efp, ad.field_conj_new);
+	return res;
+}
+
+/*
+ * Conjugate induced dipoles need a separate solve only if some polarizability
+ * tensors are not symmetric. Without gradient and ab initio polarization the
+ * energy does not depend on them as the field of the wavefunction is zero.
+ */
+static int
+need_conj_id(const struct efp *efp)
+{
+	if (efp->pol_symmetric)
+		return 0;
+
+	return efp->do_gradient || (efp->opts.terms & EFP_TERM_AI_POL);
 }
 
 enum efp_result
 efp_compute_pol_energy(struct efp *efp, double *energy)
 {
 	enum efp_result res;
+	int conj;
 
 	assert(energy);
 
 	if ((res = compute_elec_field(efp)))
 		return res;
 
+	conj = need_conj_id(efp);
+
+	/* direct drivers do not iterate */
+	efp->pol_iter = 0;
+	efp->pol_residual = 0.0;
+
 	switch (efp->opts.pol_driver) {
 	case EFP_POL_DRIVER_ITERATIVE:
-		res = efp_compute_id_iterative(efp);
+		res = efp_compute_id_iterative(efp, conj);
 		break;
 	case EFP_POL_DRIVER_DIRECT:
-		res = efp_compute_id_direct(efp);
+		res = efp_compute_id_direct(efp, conj);
+		break;
+	case EFP_POL_DRIVER_ADAPTIVE:
+		res = efp_compute_id_adaptive(efp, conj);
+		break;
+	case EFP_POL_DRIVER_HODLR:
+		res = efp_compute_id_hodlr(efp, conj);
 		break;
 	}
 
 	if (res)
 		return res;
 
+	if (!conj)
+		memcpy(efp->indipconj, efp->indip,
+		    efp->n_polarizable_pts * sizeof(vec_t));
+
+	efp->indip_gen = efp->coord_gen;
+	efp->dipole_gen++;
 	*energy = 0.0;
+
+	if (efp->opts.enable_pairwise && efp->frag_pol_energy)
+		memset(efp->frag_pol_energy, 0, efp->n_frag * sizeof(double));
+
 	efp_balance_work(efp, compute_energy_range, energy);
 	efp_allreduce(energy, 1);
 
+	if (efp->opts.enable_pairwise && efp->frag_pol_energy)
+		efp_allreduce(efp->frag_pol_energy, efp->n_frag);
+
 	return EFP_RESULT_SUCCESS;
 }
 
@@ -549,7 +1078,7 @@ compute_grad_point(struct efp *efp, size_t frag_idx, size_t pt_idx)
 			    CVEC(pt_i->x), &force, &add_i);
 			efp_sub_force(efp->grad + j, CVEC(fr_j->x),
 			    CVEC(at_j->x), &force, &add_j);
-			efp_add_stress(&swf.dr, &force, &efp->stress);
+			efp_add_stress(efp, frag_idx, &swf.dr, &force);
 
 			energy += p1 * e;
 		}
@@ -623,7 +1152,7 @@ compute_grad_point(struct efp *efp, size_t frag_idx, size_t pt_idx)
 			    CVEC(pt_i->x), &force, &add_i);
 			efp_sub_force(efp->grad + j, CVEC(fr_j->x),
 			    CVEC(pt_j->x), &force, &add_j);
-			efp_add_stress(&swf.dr, &force, &efp->stress);
+			efp_add_stress(efp, frag_idx, &swf.dr, &force);
 
 			energy += p1 * e;
 		}
@@ -679,7 +1208,7 @@ compute_grad_point(struct efp *efp, size_t frag_idx, size_t pt_idx)
 			    CVEC(pt_i->x), &force, &add_i);
 			efp_sub_force(efp->grad + j, CVEC(fr_j->x),
 			    CVEC(pt_j->x), &force, &add_j);
-			efp_add_stress(&swf.dr, &force, &efp->stress);
+			efp_add_stress(efp, frag_idx, &swf.dr, &force);
 			energy += p1 * e;
 		}
 
@@ -688,7 +1217,7 @@ compute_grad_point(struct efp *efp, size_t frag_idx, size_t pt_idx)
 		force.z = swf.dswf.z * energy;
 		six_atomic_add_xyz(efp->grad + frag_idx, &force);
 		six_atomic_sub_xyz(efp->grad + j, &force);
-		efp_add_stress(&swf.dr, &force, &efp->stress);
+		efp_add_stress(efp, frag_idx, &swf.dr, &force);
 	}
 
 	/* induced dipole - ab initio nuclei */
@@ -709,14 +1238,19 @@ compute_grad_point(struct efp *efp, size_t frag_idx, size_t pt_idx)
 static void
 compute_grad_range(struct efp *efp, size_t from, size_t to, void *data)
 {
+	struct frag_schedule sched;
+
 	(void)data;
+	efp_frag_schedule(efp, &sched);
 
 #ifdef _OPENMP
-#pragma omp parallel for schedule(dynamic)
+#pragma omp parallel for schedule(runtime)
 #endif
 	for (size_t i = from; i < to; i++)
 		for (size_t j = 0; j < efp->frags[i].n_polarizable_pts; j++)
 			compute_grad_point(efp, i, j);
+
+	efp_restore_schedule(&sched);
 }
 
 enum efp_result
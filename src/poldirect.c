@@ -30,7 +30,7 @@
 #include "private.h"
 
 double efp_get_pol_damp_tt(double, double, double);
-enum efp_result efp_compute_id_direct(struct efp *);
+enum efp_result efp_compute_id_direct(struct efp *, int);
 
 static void
 copy_matrix(double *dst, size_t n, size_t off_i, size_t off_j, const mat_t *m)
@@ -149,7 +149,7 @@ compute_rhs(const struct efp *efp, vec_t *id, int conj)
 }
 
 enum efp_result
-efp_compute_id_direct(struct efp *efp)
+efp_compute_id_direct(struct efp *efp, int conj)
 {
 	double *c;
 	size_t n;
@@ -157,8 +157,8 @@ efp_compute_id_direct(struct efp *efp)
 	enum efp_result res;
 
 	n = 3 * efp->n_polarizable_pts;
-	c = (double *)calloc(n * n, sizeof *c);
-	ipiv = (fortranint_t *)calloc(n, sizeof *ipiv);
+	c = (double *)efp_alloc(efp, n * n * sizeof *c);
+	ipiv = (fortranint_t *)efp_alloc(efp, n * sizeof *ipiv);
 
 	if (c == NULL || ipiv == NULL) {
 		res = EFP_RESULT_NO_MEMORY;
@@ -178,19 +178,22 @@ efp_compute_id_direct(struct efp *efp)
 	}
 
 	/* conjugate induced dipoles */
-	compute_lhs(efp, c, 1);
-	compute_rhs(efp, efp->indipconj, 1);
-	transpose_matrix(c, n);
-
-	if (efp_dgesv((fortranint_t)n, 1, c, (fortranint_t)n, ipiv,
-	    (double *)efp->indipconj, (fortranint_t)n) != 0) {
-		efp_log("dgesv: error solving for conjugate induced dipoles");
-		res = EFP_RESULT_FATAL;
-		goto error;
+	if (conj) {
+		compute_lhs(efp, c, 1);
+		compute_rhs(efp, efp->indipconj, 1);
+		transpose_matrix(c, n);
+
+		if (efp_dgesv((fortranint_t)n, 1, c, (fortranint_t)n, ipiv,
+		    (double *)efp->indipconj, (fortranint_t)n) != 0) {
+			efp_log("dgesv: error solving for conjugate "
+			    "induced dipoles");
+			res = EFP_RESULT_FATAL;
+			goto error;
+		}
 	}
 	res = EFP_RESULT_SUCCESS;
 error:
-	free(c);
-	free(ipiv);
+	efp_free(efp, c);
+	efp_free(efp, ipiv);
 	return res;
 }
@@ -0,0 +1,675 @@
+/*-
+ * Copyright (c) 2012-2017 Ilya Kaliman
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+
+#include "clapack.h"
+#include "private.h"
+
+/*
+ * Direct solver of polarization equations which stores the matrix in the
+ * hierarchically off-diagonal low-rank (HODLR) format. Polarizable points are
+ * ordered by recursive bisection of space. Diagonal blocks of the leaves are
+ * LU factorized and off-diagonal blocks of each node are compressed by
+ * adaptive cross approximation. The matrix is factorized recursively using the
+ * Sherman-Morrison-Woodbury formula. For three-dimensional systems the rank
+ * of the off-diagonal blocks grows with the area of the interface between
+ * clusters, so memory and time grow much slower than for the dense direct
+ * solver but faster than linearly for bulk systems. The solver only pays off
+ * for large systems.
+ *
+ * Reference:
+ *
+ * Sivaram Ambikasaran and Eric Darve
+ *
+ * An O(N log N) fast direct solver for partial hierarchically semi-separable
+ * matrices
+ *
+ * J. Sci. Comput. 57, 477-501 (2013)
+ */
+
+/* maximum number of polarizable points in a leaf of the cluster tree */
+#define HODLR_LEAF_SIZE 32
+
+/* relative accuracy of low-rank approximations of off-diagonal blocks */
+#define HODLR_TOL 1.0e-8
+
+/* number of consecutive zero rows after which cross approximation stops */
+#define HODLR_MAX_ZERO_ROWS 16
+
+double efp_get_pol_damp_tt(double, double, double);
+enum efp_result efp_compute_id_hodlr(struct efp *, int);
+
+struct hodlr_pt {
+	/* fragment of the point */
+	size_t frag_idx;
+	/* index of the point in induced dipole arrays */
+	size_t idx;
+	/* the point itself */
+	const struct polarizable_pt *pt;
+	/* coordinate used for sorting */
+	double key;
+};
+
+struct hodlr_node {
+	/* range of points of this node in the permuted order */
+	size_t start;
+	size_t n_pts;
+	/* children, NULL for leaves */
+	struct hodlr_node *left;
+	struct hodlr_node *right;
+	/* leaves only: LU factorization of the diagonal block */
+	double *lu;
+	fortranint_t *ipiv;
+	/* off-diagonal blocks A_lr = u_lr v_lr^T and A_rl = u_rl v_rl^T where
+	 * y_lr = A_l^-1 u_lr and y_rl = A_r^-1 u_rl, column-major */
+	size_t rank_lr;
+	size_t rank_rl;
+	double *y_lr;
+	double *v_lr;
+	double *y_rl;
+	double *v_rl;
+	/* LU factorization of the capacitance matrix of rank_lr + rank_rl
+	 * size */
+	double *s_lu;
+	fortranint_t *s_ipiv;
+};
+
+struct hodlr {
+	struct efp *efp;
+	/* nonzero if the conjugate system is factorized */
+	int conj;
+	/* polarizable points in the permuted order */
+	struct hodlr_pt *pts;
+	/* first error which occurred */
+	enum efp_result res;
+};
+
+static double *
+hodlr_alloc(struct hodlr *h, size_t n)
+{
+	double *ptr = (double *)efp_alloc(h->efp, (n + 1) * sizeof(double));
+
+	if (ptr == NULL)
+		h->res = EFP_RESULT_NO_MEMORY;
+
+	return ptr;
+}
+
+static void
+gemm(char transa, char transb, size_t m, size_t n, size_t k, double alpha,
+    double *a, size_t lda, double *b, size_t ldb, double beta, double *c,
+    size_t ldc)
+{
+	if (m == 0 || n == 0 || k == 0)
+		return;
+
+	efp_dgemm(transa, transb, (fortranint_t)m, (fortranint_t)n,
+	    (fortranint_t)k, alpha, a, (fortranint_t)lda, b, (fortranint_t)ldb,
+	    beta, c, (fortranint_t)ldc);
+}
+
+/* LU factorization of a column-major n x n matrix in place */
+static fortranint_t *
+factor_lu(struct hodlr *h, double *a, size_t n)
+{
+	fortranint_t *ipiv;
+
+	ipiv = (fortranint_t *)efp_alloc(h->efp, (n + 1) * sizeof *ipiv);
+
+	if (ipiv == NULL) {
+		h->res = EFP_RESULT_NO_MEMORY;
+		return NULL;
+	}
+
+	if (efp_dgetrf((fortranint_t)n, a, (fortranint_t)n, ipiv) != 0) {
+		efp_log("dgetrf: error factorizing hodlr block");
+		h->res = EFP_RESULT_FATAL;
+		efp_free(h->efp, ipiv);
+		return NULL;
+	}
+
+	return ipiv;
+}
+
+static void
+solve_lu(double *a, fortranint_t *ipiv, size_t n, double *b, size_t nrhs,
+    size_t ldb)
+{
+	if (n == 0 || nrhs == 0)
+		return;
+
+	efp_dgetrs('N', (fortranint_t)n, (fortranint_t)nrhs, a,
+	    (fortranint_t)n, ipiv, b, (fortranint_t)ldb);
+}
+
+/* 3x3 block of the polarization matrix for points i and j */
+static mat_t
+get_block(const struct hodlr *h, size_t i, size_t j)
+{
+	const struct efp *efp = h->efp;
+	const struct hodlr_pt *p_i = h->pts + i;
+	const struct hodlr_pt *p_j = h->pts + j;
+
+	if (p_i->frag_idx == p_j->frag_idx)
+		return i == j ? mat_identity : mat_zero;
+
+	if (efp_skip_frag_pair(efp, p_i->frag_idx, p_j->frag_idx))
+		return mat_zero;
+
+	const struct frag *fr_i = efp->frags + p_i->frag_idx;
+	const struct frag *fr_j = efp->frags + p_j->frag_idx;
+	struct swf swf = efp_make_swf(efp, fr_i, fr_j);
+
+	vec_t dr = {
+		p_j->pt->x - p_i->pt->x - swf.cell.x,
+		p_j->pt->y - p_i->pt->y - swf.cell.y,
+		p_j->pt->z - p_i->pt->z - swf.cell.z
+	};
+
+	double p1 = 1.0;
+	double r = vec_len(&dr);
+	double r3 = r * r * r;
+	double r5 = r3 * r * r;
+
+	if (efp->opts.pol_damp == EFP_POL_DAMP_TT)
+		p1 = efp_get_pol_damp_tt(r, fr_i->pol_damp, fr_j->pol_damp);
+
+	double s = swf.swf * p1;
+	mat_t m = {
+		s * (3.0 * dr.x * dr.x / r5 - 1.0 / r3),
+		s * 3.0 * dr.x * dr.y / r5,
+		s * 3.0 * dr.x * dr.z / r5,
+		s * 3.0 * dr.y * dr.x / r5,
+		s * (3.0 * dr.y * dr.y / r5 - 1.0 / r3),
+		s * 3.0 * dr.y * dr.z / r5,
+		s * 3.0 * dr.z * dr.x / r5,
+		s * 3.0 * dr.z * dr.y / r5,
+		s * (3.0 * dr.z * dr.z / r5 - 1.0 / r3)
+	};
+
+	if (h->conj)
+		m = mat_trans_mat(&p_i->pt->tensor, &m);
+	else
+		m = mat_mat(&p_i->pt->tensor, &m);
+
+	mat_negate(&m);
+	return m;
+}
+
+/* row a of the matrix restricted to n_pts points starting from col */
+static void
+get_row(const struct hodlr *h, size_t a, size_t col, size_t n_pts,
+    double *out)
+{
+	for (size_t j = 0; j < n_pts; j++) {
+		mat_t m = get_block(h, a / 3, col + j);
+		const double *row = (const double *)&m + 3 * (a % 3);
+
+		out[3 * j + 0] = row[0];
+		out[3 * j + 1] = row[1];
+		out[3 * j + 2] = row[2];
+	}
+}
+
+/* column b of the matrix restricted to n_pts points starting from row */
+static void
+get_col(const struct hodlr *h, size_t b, size_t row, size_t n_pts,
+    double *out)
+{
+	for (size_t i = 0; i < n_pts; i++) {
+		mat_t m = get_block(h, row + i, b / 3);
+		const double *el = (const double *)&m + b % 3;
+
+		out[3 * i + 0] = el[0];
+		out[3 * i + 1] = el[3];
+		out[3 * i + 2] = el[6];
+	}
+}
+
+static int
+grow(struct hodlr *h, double **ptr, size_t n, size_t cap, size_t new_cap)
+{
+	double *tmp = hodlr_alloc(h, n * new_cap);
+
+	if (tmp == NULL)
+		return 0;
+
+	if (*ptr)
+		memcpy(tmp, *ptr, n * cap * sizeof(double));
+
+	efp_free(h->efp, *ptr);
+	*ptr = tmp;
+	return 1;
+}
+
+/*
+ * Adaptive cross approximation with partial pivoting of the block with rows
+ * of m_pts points starting from row and columns of n_pts points starting from
+ * col. On return u and v contain rank columns each.
+ */
+static void
+compress_block(struct hodlr *h, size_t row, size_t m_pts, size_t col,
+    size_t n_pts, double **u_out, double **v_out, size_t *rank_out)
+{
+	size_t m = 3 * m_pts, n = 3 * n_pts;
+	size_t max_rank = m < n ? m : n;
+	size_t rank = 0, cap = 0, n_zero = 0, i = 0;
+	double *u = NULL, *v = NULL, *dots = NULL, norm2 = 0.0;
+	char *used;
+
+	*u_out = NULL;
+	*v_out = NULL;
+	*rank_out = 0;
+
+	if ((used = (char *)efp_alloc(h->efp, m)) == NULL) {
+		h->res = EFP_RESULT_NO_MEMORY;
+		return;
+	}
+
+	memset(used, 0, m);
+
+	while (rank < max_rank) {
+		if (rank == cap) {
+			size_t new_cap = cap ? 2 * cap : 16;
+
+			if (new_cap > max_rank)
+				new_cap = max_rank;
+			if (!grow(h, &u, m, cap, new_cap) ||
+			    !grow(h, &v, n, cap, new_cap) ||
+			    !grow(h, &dots, 2, 0, new_cap))
+				goto error;
+			cap = new_cap;
+		}
+
+		double *uk = u + rank * m, *vk = v + rank * n;
+		size_t j = 0;
+
+		/* residual of row i */
+		used[i] = 1;
+		get_row(h, 3 * row + i, col, n_pts, vk);
+
+		gemm('N', 'T', n, 1, rank, -1.0, v, n, u + i, m, 1.0, vk, n);
+
+		for (size_t jj = 1; jj < n; jj++)
+			if (fabs(vk[jj]) > fabs(vk[j]))
+				j = jj;
+
+		if (vk[j] == 0.0) {
+			/* try another row spread over the block */
+			if (++n_zero == HODLR_MAX_ZERO_ROWS)
+				break;
+
+			size_t next = i;
+
+			for (size_t k = 0; k < m; k++) {
+				next = (next + m / HODLR_MAX_ZERO_ROWS + 1) % m;
+				if (!used[next])
+					break;
+			}
+			if (used[next])
+				break;
+			i = next;
+			continue;
+		}
+
+		n_zero = 0;
+
+		double pivot = vk[j];
+
+		for (size_t jj = 0; jj < n; jj++)
+			vk[jj] /= pivot;
+
+		/* residual of column j */
+		get_col(h, 3 * col + j, row, m_pts, uk);
+
+		gemm('N', 'T', m, 1, rank, -1.0, u, m, v + j, n, 1.0, uk, m);
+
+		double unorm2 = 0.0, vnorm2 = 0.0;
+
+		for (size_t ii = 0; ii < m; ii++)
+			unorm2 += uk[ii] * uk[ii];
+		for (size_t jj = 0; jj < n; jj++)
+			vnorm2 += vk[jj] * vk[jj];
+
+		/* update Frobenius norm of the approximation */
+		gemm('T', 'N', rank, 1, m, 1.0, u, m, uk, m, 0.0, dots, rank);
+		gemm('T', 'N', rank, 1, n, 1.0, v, n, vk, n, 0.0,
+		    dots + rank, rank);
+
+		for (size_t l = 0; l < rank; l++)
+			norm2 += 2.0 * dots[l] * dots[rank + l];
+
+		norm2 += unorm2 * vnorm2;
+		rank++;
+
+		if (unorm2 * vnorm2 <= HODLR_TOL * HODLR_TOL * norm2)
+			break;
+
+		/* next row is the largest entry of the new column */
+		size_t next = m;
+
+		for (size_t ii = 0; ii < m; ii++)
+			if (!used[ii] && (next == m ||
+			    fabs(uk[ii]) > fabs(uk[next])))
+				next = ii;
+		if (next == m)
+			break;
+		i = next;
+	}
+
+	efp_free(h->efp, used);
+	efp_free(h->efp, dots);
+	*u_out = u;
+	*v_out = v;
+	*rank_out = rank;
+	return;
+error:
+	efp_free(h->efp, used);
+	efp_free(h->efp, dots);
+	efp_free(h->efp, u);
+	efp_free(h->efp, v);
+}
+
+static int
+compare_key(const void *a, const void *b)
+{
+	double ka = ((const struct hodlr_pt *)a)->key;
+	double kb = ((const struct hodlr_pt *)b)->key;
+
+	return (ka > kb) - (ka < kb);
+}
+
+/* cluster tree by bisection along the longest side of the bounding box */
+static struct hodlr_node *
+build_tree(struct hodlr *h, size_t start, size_t n_pts)
+{
+	struct hodlr_node *node;
+
+	node = (struct hodlr_node *)efp_alloc(h->efp, sizeof(*node));
+	if (node == NULL) {
+		h->res = EFP_RESULT_NO_MEMORY;
+		return NULL;
+	}
+
+	memset(node, 0, sizeof(*node));
+	node->start = start;
+	node->n_pts = n_pts;
+
+	if (n_pts <= HODLR_LEAF_SIZE)
+		return node;
+
+	struct hodlr_pt *pts = h->pts + start;
+	vec_t lo = *CVEC(pts[0].pt->x), hi = lo;
+
+	for (size_t i = 1; i < n_pts; i++) {
+		lo.x = fmin(lo.x, pts[i].pt->x);
+		lo.y = fmin(lo.y, pts[i].pt->y);
+		lo.z = fmin(lo.z, pts[i].pt->z);
+		hi.x = fmax(hi.x, pts[i].pt->x);
+		hi.y = fmax(hi.y, pts[i].pt->y);
+		hi.z = fmax(hi.z, pts[i].pt->z);
+	}
+
+	vec_t side = vec_sub(&hi, &lo);
+	size_t axis = side.x >= side.y && side.x >= side.z ? 0 :
+	    side.y >= side.z ? 1 : 2;
+
+	for (size_t i = 0; i < n_pts; i++)
+		pts[i].key = (&pts[i].pt->x)[axis];
+
+	qsort(pts, n_pts, sizeof(*pts), compare_key);
+
+	node->left = build_tree(h, start, n_pts / 2);
+	node->right = build_tree(h, start + n_pts / 2, n_pts - n_pts / 2);
+
+	return node;
+}
+
+static void
+free_factor(struct hodlr *h, struct hodlr_node *node)
+{
+	if (node == NULL)
+		return;
+
+	free_factor(h, node->left);
+	free_factor(h, node->right);
+
+	efp_free(h->efp, node->lu);
+	efp_free(h->efp, node->ipiv);
+	efp_free(h->efp, node->y_lr);
+	efp_free(h->efp, node->v_lr);
+	efp_free(h->efp, node->y_rl);
+	efp_free(h->efp, node->v_rl);
+	efp_free(h->efp, node->s_lu);
+	efp_free(h->efp, node->s_ipiv);
+
+	node->lu = NULL;
+	node->ipiv = NULL;
+	node->y_lr = NULL;
+	node->v_lr = NULL;
+	node->y_rl = NULL;
+	node->v_rl = NULL;
+	node->s_lu = NULL;
+	node->s_ipiv = NULL;
+	node->rank_lr = 0;
+	node->rank_rl = 0;
+}
+
+static void
+free_tree(struct hodlr *h, struct hodlr_node *node)
+{
+	if (node == NULL)
+		return;
+
+	free_tree(h, node->left);
+	free_tree(h, node->right);
+	efp_free(h->efp, node);
+}
+
+/* overwrite nrhs columns of b with A^-1 b for the block of the node */
+static void
+solve(struct hodlr *h, const struct hodlr_node *node, double *b, size_t nrhs,
+    size_t ldb)
+{
+	size_t n = 3 * node->n_pts;
+
+	if (h->res)
+		return;
+
+	if (node->left == NULL) {
+		solve_lu(node->lu, node->ipiv, n, b, nrhs, ldb);
+		return;
+	}
+
+	size_t n_l = 3 * node->left->n_pts, n_r = 3 * node->right->n_pts;
+	size_t r1 = node->rank_lr, r2 = node->rank_rl, r = r1 + r2;
+
+	solve(h, node->left, b, nrhs, ldb);
+	solve(h, node->right, b + n_l, nrhs, ldb);
+
+	if (h->res || r == 0)
+		return;
+
+	double *w = hodlr_alloc(h, r * nrhs);
+
+	if (w == NULL)
+		return;
+
+	gemm('T', 'N', r1, nrhs, n_r, 1.0, node->v_lr, n_r, b + n_l, ldb, 0.0,
+	    w, r);
+	gemm('T', 'N', r2, nrhs, n_l, 1.0, node->v_rl, n_l, b, ldb, 0.0,
+	    w + r1, r);
+	solve_lu(node->s_lu, node->s_ipiv, r, w, nrhs, r);
+	gemm('N', 'N', n_l, nrhs, r1, -1.0, node->y_lr, n_l, w, r, 1.0,
+	    b, ldb);
+	gemm('N', 'N', n_r, nrhs, r2, -1.0, node->y_rl, n_r, w + r1, r, 1.0,
+	    b + n_l, ldb);
+
+	efp_free(h->efp, w);
+}
+
+static void
+factor(struct hodlr *h, struct hodlr_node *node)
+{
+	size_t n = 3 * node->n_pts;
+
+	if (h->res)
+		return;
+
+	if (node->left == NULL) {
+		double *a = hodlr_alloc(h, n * n);
+
+		if (a == NULL)
+			return;
+
+		for (size_t j = 0; j < node->n_pts; j++)
+			for (size_t i = 0; i < node->n_pts; i++) {
+				mat_t m = get_block(h, node->start + i,
+				    node->start + j);
+				const double *el = (const double *)&m;
+
+				for (size_t a_i = 0; a_i < 3; a_i++)
+					for (size_t a_j = 0; a_j < 3; a_j++)
+						a[(3 * j + a_j) * n +
+						    3 * i + a_i] =
+						    el[3 * a_i + a_j];
+			}
+
+		node->lu = a;
+		node->ipiv = factor_lu(h, a, n);
+		return;
+	}
+
+	factor(h, node->left);
+	factor(h, node->right);
+
+	size_t n_l = 3 * node->left->n_pts, n_r = 3 * node->right->n_pts;
+
+	compress_block(h, node->left->start, node->left->n_pts,
+	    node->right->start, node->right->n_pts, &node->y_lr,
+	    &node->v_lr, &node->rank_lr);
+	compress_block(h, node->right->start, node->right->n_pts,
+	    node->left->start, node->left->n_pts, &node->y_rl,
+	    &node->v_rl, &node->rank_rl);
+
+	/* u blocks are replaced by y = A^-1 u */
+	solve(h, node->left, node->y_lr, node->rank_lr, n_l);
+	solve(h, node->right, node->y_rl, node->rank_rl, n_r);
+
+	size_t r1 = node->rank_lr, r2 = node->rank_rl, r = r1 + r2;
+
+	if (h->res || r == 0)
+		return;
+
+	double *s = node->s_lu = hodlr_alloc(h, r * r);
+
+	if (s == NULL)
+		return;
+
+	memset(s, 0, r * r * sizeof(double));
+
+	gemm('T', 'N', r1, r2, n_r, 1.0, node->v_lr, n_r, node->y_rl, n_r,
+	    0.0, s + r1 * r, r);
+	gemm('T', 'N', r2, r1, n_l, 1.0, node->v_rl, n_l, node->y_lr, n_l,
+	    0.0, s + r1, r);
+
+	for (size_t i = 0; i < r; i++)
+		s[i * r + i] = 1.0;
+
+	node->s_ipiv = factor_lu(h, s, r);
+}
+
+enum efp_result
+efp_compute_id_hodlr(struct efp *efp, int conj)
+{
+	struct hodlr h;
+	struct hodlr_node *root = NULL;
+	size_t n_pts = efp->n_polarizable_pts;
+	double *b = NULL;
+
+	if (n_pts == 0)
+		return EFP_RESULT_SUCCESS;
+
+	h.efp = efp;
+	h.conj = 0;
+	h.res = EFP_RESULT_SUCCESS;
+	h.pts = (struct hodlr_pt *)efp_alloc(efp, n_pts * sizeof(*h.pts));
+
+	if (h.pts == NULL)
+		return EFP_RESULT_NO_MEMORY;
+
+	for (size_t i = 0, k = 0; i < efp->n_frag; i++) {
+		const struct frag *frag = efp->frags + i;
+
+		for (size_t j = 0; j < frag->n_polarizable_pts; j++, k++) {
+			h.pts[k].frag_idx = i;
+			h.pts[k].idx = frag->polarizable_offset + j;
+			h.pts[k].pt = frag->polarizable_pts + j;
+		}
+	}
+
+	root = build_tree(&h, 0, n_pts);
+	b = hodlr_alloc(&h, 3 * n_pts);
+
+	for (int pass = 0; pass <= conj && h.res == EFP_RESULT_SUCCESS;
+	    pass++) {
+		vec_t *id = pass ? efp->indipconj : efp->indip;
+
+		h.conj = pass;
+		factor(&h, root);
+
+		for (size_t k = 0; k < n_pts; k++) {
+			const struct polarizable_pt *pt = h.pts[k].pt;
+			vec_t field = vec_add(&pt->elec_field,
+			    &pt->elec_field_wf);
+
+			if (pass)
+				field = mat_trans_vec(&pt->tensor, &field);
+			else
+				field = mat_vec(&pt->tensor, &field);
+
+			b[3 * k + 0] = field.x;
+			b[3 * k + 1] = field.y;
+			b[3 * k + 2] = field.z;
+		}
+
+		solve(&h, root, b, 1, 3 * n_pts);
+
+		for (size_t k = 0; k < n_pts; k++) {
+			id[h.pts[k].idx].x = b[3 * k + 0];
+			id[h.pts[k].idx].y = b[3 * k + 1];
+			id[h.pts[k].idx].z = b[3 * k + 2];
+		}
+
+		free_factor(&h, root);
+	}
+
+	free_tree(&h, root);
+	efp_free(efp, b);
+	efp_free(efp, h.pts);
+	return h.res;
+}
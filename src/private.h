@@ -31,6 +31,7 @@
 
 #include "efp.h"
 #include "int.h"
+#include "kernel.h"
 #include "log.h"
 #include "swf.h"
 #include "terms.h"
@@ -70,6 +71,20 @@ struct ff_link {
 	size_t idx2;   /* index in ff_atoms array */
 };
 
+struct pair_list {
+	/* number of recorded pairs */
+	size_t n;
+
+	/* allocated size of pairs array */
+	size_t size;
+
+	/* recorded pairs */
+	struct efp_pair_energy *pairs;
+
+	/* nonzero if allocation of pairs array has failed */
+	int error;
+};
+
 struct frag {
 	/* fragment name */
 	char name[32];
@@ -83,6 +98,17 @@ struct frag {
 	/* pointer to the initial fragment state in library */
 	const struct frag *lib;
 
+	/* index of the library fragment in efp->lib */
+	size_t lib_idx;
+
+	/* potential file and offset of the parameters of a library fragment
+	 * which is not parsed yet, NULL once parsed (lazy library mode) */
+	char *lib_path;
+	long lib_offset;
+
+	/* nonzero if exchange repulsion data was not loaded */
+	int xr_skipped;
+
 	/* number of atoms in this fragment */
 	size_t n_atoms;
 
@@ -140,14 +166,32 @@ struct frag {
 	/* exchange repulsion wavefunction, size = n_lmo * xr_wf_size */
 	double *xr_wf;
 
-	/* rotational derivatives of MO coefficients */
-	double *xr_wf_deriv[3];
-
 	/* fitted ai-efp exchange-repulsion parameters */
 	double *xrfit;
 
+	/* nonzero if the arrays of this fragment which do not depend on its
+	 * position were moved to node shared memory, for fragment copies only
+	 * the wavefunction is moved as other such arrays belong to the
+	 * library fragment */
+	int shared;
+
 	/* offset of polarizable points for this fragment */
 	size_t polarizable_offset;
+
+	/* offset of atoms of this fragment in the atomic gradient */
+	size_t atom_offset;
+
+	/* library fragments only: principal axes of inertia (rows) in the
+	 * library frame, total mass and contribution of each atom to the
+	 * moment of inertia along each axis, size = 3 * n_atoms */
+	mat_t inertia_axes;
+	double total_mass;
+	double *atom_inertia;
+
+	/* specialized pair kernels matching the sizes of this fragment type,
+	 * selected in efp_prepare (see kernel.h) */
+	enum frag_kernel elec_kernel;
+	enum frag_kernel xr_kernel;
 };
 
 struct efp {
@@ -163,6 +207,17 @@ struct efp {
 	/* array with the library of fragment initial parameters */
 	struct frag **lib;
 
+	/* dispersion coefficients for each pair of fragment types present
+	 * in the system, n_disp_type * n_disp_type tables, NULL if not
+	 * precomputed */
+	double **disp_c6;
+
+	/* number of fragment types with dispersion coefficient tables */
+	size_t n_disp_type;
+
+	/* table index of each library fragment, SIZE_MAX if not present */
+	size_t *disp_type;
+
 	/* callback which computes electric field from electrons */
 	efp_electron_density_field_fn get_electron_density_field;
 
@@ -181,6 +236,10 @@ struct efp {
 	/* stress tensor */
 	mat_t stress;
 
+	/* per fragment contributions to the stress tensor, allocated if
+	 * stress computation is enabled */
+	mat_t *frag_stress;
+
 	/* force and torque on fragments */
 	six_t *grad;
 
@@ -205,6 +264,19 @@ struct efp {
 	/* total number of polarizable points */
 	size_t n_polarizable_pts;
 
+	/* total number of multipole points */
+	size_t n_multipole_pts;
+
+	/* read-only views for host codes, valid for coord_gen equal to
+	 * view_gen; see efp_get_multipole_view */
+	double *view_mult_xyz;
+	double *view_mult;
+	double *view_indip_xyz;
+	size_t view_gen;
+
+	/* incremented every time induced dipoles are computed */
+	size_t dipole_gen;
+
 	/* number of core orbitals in ab initio subsystem */
 	size_t n_ai_core;
 
@@ -227,6 +299,56 @@ struct efp {
 
 	/* skip-list of fragments - boolean array of nfrag^2 elements */
 	char *skiplist;
+
+	/* incremented on every change of coordinates, point charges, periodic
+	 * box, skip-list or options */
+	size_t coord_gen;
+
+	/* value of coord_gen for which static field on polarizable points was
+	 * computed */
+	size_t elec_field_gen;
+
+	/* value of coord_gen for which induced dipoles were last converged */
+	size_t indip_gen;
+
+	/* induced dipoles were set by efp_set_induced_dipoles and are used as
+	 * the starting point of the next solve */
+	int indip_guess;
+
+	/* all polarizability tensors are symmetric so conjugate induced
+	 * dipoles are equal to induced dipoles */
+	int pol_symmetric;
+
+	/* number of iterations and final residual of the last polarization
+	 * solve */
+	size_t pol_iter;
+	double pol_residual;
+
+	/* fragment pair energies, one list for each fragment, a pair is
+	 * stored in the list of the fragment which computed it */
+	struct pair_list *pair_lists;
+
+	/* per fragment polarization energy */
+	double *frag_pol_energy;
+
+	/* memory limit in bytes, zero if unlimited */
+	size_t mem_limit;
+
+	/* persistent memory computed during efp_prepare */
+	size_t mem_resident;
+
+	/* memory in temporary buffers allocated with efp_alloc */
+	size_t mem_transient;
+
+	/* peak of resident plus transient memory */
+	size_t mem_peak;
+
+	/* memory shared by processes of a node, NULL if not used */
+	struct shm *shm;
+
+	/* value of coord_gen for which shared fragment wavefunctions were
+	 * rotated */
+	size_t shm_wf_gen;
 };
 
 #endif /* LIBEFP_PRIVATE_H */
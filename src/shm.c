@@ -0,0 +1,186 @@
+/*-
+ * Copyright (c) 2012-2017 Ilya Kaliman
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifdef EFP_USE_MPI
+#include <mpi.h>
+#endif
+
+#include <stdlib.h>
+
+#include "balance.h"
+#include "log.h"
+#include "shm.h"
+
+/*
+ * Memory shared by all processes of a node. Every allocation is a separate
+ * MPI-3 shared window which is owned by the process with the lowest rank on
+ * the node. Other processes access it directly through their own mapping.
+ * Windows stay locked for passive target access for their entire lifetime
+ * and are synchronized by efp_shm_barrier. Without MPI the node consists of
+ * a single process and nothing is ever shared.
+ */
+
+#ifdef EFP_USE_MPI
+struct shm {
+	/* communicator of the processes of this node */
+	MPI_Comm comm;
+
+	/* rank of this process on the node and number of processes */
+	int rank, size;
+
+	/* shared windows allocated so far */
+	size_t n_win;
+	MPI_Win *win;
+};
+#endif
+
+enum efp_result
+efp_shm_init(struct shm **out)
+{
+#ifdef EFP_USE_MPI
+	struct shm *shm;
+
+	if ((shm = (struct shm *)calloc(1, sizeof(*shm))) == NULL)
+		return EFP_RESULT_NO_MEMORY;
+
+	if (MPI_Comm_split_type(efp_comm(), MPI_COMM_TYPE_SHARED, 0,
+	    MPI_INFO_NULL, &shm->comm) != MPI_SUCCESS) {
+		efp_log("unable to create node communicator");
+		free(shm);
+		return EFP_RESULT_FATAL;
+	}
+
+	MPI_Comm_rank(shm->comm, &shm->rank);
+	MPI_Comm_size(shm->comm, &shm->size);
+
+	*out = shm;
+#else
+	*out = NULL;
+#endif
+	return EFP_RESULT_SUCCESS;
+}
+
+void
+efp_shm_shutdown(struct shm *shm)
+{
+#ifdef EFP_USE_MPI
+	if (shm == NULL)
+		return;
+
+	for (size_t i = 0; i < shm->n_win; i++) {
+		MPI_Win_unlock_all(shm->win[i]);
+		MPI_Win_free(&shm->win[i]);
+	}
+
+	MPI_Comm_free(&shm->comm);
+	free(shm->win);
+	free(shm);
+#else
+	(void)shm;
+#endif
+}
+
+/* collective over the node, returns NULL if memory can not be shared */
+void *
+efp_shm_alloc(struct shm *shm, size_t size)
+{
+#ifdef EFP_USE_MPI
+	MPI_Win *win;
+	MPI_Aint win_size;
+	int disp_unit;
+	void *ptr;
+
+	if (shm == NULL || shm->size < 2 || size == 0)
+		return NULL;
+
+	win = (MPI_Win *)realloc(shm->win, (shm->n_win + 1) * sizeof(*win));
+
+	if (win == NULL)
+		return NULL;
+
+	shm->win = win;
+	win += shm->n_win;
+
+	if (MPI_Win_allocate_shared(shm->rank == 0 ? (MPI_Aint)size : 0, 1,
+	    MPI_INFO_NULL, shm->comm, &ptr, win) != MPI_SUCCESS)
+		return NULL;
+
+	MPI_Win_shared_query(*win, 0, &win_size, &disp_unit, &ptr);
+	MPI_Win_lock_all(MPI_MODE_NOCHECK, *win);
+	shm->n_win++;
+
+	return ptr;
+#else
+	(void)shm;
+	(void)size;
+
+	return NULL;
+#endif
+}
+
+int
+efp_shm_rank(struct shm *shm)
+{
+#ifdef EFP_USE_MPI
+	return shm ? shm->rank : 0;
+#else
+	(void)shm;
+
+	return 0;
+#endif
+}
+
+int
+efp_shm_size(struct shm *shm)
+{
+#ifdef EFP_USE_MPI
+	return shm ? shm->size : 1;
+#else
+	(void)shm;
+
+	return 1;
+#endif
+}
+
+/* makes stores to shared memory visible to all processes of the node */
+void
+efp_shm_barrier(struct shm *shm)
+{
+#ifdef EFP_USE_MPI
+	if (shm == NULL)
+		return;
+
+	for (size_t i = 0; i < shm->n_win; i++)
+		MPI_Win_sync(shm->win[i]);
+
+	MPI_Barrier(shm->comm);
+
+	for (size_t i = 0; i < shm->n_win; i++)
+		MPI_Win_sync(shm->win[i]);
+#else
+	(void)shm;
+#endif
+}
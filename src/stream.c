@@ -293,6 +293,26 @@ efp_stream_eol(struct stream *stream)
 	return stream->ptr == NULL || *stream->ptr == '\0';
 }
 
+long
+efp_stream_tell(struct stream *stream)
+{
+	assert(stream);
+
+	return ftell(stream->in);
+}
+
+int
+efp_stream_seek(struct stream *stream, long offset)
+{
+	assert(stream);
+
+	free(stream->buffer);
+	stream->buffer = NULL;
+	stream->ptr = NULL;
+
+	return fseek(stream->in, offset, SEEK_SET) == 0;
+}
+
 int
 efp_stream_eof(struct stream *stream)
 {
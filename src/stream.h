@@ -45,6 +45,8 @@ int efp_stream_advance(struct stream *, size_t);
 void efp_stream_skip_space(struct stream *);
 void efp_stream_skip_nonspace(struct stream *);
 int efp_stream_eol(struct stream *);
+long efp_stream_tell(struct stream *);
+int efp_stream_seek(struct stream *, long);
 int efp_stream_eof(struct stream *);
 void efp_stream_close(struct stream *);
 
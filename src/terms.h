@@ -40,10 +40,13 @@ void efp_frag_frag_xr(struct efp *, size_t, size_t, double *,
 enum efp_result efp_compute_pol(struct efp *);
 enum efp_result efp_compute_ai_elec(struct efp *);
 enum efp_result efp_compute_ai_disp(struct efp *);
+enum efp_result efp_prepare_disp(struct efp *);
+enum efp_result efp_compute_disp_ewald(struct efp *);
 enum efp_result efp_compute_pol_energy(struct efp *, double *);
 void efp_update_elec(struct frag *);
 void efp_update_pol(struct frag *);
 void efp_update_disp(struct frag *);
 void efp_update_xr(struct frag *);
+void efp_update_xr_wf(struct frag *);
 
 #endif /* LIBEFP_TERMS_H */
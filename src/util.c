@@ -24,11 +24,121 @@
  * SUCH DAMAGE.
  */
 
+/* posix_memalign and madvise */
+#define _DEFAULT_SOURCE
+
 #include <ctype.h>
+#include <stdlib.h>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
 
 #include "private.h"
 #include "util.h"
 
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+/* keeps the size of the allocation in front of the returned pointer */
+union mem_header {
+	size_t size;
+	double align_d;
+	void *align_p;
+};
+
+/* all accesses to the memory counters go through the efp_mem section */
+static void
+release_transient(struct efp *efp, size_t size)
+{
+#ifdef _OPENMP
+#pragma omp critical(efp_mem)
+#endif
+	efp->mem_transient -= size;
+}
+
+/*
+ * Allocate zero-initialized temporary buffer. Allocated memory is accounted
+ * in the efp object and allocation fails if the memory limit is exceeded.
+ */
+void *
+efp_alloc(struct efp *efp, size_t size)
+{
+	union mem_header *hdr;
+	int fail = 0;
+
+#ifdef _OPENMP
+#pragma omp critical(efp_mem)
+#endif
+	{
+		size_t total = efp->mem_resident + efp->mem_transient + size;
+
+		if (efp->mem_limit > 0 && total > efp->mem_limit) {
+			fail = 1;
+		} else {
+			efp->mem_transient += size;
+
+			if (total > efp->mem_peak)
+				efp->mem_peak = total;
+		}
+	}
+
+	if (fail) {
+		efp_log("memory limit of %zu bytes exceeded", efp->mem_limit);
+		return NULL;
+	}
+
+	if (efp->opts.enable_huge_pages) {
+		hdr = (union mem_header *)efp_alloc_large(sizeof(*hdr) + size, 1);
+		if (hdr)
+			memset(hdr, 0, sizeof(*hdr) + size);
+	} else {
+		hdr = (union mem_header *)calloc(1, sizeof(*hdr) + size);
+	}
+
+	if (hdr == NULL) {
+		release_transient(efp, size);
+		return NULL;
+	}
+
+	hdr->size = size;
+	return hdr + 1;
+}
+
+/*
+ * Allocate large array. If huge is nonzero the array is aligned to huge page
+ * boundary and transparent huge pages are requested on Linux. Memory can be
+ * released with free.
+ */
+void *
+efp_alloc_large(size_t size, int huge)
+{
+	void *ptr;
+
+	if (!huge || size < HUGE_PAGE_SIZE)
+		return malloc(size);
+
+	if (posix_memalign(&ptr, HUGE_PAGE_SIZE, size))
+		return NULL;
+
+#ifdef MADV_HUGEPAGE
+	madvise(ptr, size, MADV_HUGEPAGE);
+#endif
+	return ptr;
+}
+
+void
+efp_free(struct efp *efp, void *ptr)
+{
+	union mem_header *hdr;
+
+	if (ptr == NULL)
+		return;
+
+	hdr = (union mem_header *)ptr - 1;
+	release_transient(efp, hdr->size);
+	free(hdr);
+}
+
 int
 efp_skip_frag_pair(const struct efp *efp, size_t fr_i_idx, size_t fr_j_idx)
 {
@@ -146,7 +256,7 @@ efp_points_to_matrix(const double *pts, mat_t *rotmat)
 	rotmat->zz = cross.z;
 }
 
-const struct frag *
+struct frag *
 efp_find_lib(struct efp *efp, const char *name)
 {
 	for (size_t i = 0; i < efp->n_lib; i++)
@@ -155,23 +265,29 @@ efp_find_lib(struct efp *efp, const char *name)
 	return NULL;
 }
 
+/*
+ * Contributions are accumulated separately for each fragment. Work is always
+ * split by the first fragment of a pair so no locking is needed. Per fragment
+ * values are summed after all gradient terms are computed.
+ */
 void
-efp_add_stress(const vec_t *dr, const vec_t *force, mat_t *stress)
+efp_add_stress(struct efp *efp, size_t frag_idx, const vec_t *dr,
+    const vec_t *force)
 {
-#ifdef _OPENMP
-#pragma omp critical
-#endif
-	{
-		stress->xx += dr->x * force->x;
-		stress->xy += dr->x * force->y;
-		stress->xz += dr->x * force->z;
-		stress->yx += dr->y * force->x;
-		stress->yy += dr->y * force->y;
-		stress->yz += dr->y * force->z;
-		stress->zx += dr->z * force->x;
-		stress->zy += dr->z * force->y;
-		stress->zz += dr->z * force->z;
-	}
+	if (!efp->opts.enable_stress)
+		return;
+
+	mat_t *stress = efp->frag_stress + frag_idx;
+
+	stress->xx += dr->x * force->x;
+	stress->xy += dr->x * force->y;
+	stress->xz += dr->x * force->z;
+	stress->yx += dr->y * force->x;
+	stress->yy += dr->y * force->y;
+	stress->yz += dr->y * force->z;
+	stress->zx += dr->z * force->x;
+	stress->zy += dr->z * force->y;
+	stress->zz += dr->z * force->z;
 }
 
 void
@@ -37,8 +37,9 @@ struct swf efp_make_swf(const struct efp *, const struct frag *,
     const struct frag *);
 int efp_check_rotation_matrix(const mat_t *);
 void efp_points_to_matrix(const double *, mat_t *);
-const struct frag *efp_find_lib(struct efp *, const char *);
-void efp_add_stress(const vec_t *, const vec_t *, mat_t *);
+struct frag *efp_find_lib(struct efp *, const char *);
+enum efp_result efp_parse_lib(struct frag *, int);
+void efp_add_stress(struct efp *, size_t, const vec_t *, const vec_t *);
 void efp_add_force(six_t *, const vec_t *, const vec_t *,
     const vec_t *, const vec_t *);
 void efp_sub_force(six_t *, const vec_t *, const vec_t *,
@@ -46,6 +47,9 @@ void efp_sub_force(six_t *, const vec_t *, const vec_t *,
 void efp_move_pt(const vec_t *, const mat_t *, const vec_t *, vec_t *);
 void efp_rotate_t2(const mat_t *, const double *, double *);
 void efp_rotate_t3(const mat_t *, const double *, double *);
+void *efp_alloc(struct efp *, size_t);
+void efp_free(struct efp *, void *);
+void *efp_alloc_large(size_t, int);
 int efp_strcasecmp(const char *, const char *);
 int efp_strncasecmp(const char *, const char *, size_t);
 
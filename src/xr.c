@@ -27,6 +27,10 @@
 #include <stdlib.h>
 #include <string.h>
 
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 #include "clapack.h"
 #include "private.h"
 
@@ -101,69 +105,211 @@ charge_penetration_grad(struct efp *efp, size_t fr_i_idx, size_t fr_j_idx,
 	six_atomic_add_abc(efp->grad + fr_i_idx, &torque_i);
 	six_atomic_sub_abc(efp->grad + fr_j_idx, &torque_j);
 
-	efp_add_stress(&swf->dr, &force, &efp->stress);
+	efp_add_stress(efp, fr_i_idx, &swf->dr, &force);
 }
 
-static void
+/* Products over a fragment pair are small (a few LMOs by a few tens of basis
+ * functions for water). At these sizes BLAS call overhead dominates, so such
+ * products use a plain kernel instead. */
+#define SMALL_GEMM_SIZE 32768
+
+/* BLAS is only used from serial code, a threaded BLAS would spawn threads
+ * inside the OpenMP loops over fragments and pairs */
+static int
+use_blas(size_t size)
+{
+#ifdef _OPENMP
+	if (omp_in_parallel())
+		return 0;
+#endif
+	return size > SMALL_GEMM_SIZE;
+}
+
+/* C = op(A) * op(B) for column-major matrices, see efp_dgemm. Inlined so
+ * that the loops get constant bounds in the fixed size transforms below. */
+static ALWAYS_INLINE void
+small_dgemm(char transa, char transb, size_t m, size_t n, size_t k,
+    double *a, size_t lda, double *b, size_t ldb, double *c, size_t ldc)
+{
+	size_t b_row, b_col;
+
+	if (use_blas(m * n * k)) {
+		efp_dgemm(transa, transb, (fortranint_t)m, (fortranint_t)n,
+		    (fortranint_t)k, 1.0, a, (fortranint_t)lda, b,
+		    (fortranint_t)ldb, 0.0, c, (fortranint_t)ldc);
+		return;
+	}
+
+	b_row = transb == 'N' ? 1 : ldb;
+	b_col = transb == 'N' ? ldb : 1;
+
+	for (size_t j = 0; j < n; j++) {
+		const double *b_j = b + j * b_col;
+		double *c_j = c + j * ldc;
+
+		if (transa == 'N') {
+			for (size_t i = 0; i < m; i++)
+				c_j[i] = 0.0;
+
+			for (size_t l = 0; l < k; l++) {
+				const double *a_l = a + l * lda;
+				double w = b_j[l * b_row];
+
+				for (size_t i = 0; i < m; i++)
+					c_j[i] += a_l[i] * w;
+			}
+		} else {
+			size_t i = 0;
+
+			/* four independent sums hide the add latency, each
+			 * one is still summed in order */
+			for (; i + 4 <= m; i += 4) {
+				const double *a_i = a + i * lda;
+				double s0 = 0.0, s1 = 0.0, s2 = 0.0, s3 = 0.0;
+
+				for (size_t l = 0; l < k; l++) {
+					double w = b_j[l * b_row];
+
+					s0 += a_i[l] * w;
+					s1 += a_i[lda + l] * w;
+					s2 += a_i[2 * lda + l] * w;
+					s3 += a_i[3 * lda + l] * w;
+				}
+
+				c_j[i] = s0;
+				c_j[i + 1] = s1;
+				c_j[i + 2] = s2;
+				c_j[i + 3] = s3;
+			}
+
+			for (; i < m; i++) {
+				const double *a_i = a + i * lda;
+				double sum = 0.0;
+
+				for (size_t l = 0; l < k; l++)
+					sum += a_i[l] * b_j[l * b_row];
+
+				c_j[i] = sum;
+			}
+		}
+	}
+}
+
+static ALWAYS_INLINE void
 transform_integrals(size_t n_lmo_i, size_t n_lmo_j, size_t wf_size_i,
     size_t wf_size_j, double *wf_i, double *wf_j, double *s, double *lmo_s,
     double *tmp)
 {
-	efp_dgemm('N', 'N', (fortranint_t)wf_size_j, (fortranint_t)n_lmo_i,
-	    (fortranint_t)wf_size_i, 1.0, s, (fortranint_t)wf_size_j, wf_i,
-	    (fortranint_t)wf_size_i, 0.0, tmp, (fortranint_t)wf_size_j);
-	efp_dgemm('T', 'N', (fortranint_t)n_lmo_j, (fortranint_t)n_lmo_i,
-	    (fortranint_t)wf_size_j, 1.0, wf_j, (fortranint_t)wf_size_j, tmp,
-	    (fortranint_t)wf_size_j, 0.0, lmo_s, (fortranint_t)n_lmo_j);
+	small_dgemm('N', 'N', wf_size_j, n_lmo_i, wf_size_i, s, wf_size_j,
+	    wf_i, wf_size_i, tmp, wf_size_j);
+	small_dgemm('T', 'N', n_lmo_j, n_lmo_i, wf_size_j, wf_j, wf_size_j,
+	    tmp, wf_size_j, lmo_s, n_lmo_j);
 }
 
-static void
+/* Rotational contribution to the derivatives of transformed integrals for
+ * all three axes at once. The integrals are transformed over fragment j
+ * first so that each axis costs only a product of LMO size. */
+static ALWAYS_INLINE void
+transform_rot_derivatives(size_t n_lmo_i, size_t n_lmo_j, size_t wf_size_i,
+    size_t wf_size_j, double *wf_deriv_i, double *wf_j, double *s,
+    double *lmo_ds, double *tmp)
+{
+	small_dgemm('T', 'N', n_lmo_j, wf_size_i, wf_size_j, wf_j, wf_size_j,
+	    s, wf_size_j, tmp, n_lmo_j);
+	small_dgemm('N', 'N', n_lmo_j, 3 * n_lmo_i, wf_size_i, tmp, n_lmo_j,
+	    wf_deriv_i, wf_size_i, lmo_ds, n_lmo_j);
+}
+
+/* Same as transform_integrals for the six derivative components. The six_t
+ * array is used directly as a 6 * wf_size_j by wf_size_i matrix; the first
+ * product leaves the components of fragment j functions outermost so that
+ * the second one is a single product too. The result is component-major
+ * (SoA) and is scattered back into six_t at the end. The tmp buffer holds
+ * 6 * n_lmo_i * (wf_size_j + n_lmo_j) values. */
+static ALWAYS_INLINE void
 transform_integral_derivatives(size_t n_lmo_i, size_t n_lmo_j, size_t wf_size_i,
-    size_t wf_size_j, const double *wf_i, const double *wf_j, const six_t *ds,
-    six_t *lmo_ds, six_t *tmp)
+    size_t wf_size_j, double *wf_i, double *wf_j, six_t *ds, six_t *lmo_ds,
+    double *tmp)
 {
-	const six_t *p_ds;
-	six_t *p_tmp, *p_lmo_ds;
+	double *soa = tmp + 6 * n_lmo_i * wf_size_j;
 
-	p_tmp = tmp;
-	for (size_t i = 0; i < n_lmo_i; i++) {
-	for (size_t j = 0; j < wf_size_j; j++, p_tmp++) {
-		six_t sum = six_zero;
-		p_ds = ds + j;
-
-		for (size_t k = 0; k < wf_size_i; k++, p_ds += wf_size_j) {
-			double w = wf_i[wf_size_i * i + k];
-
-			sum.x += p_ds->x * w;
-			sum.y += p_ds->y * w;
-			sum.z += p_ds->z * w;
-			sum.a += p_ds->a * w;
-			sum.b += p_ds->b * w;
-			sum.c += p_ds->c * w;
-		}
-		*p_tmp = sum;
-	} }
+	small_dgemm('T', 'T', n_lmo_i, 6 * wf_size_j, wf_size_i, wf_i,
+	    wf_size_i, (double *)ds, 6 * wf_size_j, tmp, n_lmo_i);
+	small_dgemm('N', 'N', 6 * n_lmo_i, n_lmo_j, wf_size_j, tmp, 6 * n_lmo_i,
+	    wf_j, wf_size_j, soa, 6 * n_lmo_i);
 
-	p_lmo_ds = lmo_ds;
 	for (size_t i = 0; i < n_lmo_i; i++) {
-	for (size_t j = 0; j < n_lmo_j; j++, p_lmo_ds++) {
-		six_t sum = six_zero;
-		p_tmp = tmp + i * wf_size_j;
-
-		for (size_t k = 0; k < wf_size_j; k++, p_tmp++) {
-			double w = wf_j[wf_size_j * j + k];
-
-			sum.x += p_tmp->x * w;
-			sum.y += p_tmp->y * w;
-			sum.z += p_tmp->z * w;
-			sum.a += p_tmp->a * w;
-			sum.b += p_tmp->b * w;
-			sum.c += p_tmp->c * w;
+		for (size_t j = 0; j < n_lmo_j; j++) {
+			const double *p = soa + 6 * n_lmo_i * j + i;
+			double *out = (double *)(lmo_ds + i * n_lmo_j + j);
+
+			for (size_t c = 0; c < 6; c++)
+				out[c] = p[c * n_lmo_i];
 		}
-		*p_lmo_ds = sum;
-	} }
+	}
 }
 
+/*
+ * Integral transforms for a pair of fragments. The generic versions take the
+ * sizes of the fragments at run time; for a pair of fragments of the same type
+ * listed in kernel.h the sizes are compile time constants, which lets the
+ * compiler unroll and vectorize the products.
+ */
+struct xr_transforms {
+	void (*integrals)(size_t, size_t, size_t, size_t, double *, double *,
+	    double *, double *, double *);
+	void (*rot_derivatives)(size_t, size_t, size_t, size_t, double *,
+	    double *, double *, double *, double *);
+	void (*integral_derivatives)(size_t, size_t, size_t, size_t, double *,
+	    double *, six_t *, six_t *, double *);
+};
+
+#define XR_TRANSFORMS(name, lmo_i, lmo_j, wf_i, wf_j) \
+static void \
+transform_integrals_##name(size_t n_lmo_i, size_t n_lmo_j, size_t wf_size_i, \
+    size_t wf_size_j, double *a, double *b, double *c, double *d, double *e) \
+{ \
+	assert(n_lmo_i == lmo_i && n_lmo_j == lmo_j); \
+	assert(wf_size_i == wf_i && wf_size_j == wf_j); \
+	transform_integrals(lmo_i, lmo_j, wf_i, wf_j, a, b, c, d, e); \
+} \
+static void \
+transform_rot_derivatives_##name(size_t n_lmo_i, size_t n_lmo_j, \
+    size_t wf_size_i, size_t wf_size_j, double *a, double *b, double *c, \
+    double *d, double *e) \
+{ \
+	assert(n_lmo_i == lmo_i && n_lmo_j == lmo_j); \
+	assert(wf_size_i == wf_i && wf_size_j == wf_j); \
+	transform_rot_derivatives(lmo_i, lmo_j, wf_i, wf_j, a, b, c, d, e); \
+} \
+static void \
+transform_integral_derivatives_##name(size_t n_lmo_i, size_t n_lmo_j, \
+    size_t wf_size_i, size_t wf_size_j, double *a, double *b, six_t *c, \
+    six_t *d, double *e) \
+{ \
+	assert(n_lmo_i == lmo_i && n_lmo_j == lmo_j); \
+	assert(wf_size_i == wf_i && wf_size_j == wf_j); \
+	transform_integral_derivatives(lmo_i, lmo_j, wf_i, wf_j, a, b, c, d, \
+	    e); \
+}
+
+XR_TRANSFORMS(generic, n_lmo_i, n_lmo_j, wf_size_i, wf_size_j)
+#define X(name, n_mult, n_lmo, wf_size) \
+	XR_TRANSFORMS(name, n_lmo, n_lmo, wf_size, wf_size)
+FRAG_KERNEL_TYPES(X)
+#undef X
+#undef XR_TRANSFORMS
+
+static const struct xr_transforms xr_transforms[FRAG_KERNEL_COUNT] = {
+	{ transform_integrals_generic, transform_rot_derivatives_generic,
+	    transform_integral_derivatives_generic },
+#define X(name, n_mult, n_lmo, wf_size) \
+	{ transform_integrals_##name, transform_rot_derivatives_##name, \
+	    transform_integral_derivatives_##name },
+	FRAG_KERNEL_TYPES(X)
+#undef X
+};
+
 static void
 add_six_vec(size_t el, size_t size, const double *vec, six_t *six)
 {
@@ -173,113 +319,222 @@ add_six_vec(size_t el, size_t size, const double *vec, six_t *six)
 		*ptr += *vec;
 }
 
-/*
- * Reference:
- *
- * Hui Li, Mark Gordon
- *
- * Gradients of the exchange-repulsion energy in the general effective fragment
- * potential method
- *
- * Theor. Chem. Acc. 115, 385 (2006)
- */
+/* per fragment pair quantities shared by all lmo pairs */
+struct xr_pair {
+	double *fs;  /* fs[i][j] = sum_k F_i(i,k) S(k,j) */
+	double *sf;  /* sf[i][j] = sum_l S(i,l) F_j(l,j) */
+	six_t *dfs;  /* derivatives of fs */
+	six_t *dsf;  /* derivatives of sf */
+	double *vi;  /* coulomb potential of fragment j at lmo centroids of i */
+	double *vj;  /* coulomb potential of fragment i at lmo centroids of j */
+	six_t *dvi;  /* derivatives of vi */
+	six_t *dvj;  /* derivatives of vj */
+};
+
 static void
-lmo_lmo_xr_grad(struct efp *efp, size_t fr_i_idx, size_t fr_j_idx,
-    size_t i, size_t j, const double *lmo_s, const double *lmo_t,
-    const six_t *lmo_ds, const six_t *lmo_dt, const struct swf *swf)
+coef_deriv_p(size_t axis, const double *coef, double *der)
 {
-	const struct frag *fr_i = efp->frags + fr_i_idx;
-	const struct frag *fr_j = efp->frags + fr_j_idx;
-	const vec_t *ct_i = fr_i->lmo_centroids + i;
-	const vec_t *ct_j = fr_j->lmo_centroids + j;
+	switch (axis) {
+	case 0:
+		der[0] = 0.0;
+		der[1] = coef[2];
+		der[2] = -coef[1];
+		break;
+	case 1:
+		der[0] = -coef[2];
+		der[1] = 0.0;
+		der[2] = coef[0];
+		break;
+	case 2:
+		der[0] = coef[1];
+		der[1] = -coef[0];
+		der[2] = 0.0;
+		break;
+	};
+}
 
-	size_t ij = i * fr_j->n_lmo + j;
+static void
+coef_deriv_d(size_t axis, const double *coef, double *der)
+{
+	const double sqrt3 = sqrt(3.0);
 
-	vec_t dr = {
-		ct_j->x - ct_i->x - swf->cell.x,
-		ct_j->y - ct_i->y - swf->cell.y,
-		ct_j->z - ct_i->z - swf->cell.z
+	switch (axis) {
+	case 0:
+		der[0] = 0.0;
+		der[1] = sqrt3 * coef[5];
+		der[2] = -sqrt3 * coef[5];
+		der[3] = coef[4];
+		der[4] = -coef[3];
+		der[5] = 2.0 / sqrt3 * (coef[2] - coef[1]);
+		break;
+	case 1:
+		der[0] = -sqrt3 * coef[4];
+		der[1] = 0.0;
+		der[2] = sqrt3 * coef[4];
+		der[3] = -coef[5];
+		der[4] = 2.0 / sqrt3 * (coef[0] - coef[2]);
+		der[5] = coef[3];
+		break;
+	case 2:
+		der[0] = sqrt3 * coef[3];
+		der[1] = -sqrt3 * coef[3];
+		der[2] = 0.0;
+		der[3] = 2.0 / sqrt3 * (coef[1] - coef[0]);
+		der[4] = coef[5];
+		der[5] = -coef[4];
+		break;
 	};
+}
 
-	double s_ij = lmo_s[ij];
-	double t_ij = lmo_t[ij];
-	double r_ij = vec_len(&dr);
-	double r_ij3 = r_ij * r_ij * r_ij;
+static void
+coef_deriv_f(size_t axis, const double *coef, double *der)
+{
+	const double sqrt3 = sqrt(3.0);
+	const double sqrt5 = sqrt(5.0);
 
-	six_t ds_ij = lmo_ds[ij];
-	six_t dt_ij = lmo_dt[ij];
+	switch (axis) {
+	case 0:
+		der[0] = 0.0;
+		der[1] = sqrt5 * coef[6];
+		der[2] = -sqrt5 * coef[8];
+		der[3] = coef[4];
+		der[4] = -coef[3];
+		der[5] = sqrt3 * coef[9];
+		der[6] = -3.0 / sqrt5 * coef[1] + 2.0 * coef[8];
+		der[7] = -sqrt3 * coef[9];
+		der[8] = 3.0 / sqrt5 * coef[2] - 2.0 * coef[6];
+		der[9] = 2.0 / sqrt3 * (coef[7] - coef[5]);
+		break;
+	case 1:
+		der[0] = -sqrt5 * coef[4];
+		der[1] = 0.0;
+		der[2] = sqrt5 * coef[7];
+		der[3] = -sqrt3 * coef[9];
+		der[4] = 3.0 / sqrt5 * coef[0] - 2.0 * coef[7];
+		der[5] = -coef[6];
+		der[6] = coef[5];
+		der[7] = -3.0 / sqrt5 * coef[2] + 2.0 * coef[4];
+		der[8] = sqrt3 * coef[9];
+		der[9] = 2.0 / sqrt3 * (coef[3] - coef[8]);
+		break;
+	case 2:
+		der[0] = sqrt5 * coef[3];
+		der[1] = -sqrt5 * coef[5];
+		der[2] = 0.0;
+		der[3] = -3.0 / sqrt5 * coef[0] + 2.0 * coef[5];
+		der[4] = sqrt3 * coef[9];
+		der[5] = 3.0 / sqrt5 * coef[1] - 2.0 * coef[3];
+		der[6] = -sqrt3 * coef[9];
+		der[7] = coef[8];
+		der[8] = -coef[7];
+		der[9] = 2.0 / sqrt3 * (coef[6] - coef[4]);
+		break;
+	};
+}
 
-	double t1, t2;
-	vec_t force = vec_zero, torque_i = vec_zero;
+/* Derivatives of the rotated LMO coefficients with respect to rotations of
+ * the fragment about x, y, and z. The result holds three consecutive
+ * n_lmo x xr_wf_size blocks. */
+static void
+wf_rot_deriv(const struct frag *frag, double *deriv)
+{
+	size_t size = frag->n_lmo * frag->xr_wf_size;
 
-	/* first part */
-	if (fabs(s_ij) > INTEGRAL_THRESHOLD) {
-		double ln_s = log(fabs(s_ij));
+	memset(deriv, 0, 3 * size * sizeof(double));
 
-		t1 = s_ij / r_ij * (-sqrt(-2.0 / PI / ln_s) +
-		    4.0 * sqrt(-2.0 / PI * ln_s));
-		t2 = 2.0 * sqrt(-2.0 / PI * ln_s) * s_ij * s_ij / r_ij3;
+	for (size_t k = 0; k < frag->n_lmo; k++) {
+		const double *coef = frag->xr_wf + k * frag->xr_wf_size;
+		double *der = deriv + k * frag->xr_wf_size;
 
-		force.x += -t1 * ds_ij.x - t2 * dr.x;
-		force.y += -t1 * ds_ij.y - t2 * dr.y;
-		force.z += -t1 * ds_ij.z - t2 * dr.z;
+		for (size_t j = 0, func = 0; j < frag->n_xr_atoms; j++) {
+			const struct xr_atom *atom = frag->xr_atoms + j;
 
-		torque_i.x += t1 * ds_ij.a + t2 * (dr.y * (ct_i->z - fr_i->z) -
-						   dr.z * (ct_i->y - fr_i->y));
-		torque_i.y += t1 * ds_ij.b + t2 * (dr.z * (ct_i->x - fr_i->x) -
-						   dr.x * (ct_i->z - fr_i->z));
-		torque_i.z += t1 * ds_ij.c + t2 * (dr.x * (ct_i->y - fr_i->y) -
-						   dr.y * (ct_i->x - fr_i->x));
+			for (size_t i = 0; i < atom->n_shells; i++) {
+				switch (atom->shells[i].type) {
+				case 'S':
+					func++;
+					break;
+				case 'L':
+					func++;
+					/* fall through */
+				case 'P':
+					for (size_t a = 0; a < 3; a++)
+						coef_deriv_p(a, coef + func,
+						    der + a * size + func);
+					func += 3;
+					break;
+				case 'D':
+					for (size_t a = 0; a < 3; a++)
+						coef_deriv_d(a, coef + func,
+						    der + a * size + func);
+					func += 6;
+					break;
+				case 'F':
+					for (size_t a = 0; a < 3; a++)
+						coef_deriv_f(a, coef + func,
+						    der + a * size + func);
+					func += 10;
+					break;
+				}
+			}
+		}
 	}
+}
 
-	/* second part */
-	double fij = 0.0, fji = 0.0;
-	six_t dfij = six_zero, dfji = six_zero;
+static void
+unpack_fock(size_t n_lmo, const double *fock_mat, double *out)
+{
+	for (size_t i = 0; i < n_lmo; i++)
+		for (size_t j = 0; j < n_lmo; j++)
+			out[i * n_lmo + j] = fock_mat[fock_idx(i, j)];
+}
 
-	for (size_t k = 0; k < fr_i->n_lmo; k++) {
-		double fe = fr_i->xr_fock_mat[fock_idx(i, k)];
-		const six_t *ds = lmo_ds + k * fr_j->n_lmo + j;
+/* computes fs and sf products of overlap and fock matrices */
+static void
+compute_fock_overlap(const struct frag *fr_i, const struct frag *fr_j,
+    double *fock_i, double *fock_j, double *lmo_s, double *fs, double *sf)
+{
+	size_t n_i = fr_i->n_lmo;
+	size_t n_j = fr_j->n_lmo;
 
-		fij += fe * lmo_s[k * fr_j->n_lmo + j];
+	/* matrices are row-major so the operands are swapped */
+	small_dgemm('N', 'N', n_j, n_i, n_i, lmo_s, n_j, fock_i, n_i, fs, n_j);
+	small_dgemm('N', 'N', n_j, n_i, n_j, fock_j, n_j, lmo_s, n_j, sf, n_j);
+}
 
-		dfij.x += fe * ds->x;
-		dfij.y += fe * ds->y;
-		dfij.z += fe * ds->z;
-		dfij.a += fe * ds->a;
-		dfij.b += fe * ds->b;
-		dfij.c += fe * ds->c;
-	}
+/* same as compute_fock_overlap but for overlap derivatives */
+static void
+compute_fock_overlap_deriv(const struct frag *fr_i, const struct frag *fr_j,
+    double *fock_i, double *fock_j, six_t *lmo_ds, six_t *dfs, six_t *dsf)
+{
+	size_t n_i = fr_i->n_lmo;
+	size_t n_j = fr_j->n_lmo;
 
-	for (size_t l = 0; l < fr_j->n_lmo; l++) {
-		double fe = fr_j->xr_fock_mat[fock_idx(j, l)];
-		const six_t *ds = lmo_ds + i * fr_j->n_lmo + l;
+	small_dgemm('N', 'N', 6 * n_j, n_i, n_i, (double *)lmo_ds, 6 * n_j,
+	    fock_i, n_i, (double *)dfs, 6 * n_j);
 
-		fji += fe * lmo_s[i * fr_j->n_lmo + l];
+	for (size_t i = 0; i < n_i; i++) {
+		double *ds = (double *)(lmo_ds + i * n_j);
+		double *out = (double *)(dsf + i * n_j);
 
-		dfji.x += fe * ds->x;
-		dfji.y += fe * ds->y;
-		dfji.z += fe * ds->z;
-		dfji.a += fe * ds->a;
-		dfji.b += fe * ds->b;
-		dfji.c += fe * ds->c;
+		small_dgemm('N', 'N', 6, n_j, n_j, ds, 6, fock_j, n_j, out, 6);
 	}
+}
 
-	t1 = (fij + fji - 2.0 * t_ij);
-
-	force.x += -t1 * ds_ij.x - s_ij * (dfij.x + dfji.x - 2.0 * dt_ij.x);
-	force.y += -t1 * ds_ij.y - s_ij * (dfij.y + dfji.y - 2.0 * dt_ij.y);
-	force.z += -t1 * ds_ij.z - s_ij * (dfij.z + dfji.z - 2.0 * dt_ij.z);
-
-	torque_i.x += t1 * ds_ij.a + s_ij * (dfij.a + dfji.a - 2.0 * dt_ij.a);
-	torque_i.y += t1 * ds_ij.b + s_ij * (dfij.b + dfji.b - 2.0 * dt_ij.b);
-	torque_i.z += t1 * ds_ij.c + s_ij * (dfij.c + dfji.c - 2.0 * dt_ij.c);
-
-	/* third part */
-	double vib = 0.0, vja = 0.0;
-	six_t dvib = six_zero, dvja = six_zero;
+/*
+ * Potential at lmo centroid i of fragment i due to nuclei and lmo centroids
+ * of fragment j. Derivatives are computed if dv is not NULL.
+ */
+static double
+lmo_potential_i(const struct frag *fr_i, const struct frag *fr_j, size_t i,
+    const struct swf *swf, six_t *dv)
+{
+	const vec_t *ct_i = fr_i->lmo_centroids + i;
+	double v = 0.0;
+	six_t d = six_zero;
 
 	for (size_t l = 0; l < fr_j->n_xr_atoms; l++) {
-		struct xr_atom *at_j = fr_j->xr_atoms + l;
+		const struct xr_atom *at_j = fr_j->xr_atoms + l;
 
 		vec_t dr_a = {
 			at_j->x - ct_i->x - swf->cell.x,
@@ -290,22 +545,22 @@ lmo_lmo_xr_grad(struct efp *efp, size_t fr_i_idx, size_t fr_j_idx,
 		double r = vec_len(&dr_a);
 		double tmp = at_j->znuc / (r * r * r);
 
-		vib -= at_j->znuc / r;
+		v -= at_j->znuc / r;
 
-		dvib.x -= tmp * dr_a.x;
-		dvib.y -= tmp * dr_a.y;
-		dvib.z -= tmp * dr_a.z;
+		d.x -= tmp * dr_a.x;
+		d.y -= tmp * dr_a.y;
+		d.z -= tmp * dr_a.z;
 
-		dvib.a -= tmp * (dr_a.y * (ct_i->z - fr_i->z) -
-				 dr_a.z * (ct_i->y - fr_i->y));
-		dvib.b -= tmp * (dr_a.z * (ct_i->x - fr_i->x) -
-				 dr_a.x * (ct_i->z - fr_i->z));
-		dvib.c -= tmp * (dr_a.x * (ct_i->y - fr_i->y) -
-				 dr_a.y * (ct_i->x - fr_i->x));
+		d.a -= tmp * (dr_a.y * (ct_i->z - fr_i->z) -
+			      dr_a.z * (ct_i->y - fr_i->y));
+		d.b -= tmp * (dr_a.z * (ct_i->x - fr_i->x) -
+			      dr_a.x * (ct_i->z - fr_i->z));
+		d.c -= tmp * (dr_a.x * (ct_i->y - fr_i->y) -
+			      dr_a.y * (ct_i->x - fr_i->x));
 	}
 
 	for (size_t l = 0; l < fr_j->n_lmo; l++) {
-		vec_t *ct_jj = fr_j->lmo_centroids + l;
+		const vec_t *ct_jj = fr_j->lmo_centroids + l;
 
 		vec_t dr_a = {
 			ct_jj->x - ct_i->x - swf->cell.x,
@@ -316,22 +571,40 @@ lmo_lmo_xr_grad(struct efp *efp, size_t fr_i_idx, size_t fr_j_idx,
 		double r = vec_len(&dr_a);
 		double tmp = 2.0 / (r * r * r);
 
-		vib += 2.0 / r;
+		v += 2.0 / r;
 
-		dvib.x += tmp * dr_a.x;
-		dvib.y += tmp * dr_a.y;
-		dvib.z += tmp * dr_a.z;
+		d.x += tmp * dr_a.x;
+		d.y += tmp * dr_a.y;
+		d.z += tmp * dr_a.z;
 
-		dvib.a += tmp * (dr_a.y * (ct_i->z - fr_i->z) -
-				 dr_a.z * (ct_i->y - fr_i->y));
-		dvib.b += tmp * (dr_a.z * (ct_i->x - fr_i->x) -
-				 dr_a.x * (ct_i->z - fr_i->z));
-		dvib.c += tmp * (dr_a.x * (ct_i->y - fr_i->y) -
-				 dr_a.y * (ct_i->x - fr_i->x));
+		d.a += tmp * (dr_a.y * (ct_i->z - fr_i->z) -
+			      dr_a.z * (ct_i->y - fr_i->y));
+		d.b += tmp * (dr_a.z * (ct_i->x - fr_i->x) -
+			      dr_a.x * (ct_i->z - fr_i->z));
+		d.c += tmp * (dr_a.x * (ct_i->y - fr_i->y) -
+			      dr_a.y * (ct_i->x - fr_i->x));
 	}
 
+	if (dv)
+		*dv = d;
+
+	return v;
+}
+
+/*
+ * Potential at lmo centroid j of fragment j due to nuclei and lmo centroids
+ * of fragment i. Derivatives are computed if dv is not NULL.
+ */
+static double
+lmo_potential_j(const struct frag *fr_i, const struct frag *fr_j, size_t j,
+    const struct swf *swf, six_t *dv)
+{
+	const vec_t *ct_j = fr_j->lmo_centroids + j;
+	double v = 0.0;
+	six_t d = six_zero;
+
 	for (size_t k = 0; k < fr_i->n_xr_atoms; k++) {
-		struct xr_atom *at_i = fr_i->xr_atoms + k;
+		const struct xr_atom *at_i = fr_i->xr_atoms + k;
 
 		vec_t dr_a = {
 			ct_j->x - at_i->x - swf->cell.x,
@@ -342,22 +615,22 @@ lmo_lmo_xr_grad(struct efp *efp, size_t fr_i_idx, size_t fr_j_idx,
 		double r = vec_len(&dr_a);
 		double tmp = at_i->znuc / (r * r * r);
 
-		vja -= at_i->znuc / r;
+		v -= at_i->znuc / r;
 
-		dvja.x -= tmp * dr_a.x;
-		dvja.y -= tmp * dr_a.y;
-		dvja.z -= tmp * dr_a.z;
+		d.x -= tmp * dr_a.x;
+		d.y -= tmp * dr_a.y;
+		d.z -= tmp * dr_a.z;
 
-		dvja.a -= tmp * (dr_a.y * (at_i->z - fr_i->z) -
-				 dr_a.z * (at_i->y - fr_i->y));
-		dvja.b -= tmp * (dr_a.z * (at_i->x - fr_i->x) -
-				 dr_a.x * (at_i->z - fr_i->z));
-		dvja.c -= tmp * (dr_a.x * (at_i->y - fr_i->y) -
-				 dr_a.y * (at_i->x - fr_i->x));
+		d.a -= tmp * (dr_a.y * (at_i->z - fr_i->z) -
+			      dr_a.z * (at_i->y - fr_i->y));
+		d.b -= tmp * (dr_a.z * (at_i->x - fr_i->x) -
+			      dr_a.x * (at_i->z - fr_i->z));
+		d.c -= tmp * (dr_a.x * (at_i->y - fr_i->y) -
+			      dr_a.y * (at_i->x - fr_i->x));
 	}
 
 	for (size_t k = 0; k < fr_i->n_lmo; k++) {
-		vec_t *ct_ii = fr_i->lmo_centroids + k;
+		const vec_t *ct_ii = fr_i->lmo_centroids + k;
 
 		vec_t dr_a = {
 			ct_j->x - ct_ii->x - swf->cell.x,
@@ -368,34 +641,118 @@ lmo_lmo_xr_grad(struct efp *efp, size_t fr_i_idx, size_t fr_j_idx,
 		double r = vec_len(&dr_a);
 		double tmp = 2.0 / (r * r * r);
 
-		vja += 2.0 / r;
+		v += 2.0 / r;
+
+		d.x += tmp * dr_a.x;
+		d.y += tmp * dr_a.y;
+		d.z += tmp * dr_a.z;
+
+		d.a += tmp * (dr_a.y * (ct_ii->z - fr_i->z) -
+			      dr_a.z * (ct_ii->y - fr_i->y));
+		d.b += tmp * (dr_a.z * (ct_ii->x - fr_i->x) -
+			      dr_a.x * (ct_ii->z - fr_i->z));
+		d.c += tmp * (dr_a.x * (ct_ii->y - fr_i->y) -
+			      dr_a.y * (ct_ii->x - fr_i->x));
+	}
+
+	if (dv)
+		*dv = d;
+
+	return v;
+}
+
+/*
+ * Reference:
+ *
+ * Hui Li, Mark Gordon
+ *
+ * Gradients of the exchange-repulsion energy in the general effective fragment
+ * potential method
+ *
+ * Theor. Chem. Acc. 115, 385 (2006)
+ */
+static void
+lmo_lmo_xr_grad(struct efp *efp, size_t fr_i_idx, size_t fr_j_idx,
+    size_t i, size_t j, const double *lmo_s, const double *lmo_t,
+    const six_t *lmo_ds, const six_t *lmo_dt, const struct xr_pair *pair,
+    const struct swf *swf)
+{
+	const struct frag *fr_i = efp->frags + fr_i_idx;
+	const struct frag *fr_j = efp->frags + fr_j_idx;
+	const vec_t *ct_i = fr_i->lmo_centroids + i;
+	const vec_t *ct_j = fr_j->lmo_centroids + j;
 
-		dvja.x += tmp * dr_a.x;
-		dvja.y += tmp * dr_a.y;
-		dvja.z += tmp * dr_a.z;
+	size_t ij = i * fr_j->n_lmo + j;
 
-		dvja.a += tmp * (dr_a.y * (ct_ii->z - fr_i->z) -
-				 dr_a.z * (ct_ii->y - fr_i->y));
-		dvja.b += tmp * (dr_a.z * (ct_ii->x - fr_i->x) -
-				 dr_a.x * (ct_ii->z - fr_i->z));
-		dvja.c += tmp * (dr_a.x * (ct_ii->y - fr_i->y) -
-				 dr_a.y * (ct_ii->x - fr_i->x));
+	vec_t dr = {
+		ct_j->x - ct_i->x - swf->cell.x,
+		ct_j->y - ct_i->y - swf->cell.y,
+		ct_j->z - ct_i->z - swf->cell.z
+	};
+
+	double s_ij = lmo_s[ij];
+	double t_ij = lmo_t[ij];
+	double r_ij = vec_len(&dr);
+	double r_ij3 = r_ij * r_ij * r_ij;
+
+	six_t ds_ij = lmo_ds[ij];
+	six_t dt_ij = lmo_dt[ij];
+
+	double t1, t2;
+	vec_t force = vec_zero, torque_i = vec_zero;
+
+	/* first part */
+	if (fabs(s_ij) > INTEGRAL_THRESHOLD) {
+		double ln_s = log(fabs(s_ij));
+
+		t1 = s_ij / r_ij * (-sqrt(-2.0 / PI / ln_s) +
+		    4.0 * sqrt(-2.0 / PI * ln_s));
+		t2 = 2.0 * sqrt(-2.0 / PI * ln_s) * s_ij * s_ij / r_ij3;
+
+		force.x += -t1 * ds_ij.x - t2 * dr.x;
+		force.y += -t1 * ds_ij.y - t2 * dr.y;
+		force.z += -t1 * ds_ij.z - t2 * dr.z;
+
+		torque_i.x += t1 * ds_ij.a + t2 * (dr.y * (ct_i->z - fr_i->z) -
+						   dr.z * (ct_i->y - fr_i->y));
+		torque_i.y += t1 * ds_ij.b + t2 * (dr.z * (ct_i->x - fr_i->x) -
+						   dr.x * (ct_i->z - fr_i->z));
+		torque_i.z += t1 * ds_ij.c + t2 * (dr.x * (ct_i->y - fr_i->y) -
+						   dr.y * (ct_i->x - fr_i->x));
 	}
 
-	t1 = 2.0 * s_ij * (vib + vja - 1.0 / r_ij);
+	/* second part */
+	const six_t *dfij = pair->dfs + ij;
+	const six_t *dfji = pair->dsf + ij;
+
+	t1 = (pair->fs[ij] + pair->sf[ij] - 2.0 * t_ij);
+
+	force.x += -t1 * ds_ij.x - s_ij * (dfij->x + dfji->x - 2.0 * dt_ij.x);
+	force.y += -t1 * ds_ij.y - s_ij * (dfij->y + dfji->y - 2.0 * dt_ij.y);
+	force.z += -t1 * ds_ij.z - s_ij * (dfij->z + dfji->z - 2.0 * dt_ij.z);
+
+	torque_i.x += t1 * ds_ij.a + s_ij * (dfij->a + dfji->a - 2.0 * dt_ij.a);
+	torque_i.y += t1 * ds_ij.b + s_ij * (dfij->b + dfji->b - 2.0 * dt_ij.b);
+	torque_i.z += t1 * ds_ij.c + s_ij * (dfij->c + dfji->c - 2.0 * dt_ij.c);
+
+	/* third part */
+	const six_t *dvib = pair->dvi + i;
+	const six_t *dvja = pair->dvj + j;
+
+	t1 = 2.0 * s_ij * (pair->vi[i] + pair->vj[j] - 1.0 / r_ij);
 
 	force.x += t1 * ds_ij.x +
-	    s_ij * s_ij * (dvib.x + dvja.x - dr.x / r_ij3);
+	    s_ij * s_ij * (dvib->x + dvja->x - dr.x / r_ij3);
 	force.y += t1 * ds_ij.y +
-	    s_ij * s_ij * (dvib.y + dvja.y - dr.y / r_ij3);
+	    s_ij * s_ij * (dvib->y + dvja->y - dr.y / r_ij3);
 	force.z += t1 * ds_ij.z +
-	    s_ij * s_ij * (dvib.z + dvja.z - dr.z / r_ij3);
+	    s_ij * s_ij * (dvib->z + dvja->z - dr.z / r_ij3);
 
-	torque_i.x += -t1 * ds_ij.a - s_ij * s_ij * (dvib.a + dvja.a -
+	torque_i.x += -t1 * ds_ij.a - s_ij * s_ij * (dvib->a + dvja->a -
 	    (dr.y * (ct_i->z - fr_i->z) - dr.z * (ct_i->y - fr_i->y)) / r_ij3);
-	torque_i.y += -t1 * ds_ij.b - s_ij * s_ij * (dvib.b + dvja.b -
+	torque_i.y += -t1 * ds_ij.b - s_ij * s_ij * (dvib->b + dvja->b -
 	    (dr.z * (ct_i->x - fr_i->x) - dr.x * (ct_i->z - fr_i->z)) / r_ij3);
-	torque_i.z += -t1 * ds_ij.c - s_ij * s_ij * (dvib.c + dvja.c -
+	torque_i.z += -t1 * ds_ij.c - s_ij * s_ij * (dvib->c + dvja->c -
 	    (dr.x * (ct_i->y - fr_i->y) - dr.y * (ct_i->x - fr_i->x)) / r_ij3);
 
 	force.x *= 2.0 * swf->swf;
@@ -420,15 +777,17 @@ lmo_lmo_xr_grad(struct efp *efp, size_t fr_i_idx, size_t fr_j_idx,
 	six_atomic_add_abc(efp->grad + fr_i_idx, &torque_i);
 	six_atomic_sub_abc(efp->grad + fr_j_idx, &torque_j);
 
-	efp_add_stress(&swf->dr, &force, &efp->stress);
+	efp_add_stress(efp, fr_i_idx, &swf->dr, &force);
 }
 
 static double
-lmo_lmo_xr_energy(struct frag *fr_i, struct frag *fr_j, size_t i, size_t j,
-    const double *lmo_s, const double *lmo_t, const struct swf *swf)
+lmo_lmo_xr_energy(const struct frag *fr_i, const struct frag *fr_j, size_t i,
+    size_t j, const double *lmo_s, const double *lmo_t,
+    const struct xr_pair *pair, const struct swf *swf)
 {
-	double s_ij = lmo_s[i * fr_j->n_lmo + j];
-	double t_ij = lmo_t[i * fr_j->n_lmo + j];
+	size_t ij = i * fr_j->n_lmo + j;
+	double s_ij = lmo_s[ij];
+	double t_ij = lmo_t[ij];
 
 	const vec_t *ct_i = fr_i->lmo_centroids + i;
 	const vec_t *ct_j = fr_j->lmo_centroids + j;
@@ -449,67 +808,11 @@ lmo_lmo_xr_energy(struct frag *fr_i, struct frag *fr_j, size_t i, size_t j,
 	}
 
 	/* xr - second part */
-	for (size_t k = 0; k < fr_i->n_lmo; k++) {
-		exr -= s_ij * lmo_s[k * fr_j->n_lmo + j] *
-		    fr_i->xr_fock_mat[fock_idx(i, k)];
-	}
-	for (size_t l = 0; l < fr_j->n_lmo; l++) {
-		exr -= s_ij * lmo_s[i * fr_j->n_lmo + l] *
-		    fr_j->xr_fock_mat[fock_idx(j, l)];
-	}
+	exr -= s_ij * (pair->fs[ij] + pair->sf[ij]);
 	exr += 2.0 * s_ij * t_ij;
 
 	/* xr - third part */
-	for (size_t jj = 0; jj < fr_j->n_xr_atoms; jj++) {
-		struct xr_atom *at_j = fr_j->xr_atoms + jj;
-
-		vec_t dr_a = {
-			at_j->x - ct_i->x - swf->cell.x,
-			at_j->y - ct_i->y - swf->cell.y,
-			at_j->z - ct_i->z - swf->cell.z
-		};
-
-		double r = vec_len(&dr_a);
-
-		exr -= s_ij * s_ij * at_j->znuc / r;
-	}
-	for (size_t jj = 0; jj < fr_j->n_lmo; jj++) {
-		const vec_t *ct_jj = fr_j->lmo_centroids + jj;
-
-		vec_t dr_a = {
-			ct_jj->x - ct_i->x - swf->cell.x,
-			ct_jj->y - ct_i->y - swf->cell.y,
-			ct_jj->z - ct_i->z - swf->cell.z
-		};
-
-		double r = vec_len(&dr_a);
-		exr += 2.0 * s_ij * s_ij / r;
-	}
-	for (size_t ii = 0; ii < fr_i->n_xr_atoms; ii++) {
-		struct xr_atom *at_i = fr_i->xr_atoms + ii;
-
-		vec_t dr_a = {
-			ct_j->x - at_i->x - swf->cell.x,
-			ct_j->y - at_i->y - swf->cell.y,
-			ct_j->z - at_i->z - swf->cell.z
-		};
-
-		double r = vec_len(&dr_a);
-		exr -= s_ij * s_ij * at_i->znuc / r;
-	}
-	for (size_t ii = 0; ii < fr_i->n_lmo; ii++) {
-		const vec_t *ct_ii = fr_i->lmo_centroids + ii;
-
-		vec_t dr_a = {
-			ct_j->x - ct_ii->x - swf->cell.x,
-			ct_j->y - ct_ii->y - swf->cell.y,
-			ct_j->z - ct_ii->z - swf->cell.z
-		};
-
-		double r = vec_len(&dr_a);
-		exr += 2.0 * s_ij * s_ij / r;
-	}
-	exr -= s_ij * s_ij / r_ij;
+	exr += s_ij * s_ij * (pair->vi[i] + pair->vj[j] - 1.0 / r_ij);
 
 	return 2.0 * exr;
 }
@@ -525,12 +828,28 @@ efp_frag_frag_xr(struct efp *efp, size_t frag_i, size_t frag_j, double *lmo_s,
 	size_t ij_nlmo = fr_i->n_lmo * fr_j->n_lmo;
 	size_t ij_nlmo_wf_size = fr_i->n_lmo * fr_j->xr_wf_size;
 	double *s = (double *)malloc(ij_wf_size * sizeof(double));
-	double *t = (double *)malloc(ij_wf_size * sizeof(double));
-	double *lmo_t = (double *)malloc(ij_nlmo * sizeof(double));
+	double *t = NULL, *lmo_t = NULL;
 	double *tmp = (double *)malloc(ij_nlmo_wf_size * sizeof(double));
 	struct xr_atom *atoms_j = (struct xr_atom *)malloc(
 	    fr_j->n_xr_atoms * sizeof(struct xr_atom));
 	struct swf swf = efp_make_swf(efp, fr_i, fr_j);
+	struct xr_pair pair;
+	double *fock_i = NULL, *fock_j = NULL;
+	int do_xr = efp->opts.terms & EFP_TERM_XR;
+	const struct xr_transforms *xt = xr_transforms;
+
+	if (fr_i->xr_kernel == fr_j->xr_kernel)
+		xt = xr_transforms + fr_i->xr_kernel;
+
+	memset(&pair, 0, sizeof(pair));
+
+	/* charge penetration and overlap-based dispersion damping need only
+	 * the overlap; skip kinetic energy integrals if exchange-repulsion
+	 * is not requested */
+	if (do_xr) {
+		t = (double *)malloc(ij_wf_size * sizeof(double));
+		lmo_t = (double *)malloc(ij_nlmo * sizeof(double));
+	}
 
 	for (size_t j = 0; j < fr_j->n_xr_atoms; j++) {
 		atoms_j[j] = fr_j->xr_atoms[j];
@@ -543,14 +862,39 @@ efp_frag_frag_xr(struct efp *efp, size_t frag_i, size_t frag_j, double *lmo_s,
 		   fr_j->n_xr_atoms, atoms_j,
 		   fr_j->xr_wf_size, s, t);
 
-	transform_integrals(fr_i->n_lmo, fr_j->n_lmo,
-			    fr_i->xr_wf_size, fr_j->xr_wf_size,
-			    fr_i->xr_wf, fr_j->xr_wf,
-			    s, lmo_s, tmp);
-	transform_integrals(fr_i->n_lmo, fr_j->n_lmo,
-			    fr_i->xr_wf_size, fr_j->xr_wf_size,
-			    fr_i->xr_wf, fr_j->xr_wf,
-			    t, lmo_t, tmp);
+	xt->integrals(fr_i->n_lmo, fr_j->n_lmo, fr_i->xr_wf_size,
+	    fr_j->xr_wf_size, fr_i->xr_wf, fr_j->xr_wf, s, lmo_s, tmp);
+
+	if (do_xr) {
+		xt->integrals(fr_i->n_lmo, fr_j->n_lmo, fr_i->xr_wf_size,
+		    fr_j->xr_wf_size, fr_i->xr_wf, fr_j->xr_wf, t, lmo_t, tmp);
+
+		fock_i = (double *)malloc(fr_i->n_lmo * fr_i->n_lmo *
+		    sizeof(double));
+		fock_j = (double *)malloc(fr_j->n_lmo * fr_j->n_lmo *
+		    sizeof(double));
+		pair.fs = (double *)malloc(ij_nlmo * sizeof(double));
+		pair.sf = (double *)malloc(ij_nlmo * sizeof(double));
+		pair.vi = (double *)malloc(fr_i->n_lmo * sizeof(double));
+		pair.vj = (double *)malloc(fr_j->n_lmo * sizeof(double));
+
+		if (efp->do_gradient) {
+			pair.dvi = (six_t *)malloc(fr_i->n_lmo * sizeof(six_t));
+			pair.dvj = (six_t *)malloc(fr_j->n_lmo * sizeof(six_t));
+		}
+
+		unpack_fock(fr_i->n_lmo, fr_i->xr_fock_mat, fock_i);
+		unpack_fock(fr_j->n_lmo, fr_j->xr_fock_mat, fock_j);
+		compute_fock_overlap(fr_i, fr_j, fock_i, fock_j, lmo_s,
+		    pair.fs, pair.sf);
+
+		for (size_t i = 0; i < fr_i->n_lmo; i++)
+			pair.vi[i] = lmo_potential_i(fr_i, fr_j, i, &swf,
+			    pair.dvi ? pair.dvi + i : NULL);
+		for (size_t j = 0; j < fr_j->n_lmo; j++)
+			pair.vj[j] = lmo_potential_j(fr_i, fr_j, j, &swf,
+			    pair.dvj ? pair.dvj + j : NULL);
+	}
 
 	double exr = 0.0;
 	double ecp = 0.0;
@@ -573,9 +917,9 @@ efp_frag_frag_xr(struct efp *efp, size_t frag_i, size_t frag_j, double *lmo_s,
 			if ((efp->opts.terms & EFP_TERM_ELEC) &&
 			    (efp->opts.elec_damp == EFP_ELEC_DAMP_OVERLAP))
 				ecp += charge_penetration_energy(s_ij, r_ij);
-			if (efp->opts.terms & EFP_TERM_XR)
+			if (do_xr)
 				exr += lmo_lmo_xr_energy(fr_i, fr_j, i, j,
-				    lmo_s, lmo_t, &swf);
+				    lmo_s, lmo_t, &pair, &swf);
 		}
 	}
 
@@ -588,43 +932,71 @@ efp_frag_frag_xr(struct efp *efp, size_t frag_i, size_t frag_j, double *lmo_s,
 		free(lmo_t);
 		free(tmp);
 		free(atoms_j);
+		free(fock_i);
+		free(fock_j);
+		free(pair.fs);
+		free(pair.sf);
+		free(pair.vi);
+		free(pair.vj);
 		return;
 	}
 
 	/* compute gradient */
 
 	six_t *ds = (six_t *)malloc(ij_wf_size * sizeof(six_t));
-	six_t *dt = (six_t *)malloc(ij_wf_size * sizeof(six_t));
-	six_t *lmo_dt = (six_t *)malloc(ij_nlmo * sizeof(six_t));
-	six_t *sixtmp = (six_t *)malloc(ij_nlmo_wf_size * sizeof(six_t));
-	double *lmo_tmp = (double *)malloc(ij_nlmo * sizeof(double));
+	six_t *dt = NULL, *lmo_dt = NULL;
+	double *sixtmp = (double *)malloc(6 * (ij_nlmo_wf_size + ij_nlmo) *
+	    sizeof(double));
+	double *lmo_tmp = (double *)malloc(3 * ij_nlmo * sizeof(double));
+	double *wf_deriv = (double *)malloc(3 * fr_i->n_lmo *
+	    fr_i->xr_wf_size * sizeof(double));
+	double *rot_tmp = (double *)malloc(fr_j->n_lmo * fr_i->xr_wf_size *
+	    sizeof(double));
+
+	if (do_xr) {
+		dt = (six_t *)malloc(ij_wf_size * sizeof(six_t));
+		lmo_dt = (six_t *)malloc(ij_nlmo * sizeof(six_t));
+	}
 
 	efp_st_int_deriv(fr_i->n_xr_atoms, fr_i->xr_atoms,
 			 fr_j->n_xr_atoms, atoms_j,
 			 VEC(fr_i->x), fr_i->xr_wf_size, fr_j->xr_wf_size,
 			 ds, dt);
 
-	transform_integral_derivatives(fr_i->n_lmo, fr_j->n_lmo,
-				       fr_i->xr_wf_size, fr_j->xr_wf_size,
-				       fr_i->xr_wf, fr_j->xr_wf,
-				       ds, lmo_ds, sixtmp);
-	transform_integral_derivatives(fr_i->n_lmo, fr_j->n_lmo,
-				       fr_i->xr_wf_size, fr_j->xr_wf_size,
-				       fr_i->xr_wf, fr_j->xr_wf,
-				       dt, lmo_dt, sixtmp);
+	xt->integral_derivatives(fr_i->n_lmo, fr_j->n_lmo, fr_i->xr_wf_size,
+	    fr_j->xr_wf_size, fr_i->xr_wf, fr_j->xr_wf, ds, lmo_ds, sixtmp);
 
-	for (size_t a = 0; a < 3; a++) {
-		transform_integrals(fr_i->n_lmo, fr_j->n_lmo,
-				    fr_i->xr_wf_size, fr_j->xr_wf_size,
-				    fr_i->xr_wf_deriv[a], fr_j->xr_wf,
-				    s, lmo_tmp, tmp);
-		add_six_vec(3 + a, fr_i->n_lmo * fr_j->n_lmo, lmo_tmp, lmo_ds);
-
-		transform_integrals(fr_i->n_lmo, fr_j->n_lmo,
-				    fr_i->xr_wf_size, fr_j->xr_wf_size,
-				    fr_i->xr_wf_deriv[a], fr_j->xr_wf,
-				    t, lmo_tmp, tmp);
-		add_six_vec(3 + a, fr_i->n_lmo * fr_j->n_lmo, lmo_tmp, lmo_dt);
+	if (do_xr)
+		xt->integral_derivatives(fr_i->n_lmo, fr_j->n_lmo,
+		    fr_i->xr_wf_size, fr_j->xr_wf_size, fr_i->xr_wf,
+		    fr_j->xr_wf, dt, lmo_dt, sixtmp);
+
+	/* rotational part: derivatives of the rotated wavefunction of
+	 * fragment i are generated from its coefficients on the fly */
+	wf_rot_deriv(fr_i, wf_deriv);
+
+	xt->rot_derivatives(fr_i->n_lmo, fr_j->n_lmo, fr_i->xr_wf_size,
+	    fr_j->xr_wf_size, wf_deriv, fr_j->xr_wf, s, lmo_tmp, rot_tmp);
+
+	for (size_t a = 0; a < 3; a++)
+		add_six_vec(3 + a, ij_nlmo, lmo_tmp + a * ij_nlmo, lmo_ds);
+
+	if (do_xr) {
+		xt->rot_derivatives(fr_i->n_lmo, fr_j->n_lmo,
+		    fr_i->xr_wf_size, fr_j->xr_wf_size, wf_deriv, fr_j->xr_wf,
+		    t, lmo_tmp, rot_tmp);
+
+		for (size_t a = 0; a < 3; a++)
+			add_six_vec(3 + a, ij_nlmo, lmo_tmp + a * ij_nlmo,
+			    lmo_dt);
+	}
+
+	if (do_xr) {
+		pair.dfs = (six_t *)malloc(ij_nlmo * sizeof(six_t));
+		pair.dsf = (six_t *)malloc(ij_nlmo * sizeof(six_t));
+
+		compute_fock_overlap_deriv(fr_i, fr_j, fock_i, fock_j, lmo_ds,
+		    pair.dfs, pair.dsf);
 	}
 
 	for (size_t i = 0, idx = 0; i < fr_i->n_lmo; i++) {
@@ -635,9 +1007,9 @@ efp_frag_frag_xr(struct efp *efp, size_t frag_i, size_t frag_j, double *lmo_s,
 			    (efp->opts.elec_damp == EFP_ELEC_DAMP_OVERLAP))
 				charge_penetration_grad(efp, frag_i, frag_j,
 				    i, j, lmo_s[ij], lmo_ds[ij], &swf);
-			if (efp->opts.terms & EFP_TERM_XR)
+			if (do_xr)
 				lmo_lmo_xr_grad(efp, frag_i, frag_j, i, j,
-				    lmo_s, lmo_t, lmo_ds, lmo_dt, &swf);
+				    lmo_s, lmo_t, lmo_ds, lmo_dt, &pair, &swf);
 		}
 	}
 
@@ -649,7 +1021,7 @@ efp_frag_frag_xr(struct efp *efp, size_t frag_i, size_t frag_j, double *lmo_s,
 
 	six_atomic_add_xyz(efp->grad + frag_i, &force);
 	six_atomic_sub_xyz(efp->grad + frag_j, &force);
-	efp_add_stress(&swf.dr, &force, &efp->stress);
+	efp_add_stress(efp, frag_i, &swf.dr, &force);
 
 	free(s);
 	free(ds);
@@ -658,9 +1030,21 @@ efp_frag_frag_xr(struct efp *efp, size_t frag_i, size_t frag_j, double *lmo_s,
 	free(lmo_t);
 	free(lmo_dt);
 	free(lmo_tmp);
+	free(wf_deriv);
+	free(rot_tmp);
 	free(tmp);
 	free(sixtmp);
 	free(atoms_j);
+	free(fock_i);
+	free(fock_j);
+	free(pair.fs);
+	free(pair.sf);
+	free(pair.dfs);
+	free(pair.dsf);
+	free(pair.vi);
+	free(pair.vj);
+	free(pair.dvi);
+	free(pair.dvj);
 }
 
 static inline size_t
@@ -759,104 +1143,38 @@ rotate_func_f(const mat_t *rotmat, const double *in, double *out)
 }
 
 static void
-coef_deriv_p(size_t axis, const double *coef, double *der)
+rotate_func_p(const mat_t *rotmat, const double *in, double *out)
 {
-	switch (axis) {
-	case 0:
-		der[0] = 0.0;
-		der[1] = coef[2];
-		der[2] = -coef[1];
-		break;
-	case 1:
-		der[0] = -coef[2];
-		der[1] = 0.0;
-		der[2] = coef[0];
-		break;
-	case 2:
-		der[0] = coef[1];
-		der[1] = -coef[0];
-		der[2] = 0.0;
-		break;
-	};
+	vec_t r = mat_vec(rotmat, (const vec_t *)in);
+
+	out[0] = r.x;
+	out[1] = r.y;
+	out[2] = r.z;
 }
 
+/* Rotation of a shell of n functions as a column-major n x n block. */
 static void
-coef_deriv_d(size_t axis, const double *coef, double *der)
+build_shell_rot(const mat_t *rotmat, size_t n,
+    void (*rotate_fn)(const mat_t *, const double *, double *), double *rot)
 {
-	const double sqrt3 = sqrt(3.0);
+	double unit[10];
 
-	switch (axis) {
-	case 0:
-		der[0] = 0.0;
-		der[1] = sqrt3 * coef[5];
-		der[2] = -sqrt3 * coef[5];
-		der[3] = coef[4];
-		der[4] = -coef[3];
-		der[5] = 2.0 / sqrt3 * (coef[2] - coef[1]);
-		break;
-	case 1:
-		der[0] = -sqrt3 * coef[4];
-		der[1] = 0.0;
-		der[2] = sqrt3 * coef[4];
-		der[3] = -coef[5];
-		der[4] = 2.0 / sqrt3 * (coef[0] - coef[2]);
-		der[5] = coef[3];
-		break;
-	case 2:
-		der[0] = sqrt3 * coef[3];
-		der[1] = -sqrt3 * coef[3];
-		der[2] = 0.0;
-		der[3] = 2.0 / sqrt3 * (coef[1] - coef[0]);
-		der[4] = coef[5];
-		der[5] = -coef[4];
-		break;
-	};
+	for (size_t j = 0; j < n; j++) {
+		for (size_t i = 0; i < n; i++)
+			unit[i] = i == j ? 1.0 : 0.0;
+
+		rotate_fn(rotmat, unit, rot + j * n);
+	}
 }
 
 static void
-coef_deriv_f(size_t axis, const double *coef, double *der)
+apply_shell_rot(struct frag *frag, size_t n, double *rot, size_t func)
 {
-	const double sqrt3 = sqrt(3.0);
-	const double sqrt5 = sqrt(5.0);
+	size_t ld = frag->xr_wf_size;
 
-	switch (axis) {
-	case 0:
-		der[0] = 0.0;
-		der[1] = sqrt5 * coef[6];
-		der[2] = -sqrt5 * coef[8];
-		der[3] = coef[4];
-		der[4] = -coef[3];
-		der[5] = sqrt3 * coef[9];
-		der[6] = -3.0 / sqrt5 * coef[1] + 2.0 * coef[8];
-		der[7] = -sqrt3 * coef[9];
-		der[8] = 3.0 / sqrt5 * coef[2] - 2.0 * coef[6];
-		der[9] = 2.0 / sqrt3 * (coef[7] - coef[5]);
-		break;
-	case 1:
-		der[0] = -sqrt5 * coef[4];
-		der[1] = 0.0;
-		der[2] = sqrt5 * coef[7];
-		der[3] = -sqrt3 * coef[9];
-		der[4] = 3.0 / sqrt5 * coef[0] - 2.0 * coef[7];
-		der[5] = -coef[6];
-		der[6] = coef[5];
-		der[7] = -3.0 / sqrt5 * coef[2] + 2.0 * coef[4];
-		der[8] = sqrt3 * coef[9];
-		der[9] = 2.0 / sqrt3 * (coef[3] - coef[8]);
-		break;
-	case 2:
-		der[0] = sqrt5 * coef[3];
-		der[1] = -sqrt5 * coef[5];
-		der[2] = 0.0;
-		der[3] = -3.0 / sqrt5 * coef[0] + 2.0 * coef[5];
-		der[4] = sqrt3 * coef[9];
-		der[5] = 3.0 / sqrt5 * coef[1] - 2.0 * coef[3];
-		der[6] = -sqrt3 * coef[9];
-		der[7] = coef[8];
-		der[8] = -coef[7];
-		der[9] = 2.0 / sqrt3 * (coef[6] - coef[4]);
-		break;
-	};
+	/* all LMOs at once: columns of the wavefunction are LMOs */
+	small_dgemm('N', 'N', n, frag->n_lmo, n, rot, n,
+	    frag->lib->xr_wf + func, ld, frag->xr_wf + func, ld);
 }
 
 void
@@ -874,59 +1192,51 @@ efp_update_xr(struct frag *frag)
 		efp_move_pt(CVEC(frag->x), rotmat,
 		    CVEC(frag->lib->xr_atoms[i].x), VEC(frag->xr_atoms[i].x));
 	}
-	/* rotate wavefunction */
-	for (size_t k = 0; k < frag->n_lmo; k++) {
-		double *deriv[3];
-
-		for (size_t a = 0; a < 3; a++)
-			deriv[a] = frag->xr_wf_deriv[a] + k * frag->xr_wf_size;
+	/* shared wavefunctions are rotated by all processes of a node
+	 * together before computation */
+	if (!frag->shared)
+		efp_update_xr_wf(frag);
+}
 
-		const double *in = frag->lib->xr_wf + k * frag->xr_wf_size;
-		double *out = frag->xr_wf + k * frag->xr_wf_size;
+void
+efp_update_xr_wf(struct frag *frag)
+{
+	const mat_t *rotmat = &frag->rotmat;
+	double rot_p[3 * 3], rot_d[6 * 6], rot_f[10 * 10];
 
-		for (size_t j = 0, func = 0; j < frag->n_xr_atoms; j++) {
-			const struct xr_atom *atom = frag->xr_atoms + j;
+	if (frag->n_lmo == 0)
+		return;
 
-			for (size_t i = 0; i < atom->n_shells; i++) {
-				switch (atom->shells[i].type) {
-				case 'S':
-					func++;
-					break;
-				case 'L':
-					func++;
-					/* fall through */
-				case 'P': {
-					vec_t r = mat_vec(rotmat,
-					    (const vec_t *)(in + func));
-					out[func + 0] = r.x;
-					out[func + 1] = r.y;
-					out[func + 2] = r.z;
-					for (size_t a = 0; a < 3; a++) {
-						coef_deriv_p(a, out + func,
-						    deriv[a] + func);
-					}
-					func += 3;
-					break;
-				}
-				case 'D':
-					rotate_func_d(rotmat, in + func,
-					    out + func);
-					for (size_t a = 0; a < 3; a++) {
-						coef_deriv_d(a, out + func,
-						    deriv[a] + func);
-					}
-					func += 6;
-					break;
-				case 'F':
-					rotate_func_f(rotmat, in + func,
-					    out + func);
-					for (size_t a = 0; a < 3; a++) {
-						coef_deriv_f(a, out + func,
-						    deriv[a] + func);
-					}
-					func += 10;
-					break;
-				}
+	/* rotate wavefunction: S functions are invariant, P, D, and F shells
+	 * are transformed by blocks which depend only on the orientation and
+	 * are applied to all LMOs with a single product per shell */
+	build_shell_rot(rotmat, 3, rotate_func_p, rot_p);
+	build_shell_rot(rotmat, 6, rotate_func_d, rot_d);
+	build_shell_rot(rotmat, 10, rotate_func_f, rot_f);
+
+	for (size_t j = 0, func = 0; j < frag->n_xr_atoms; j++) {
+		const struct xr_atom *atom = frag->xr_atoms + j;
+
+		for (size_t i = 0; i < atom->n_shells; i++) {
+			switch (atom->shells[i].type) {
+			case 'S':
+				func++;
+				break;
+			case 'L':
+				func++;
+				/* fall through */
+			case 'P':
+				apply_shell_rot(frag, 3, rot_p, func);
+				func += 3;
+				break;
+			case 'D':
+				apply_shell_rot(frag, 6, rot_d, func);
+				func += 6;
+				break;
+			case 'F':
+				apply_shell_rot(frag, 10, rot_f, func);
+				func += 10;
+				break;
 			}
 		}
 	}